@@ -30,6 +30,11 @@ struct u_class_block {
 	char name[MAXCLASSNAME+1];
 	int timeout;
 	int sendq;
+	/* how large a server link's input buffer may grow */
+	int recvq;
+	/* see ratelimit.h */
+	int flood_burst;
+	int flood_rate;
 };
 
 struct u_auth_block {
@@ -47,6 +52,8 @@ struct u_oper_block {
 	char pubkey[MAXPUBKEY+1];
 	unsigned char challenge[MAXCHALLENGE];
 	time_t challenge_time;
+	/* wipes the challenge when it expires */
+	u_timer challenge_timer;
 	char authname[MAXAUTHNAME+1];
 	u_auth_block *auth;
 };
@@ -39,6 +39,9 @@
 typedef struct u_chan u_chan;
 typedef struct u_chanuser u_chanuser;
 typedef struct u_cu_pfx u_cu_pfx;
+typedef struct u_invite u_invite;
+typedef struct u_chan_link u_chan_link;
+typedef struct u_chan_caplist u_chan_caplist;
 
 #include "chan.h"
 #include "user.h"
@@ -57,6 +60,36 @@ struct u_chan {
 	u_map *invites;
 	char *forward, *key;
 	int limit;
+
+	/* Who messages to the channel go to: the local members, and the
+	   server links with members behind them. These are what
+	   u_sendto_chan walks, so a big channel with few local users
+	   costs little to send to. Neither is in any order. */
+	u_chanuser **local;
+	uint nlocal, local_size;
+	/* While a sendto job is going through local (see u_sendto_slice),
+	   it's held, and members who leave leave a NULL behind instead of
+	   having the last one moved into their place. nlocal_dead counts
+	   those; they're swept out when the last hold is let go. */
+	uint holds, nlocal_dead;
+	u_chan_link *links;
+	uint nlinks, links_size;
+
+	/* with enough local members, they're also kept as a bitset over
+	   link slots, for u_sendto_visible to merge. NULL otherwise. */
+	uint64_t *bits;
+	uint nwords;
+
+	/* the local members with each cap in CAP_MASK_FANOUT */
+	struct u_chan_caplist {
+		u_chanuser **cu;
+		uint n, size;
+	} caplist[U_CAP_LISTS];
+};
+
+struct u_chan_link {
+	u_link *link;
+	uint members;
 };
 
 struct u_chanuser {
@@ -64,6 +97,12 @@ struct u_chanuser {
 	u_cookie ck_flags;
 	u_chan *c;
 	u_user *u;
+	/* where the chanuser is in c->local and c->caplist, if the user
+	   is local */
+	uint local_idx;
+	uint cap_idx[U_CAP_LISTS];
+	/* the last sendto job that's been to this member */
+	uint64_t job_seq;
 };
 
 struct u_cu_pfx {
@@ -93,6 +132,17 @@ extern u_chan *u_chan_create(char*);
 extern u_chan *u_chan_get_or_create(char*, bool *created);
 extern void u_chan_drop(u_chan*);
 
+/* how long an invite lasts, in seconds */
+#define U_INVITE_EXPIRE (60*60)
+
+/* an entry in both c->invites, keyed by the user, and u->invites, keyed
+   by the channel */
+struct u_invite {
+	u_chan *c;
+	u_user *u;
+	u_timer timer;
+};
+
 extern char *u_chan_modes(u_chan*, int un_chan);
 
 extern int u_chan_mode_register(u_mode_info*, ulong *mask);
@@ -110,6 +160,11 @@ extern void u_clr_invites_chan(u_chan*);
 extern void u_clr_invites_user(u_user*);
 
 extern u_chanuser *u_chan_user_add(u_chan*, u_user*);
+/* moves a local user between the caplists of their channels, after
+   their caps have changed from old */
+extern void u_chan_user_caps_changed(u_user*, uint old);
+extern void u_chan_hold_local(u_chan*);
+extern void u_chan_release_local(u_chan*);
 extern void u_chan_user_del(u_chanuser*);
 extern u_chanuser *u_chan_user_find(u_chan*, u_user*);
 
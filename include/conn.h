@@ -12,6 +12,7 @@
 typedef struct u_conn_ctx u_conn_ctx;
 typedef enum u_conn_state u_conn_state;
 typedef struct u_conn u_conn;
+typedef struct u_io_conn u_io_conn;
 
 struct u_conn_ctx {
 	void (*attach)(u_conn*);
@@ -28,6 +29,16 @@ struct u_conn_ctx {
 	void (*end_of_stream)(u_conn*);
 	void (*rdns_start)(u_conn*);
 	void (*rdns_finish)(u_conn*, const char*);
+
+	/* Only contexts with line_ready can be read by I/O workers. Then,
+	   line_ready is called instead of data_ready, with one line at a
+	   time. excess_flood: a line didn't fit the worker's buffer.
+	   data_returned: input that was read but not delivered, as the
+	   worker hands the connection back. */
+
+	void (*line_ready)(u_conn*, char *line);
+	void (*excess_flood)(u_conn*);
+	void (*data_returned)(u_conn*, const uchar*, size_t);
 };
 
 enum u_conn_state {
@@ -60,10 +71,33 @@ struct u_conn {
 	mowgli_eventloop_pollable_t *poll;
 	char ip[INET6_ADDRSTRLEN];
 	char host[U_CONN_HOSTSIZE];
-	mowgli_dns_query_t *dnsq;
+	u_rdns_query *rdnsq;
 
 	u_sendq sendq;
 
+	/* set when data has been queued and not yet flushed */
+	bool dirty;
+	mowgli_node_t dirty_n;
+
+	/* non-NULL while an I/O worker reads for us */
+	u_io_conn *io;
+	/* the most a worker buffers for us, see u_io_set_recvq */
+	size_t recvq;
+
+	/* set when the socket is readable and the io_uring batch hasn't
+	   read it yet */
+	bool readable;
+	mowgli_node_t readable_n;
+
+	/* input read by the io_uring batch, which u_conn_recv hands out
+	   during data_ready instead of calling read() */
+	bool rpending;
+	const uchar *rdata;
+	ssize_t rlen;
+
+	/* set while the context wants nothing more read */
+	bool recv_held;
+
 	u_conn_ctx *ctx;
 	void *priv;
 };
@@ -76,15 +110,41 @@ extern u_conn *u_conn_connect(mowgli_eventloop_t*, u_conn_ctx*, void*,
 
 extern void u_conn_shut_down(u_conn*);
 
+/* while held, the socket isn't read from, and input waits in the kernel.
+   Input from I/O workers still arrives. */
+extern void u_conn_hold_recv(u_conn*, bool hold);
+
+/* returns -1 with errno set to EAGAIN once there is nothing left to
+   read. Other errors and end of stream shut the connection down. */
 extern ssize_t u_conn_recv(u_conn*, uchar*, size_t sz);
 extern ssize_t u_conn_send(u_conn*, const uchar*, size_t sz);
+extern ssize_t u_conn_sendv(u_conn*, const struct iovec*, int iovcnt);
+
+/* appends data without copying it; see u_sendq_put_ref. If the data
+   cannot be queued, release(priv) is called immediately. */
+extern ssize_t u_conn_send_ref(u_conn*, const uchar*, size_t sz,
+                               u_sendq_release_fn *release, void *priv);
 
 /* to allow vsnf, sprintf, etc. directly into the send queue */
 extern uchar *u_conn_get_send_buffer(u_conn*, size_t sz);
 extern size_t u_conn_end_send_buffer(u_conn*, size_t sz);
 
+/* appends a shared buffer by reference, taking a new reference to it */
+extern size_t u_conn_put_send_buf(u_conn*, u_sendq_buf*);
+
 extern void u_conn_sendq_clear(u_conn*);
 
+/* events from I/O workers, see iothread.c */
+extern void u_conn_io_line(u_conn*, char *line);
+extern void u_conn_io_error(u_conn*, int err);
+extern void u_conn_io_flood(u_conn*);
+extern void u_conn_io_returned(u_conn*, const uchar*, size_t);
+extern void u_conn_io_detached(u_conn*, const uchar*, size_t);
+
+/* called by u_conn_run after each round of events. If it returns true,
+   it has work left over, and the next round doesn't wait for events. */
+extern bool (*u_conn_after_events)(void);
+
 extern void u_conn_run(mowgli_eventloop_t *ev);
 
 extern int init_conn(void);
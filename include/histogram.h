@@ -0,0 +1,42 @@
+/* Tethys, histogram.h -- log-linear latency histograms
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_HISTOGRAM_H__
+#define __INC_HISTOGRAM_H__
+
+typedef struct u_histogram u_histogram;
+
+/* Each power of two is split into 2^U_HIST_SUB_BITS equal buckets, so a
+   bucket is never more than 1/8 wider than the values in it. Values are
+   usually microseconds, and anything past 2^U_HIST_MAX_BITS (about 12
+   days) lands in the last bucket. */
+#define U_HIST_SUB_BITS    3
+#define U_HIST_MAX_BITS    40
+#define U_HIST_BUCKETS     ((U_HIST_MAX_BITS - U_HIST_SUB_BITS + 1) \
+                            << U_HIST_SUB_BITS)
+
+struct u_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[U_HIST_BUCKETS];
+};
+
+extern void u_hist_add(u_histogram*, uint64_t v);
+extern void u_hist_clear(u_histogram*);
+
+/* an upper bound on the value below which p percent of samples fall */
+extern uint64_t u_hist_percentile(u_histogram*, int p);
+
+extern mowgli_json_t *u_hist_to_json(u_histogram*);
+extern int u_hist_from_json(mowgli_json_t*, u_histogram*);
+
+/* microseconds on a clock that doesn't jump, and that carries on across
+   an upgrade */
+extern uint64_t u_mono_usec(void);
+extern uint64_t u_mono_nsec(void);
+
+#endif
@@ -0,0 +1,40 @@
+/* Tethys, iothread.h -- I/O worker threads
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_IOTHREAD_H__
+#define __INC_IOTHREAD_H__
+
+/* below this many connections to flush, the main thread writes them out
+   itself rather than waking up the workers */
+#define U_IO_FLUSH_MIN 16
+
+/* true if I/O workers are running */
+extern bool u_io_enabled(void);
+
+/* hands reading of an active connection to one of the workers. Framed
+   lines come back through the connection's line_ready callback. */
+extern void u_io_attach(u_conn*);
+
+/* sets how much input the connection's worker may buffer while waiting
+   for a line ending. This is kept whether or not it's attached. */
+extern void u_io_set_recvq(u_conn*, size_t max);
+
+/* asks the worker to let go of the connection. This completes
+   asynchronously, with u_conn_io_detached */
+extern void u_io_detach(u_conn*);
+
+/* writes out the send queues of the given attached connections on their
+   workers, and waits until all of them are done. results[i] is set to
+   what writev() returned for conns[i], or to -errno. */
+extern void u_io_flush(u_conn **conns, ssize_t *results, int count);
+
+/* stops all workers and hands every connection back to the main thread,
+   including any input that was read but not delivered yet */
+extern void u_io_stop(void);
+
+extern int init_iothread(void);
+
+#endif
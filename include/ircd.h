@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <errno.h>
 #include <dirent.h>
@@ -73,9 +74,14 @@ typedef time_t u_ts_t;
 #include "conf.h"
 #include "cookie.h"
 #include "crypto.h"
+#include "histogram.h"
+#include "linescan.h"
 #include "map.h"
 #include "strop.h"
 #include "sendq.h"
+#include "uidmap.h"
+#include "wheel.h"
+#include "rdns.h"
 #include "upgrade.h"
 #include "version.h"
 #include "vsnf.h"
@@ -87,6 +93,7 @@ typedef time_t u_ts_t;
 #include "chan.h"
 #include "conn.h"
 #include "hook.h"
+#include "iothread.h"
 #include "link.h"
 #include "mode.h"
 #include "module.h"
@@ -94,6 +101,7 @@ typedef time_t u_ts_t;
 #include "ratelimit.h"
 #include "sendto.h"
 #include "server.h"
+#include "uring.h"
 #include "user.h"
 #include "util.h"
 
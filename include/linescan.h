@@ -0,0 +1,30 @@
+/* Tethys, linescan.h -- finding line boundaries in input
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_LINESCAN_H__
+#define __INC_LINESCAN_H__
+
+typedef struct u_line_span u_line_span;
+
+/* A line runs from off up to the first \r or \n, and is len bytes long.
+   The whole run of \r and \n after it is part of the line too, and the
+   next line starts at end. */
+struct u_line_span {
+	size_t off;
+	size_t len;
+	size_t end;
+};
+
+/* Finds up to max complete lines in the n bytes at p, in a single pass,
+   and returns how many it found. Input after the last line ending is
+   left alone. A run of line endings that reaches the end of the input
+   ends at n. */
+extern int u_linescan(const uchar *p, size_t n, u_line_span *spans, int max);
+
+/* which implementation u_linescan uses, for the curious */
+extern const char *u_linescan_impl(void);
+
+#endif
@@ -10,6 +10,7 @@
 typedef enum u_link_type u_link_type;
 typedef struct u_link u_link;
 typedef struct u_link_origin u_link_origin;
+typedef struct u_link_regtime u_link_regtime;
 
 #include "conn.h"
 
@@ -19,7 +20,7 @@ enum u_link_type {
 	LINK_SERVER,
 };
 
-/* of these, only RDNS is currently used */
+/* of these, only RDNS and FLOOD are currently used */
 #define U_LINK_WAIT_RDNS         0x0001
 #define U_LINK_WAIT_IDENTD       0x0002
 #define U_LINK_WAIT_PING_COOKIE  0x0004
@@ -29,9 +30,35 @@ enum u_link_type {
 #define U_LINK_SENT_QUIT         0x0010
 #define U_LINK_REGISTERED        0x0020
 #define U_LINK_SENT_PASS         0x0040
+#define U_LINK_SENT_PING         0x0080
 
+/* input buffer size for new links, and the most a user link gets */
 #define IBUFSIZE 2048
 
+/* default limit for server links, which grow their input buffers to
+   take a burst in large reads */
+#define U_LINK_SERVER_RECVQ (256<<10)
+
+/* how much is read from one link before going back to the event loop */
+#define U_LINK_READ_BUDGET (64<<10)
+
+/* default limits on the lines one link runs per turn, see
+   u_link_run_input. The time budget is in microseconds. */
+#define U_LINK_LINE_BUDGET        16
+#define U_LINK_SERVER_LINE_BUDGET 512
+#define U_LINK_TIME_BUDGET        2000
+
+/* seconds a link gets to register before it's dropped */
+#define U_LINK_REG_TIMEOUT 60
+
+/* when each phase of registration started and ended, from u_mono_usec.
+   zero means it hasn't happened */
+struct u_link_regtime {
+	uint64_t accept;
+	uint64_t rdns_start, rdns_end;
+	uint64_t caps_start, caps_end;
+};
+
 struct u_link {
 	u_conn *conn;
 
@@ -46,8 +73,13 @@ struct u_link {
 	} conf;
 	int sendq;
 
-	uchar ibuf[IBUFSIZE+1];
-	size_t ibuflen;
+	/* Input ring buffer. ibuflen bytes of input start at ibufhead and
+	 * wrap around at ibufsize. The buffer grows up to ibufmax when it
+	 * fills up, and has one byte to spare at the end.
+	 */
+	uchar *ibuf;
+	size_t ibufsize, ibufmax;
+	size_t ibufhead, ibuflen;
 
 	/* This indicates that X bytes should be skipped in ibuf when serializing
 	 * ibuf to do an upgrade. This is necessary to prevent the UPGRADE command
@@ -56,10 +88,40 @@ struct u_link {
 	size_t ibufskip;
 
 	u_cookie ck_sendto;
+
+	u_link_regtime reg;
+
+	/* set while the link is in the input run queue, with when it was
+	   put there. run_lines counts the lines run during input round
+	   run_round. */
+	bool runq;
+	mowgli_node_t runq_n;
+	uint64_t runq_since;
+	uint run_round, run_lines;
+
+	/* the registration timeout, and then the ping check. last_input is
+	   when the link last sent anything, in u_timers ticks. */
+	u_timer timer;
+	uint ping_freq;
+	uint64_t last_input;
+
+	/* a small number of its own, for bitsets of links. See
+	   u_link_slots. */
+	uint slot;
 };
 
+/* time links spent in the run queue before their turn, in microseconds */
+extern u_histogram input_delay;
+/* turns that ended with lines left over */
+extern uint64_t input_deferred;
+
 extern u_conn_ctx u_link_conn_ctx;
 
+/* every link, by its slot. Freed slots are NULL until they're given
+   out again, and u_link_nslots is the most that have been in use. */
+extern u_link **u_link_slots;
+extern uint u_link_nslots;
+
 extern u_link *u_link_connect(mowgli_eventloop_t*, u_link_block*,
                               const struct sockaddr*, socklen_t);
 extern void u_link_close(u_link *link);
@@ -67,11 +129,29 @@ extern void u_link_fatal(u_link *link, const char *msg);
 
 extern void u_link_vf(u_link *link, const char *fmt, va_list va);
 extern void u_link_f(u_link *link, const char *fmt, ...);
+extern void u_link_put_buf(u_link *link, u_sendq_buf *buf);
+extern void u_link_sendv(u_link *link, const struct iovec *iov, int iovcnt);
+extern void u_link_send_line(u_link *link, const char *line);
 
 extern void u_link_vnum(u_link *link, const char *tgt, int num, va_list va);
 extern int u_link_num(u_link *link, int num, ...);
 extern void u_link_flush_input(u_link *link);
 
+/* stops, or starts again, reading and running the link's input */
+extern void u_link_hold_input(u_link *link, bool hold);
+
+/* gives every link in the run queue a turn. Returns true if some still
+   have lines to run. */
+extern bool u_link_run_input(void);
+
+/* starts checking that a link which has just registered is still
+   there. After freq seconds without input it's sent a PING, and after
+   another freq it's dropped. */
+extern void u_link_set_ping(u_link *link, uint freq);
+
+/* lets the link's input buffer grow to max bytes */
+extern void u_link_set_recvq(u_link *link, size_t max);
+
 extern int u_link_origin_create(mowgli_eventloop_t*, ushort);
 
 extern int init_link(void);
@@ -22,10 +22,15 @@ struct hook_log {
 	char *line;
 };
 
+/* called from the log writer thread once init_log has run */
 extern int (*u_log_handler)(int level, char *time, char *line /* no EOL */);
 extern int u_log_level;
+extern uint64_t u_log_dropped; /* lines lost to a full ring */
 
+/* only from the main thread */
 extern int u_log(int level, char *fmt, ...);
+/* waits until everything logged so far has been written */
+extern void u_log_flush(void);
 
 extern void u_perror_real(const char *func, const char *s);
 #define u_perror(s) u_perror_real(__func__, s)
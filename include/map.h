@@ -9,20 +9,28 @@
 
 typedef struct u_map u_map;
 typedef struct u_map_n u_map_n; /* defined internally */
+typedef struct u_map_h u_map_h; /* defined internally */
 
+/* Maps are AA trees by default. MAP_HASH makes a map an open-addressing
+   hash table instead, which finds a key in a probe or two of one array
+   rather than a walk down separately allocated nodes. It only applies
+   to pointer keys, and has no order. */
 #define MAP_STRING_KEYS 1
+#define MAP_HASH        2
 
 struct u_map {
 	int iterdepth;
 	uint flags;
 	u_map_n *root;
+	u_map_h *slots;
+	uint mask, used; /* used counts entries still waiting on deletion */
 	uint size;
 	mowgli_list_t pending;
 };
 
 typedef void (u_map_cb_t)(u_map*, void *k, void *v, void *priv);
 
-extern u_map *u_map_new(int string_keys);
+extern u_map *u_map_new(uint flags);
 extern void u_map_free(u_map*);
 extern void u_map_each(u_map*, u_map_cb_t*, void *priv);
 extern void *u_map_get(u_map*, void *key);
@@ -35,6 +43,7 @@ typedef struct u_map_each_state u_map_each_state;
 struct u_map_each_state {
 	u_map *map;
 	mowgli_list_t list;
+	uint i;
 };
 
 extern void u_map_each_start(u_map_each_state*, u_map*);
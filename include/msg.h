@@ -7,8 +7,11 @@
 #ifndef __INC_MSG_H__
 #define __INC_MSG_H__
 
+typedef struct u_span u_span;
+typedef struct u_msg_spans u_msg_spans;
 typedef struct u_msg u_msg;
 typedef struct u_cmd u_cmd;
+typedef struct u_cmd_stats u_cmd_stats;
 typedef struct u_sourceinfo u_sourceinfo;
 
 #include "module.h"
@@ -16,8 +19,30 @@ typedef struct u_sourceinfo u_sourceinfo;
 /* from jilles' ts6.txt */
 #define U_MSG_MAXARGS 15
 
+#define MAXCOMMANDLEN 16
+
 #define MSG_REPEAT 0x0001
 
+/* a piece of a line, not NUL terminated */
+struct u_span {
+	const char *p;
+	size_t len;
+};
+
+/* the pieces of a message, as they are in the line. Pieces that aren't
+   there have a NULL p */
+struct u_msg_spans {
+	u_span tags;      /* IRCv3 message tags, without the @ */
+	u_span src;       /* without the : */
+	u_span command;
+
+	u_span argv[U_MSG_MAXARGS];
+	int argc;
+
+	/* the command in upper case, or "" if it's too long to be one */
+	char cmd[MAXCOMMANDLEN+1];
+};
+
 struct u_msg {
 	char *srcstr;
 
@@ -28,9 +53,20 @@ struct u_msg {
 
 	ulong flags;
 	char *propagate;
+
+	/* what the fields above point into */
+	u_msg_spans spans;
 };
 
-/* the parser will modify the string */
+/* finds the pieces of the line without modifying it */
+extern int u_msg_scan(u_msg_spans*, const char *line);
+
+/* finds a message tag. The value is empty if the tag has none, and
+   hasn't been unescaped */
+extern bool u_msg_tag(u_msg_spans*, const char *key, u_span *value);
+
+/* scans the line, then terminates the pieces in place for the fields of
+   u_msg. the parser will modify the string */
 extern int u_msg_parse(u_msg*, char*);
 
 /* source mask bits */
@@ -97,8 +133,6 @@ struct u_sourceinfo {
 extern int u_src_num(u_sourceinfo *si, int num, ...);
 extern void u_src_f(u_sourceinfo *si, const char *fmt, ...);
 
-#define MAXCOMMANDLEN 16
-
 /* command flags */
 #define CMD_PROP_MASK          0x0003
 #define CMD_PROP_NONE          0x0000
@@ -108,6 +142,14 @@ extern void u_src_f(u_sourceinfo *si, const char *fmt, ...);
 
 #define CMD_DO_BROADCAST ((void*)1)
 
+/* kept by the command table, and never freed, so that they're still
+   there if a handler unloads its own module, and across reloads */
+struct u_cmd_stats {
+	uint64_t runs;
+	uint sample_left;
+	u_histogram hist; /* nanoseconds, of the runs that were timed */
+};
+
 struct u_cmd {
 	char name[MAXCOMMANDLEN+1];
 	/* The 'mask' field here specifies which types of source to
@@ -130,8 +172,9 @@ struct u_cmd {
 	   anything */
 	u_module *owner;
 	bool loaded;
+	int id;
 	struct u_cmd *next, *prev;
-	int runs, usecs;
+	u_cmd_stats *stats;
 };
 
 extern mowgli_patricia_t *all_commands;
@@ -139,6 +182,15 @@ extern mowgli_patricia_t *all_commands;
 extern int u_cmds_reg(u_cmd*); /* terminated with empty name */
 extern int u_cmd_reg(u_cmd*); /* single command */
 extern void u_cmd_unreg(u_cmd*);
+
+/* the ID of the commands with this name, or -1 if nothing has ever
+   registered it. IDs are small, and stay the same until the server
+   restarts, even if the commands are unloaded */
+extern int u_cmd_id(const char *name);
+
+/* handlers are timed once in this many runs */
+extern int u_cmd_sample;
+extern void u_cmd_stats_reset(void);
 extern void u_cmd_invoke(u_link*, u_msg*, char *line);
 
 extern int u_repeat_as_user(u_sourceinfo *si, u_msg *msg);
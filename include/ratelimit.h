@@ -8,18 +8,23 @@
 #ifndef __INC_RATELIMIT_H__
 #define __INC_RATELIMIT_H__
 
-/* Flood rate tokens */
-#define FLOODTOKENS 30
+/* Each command a local user runs adds to their penalty, which drains
+ * away in real time. Once the penalty is more than flood_burst seconds,
+ * their input is held (nothing more is read or run) until it drains back
+ * below that. Defaults for the class{} settings:
+ */
 
-/* Grace period length */
-#define GRACEPERIOD 15
+/* Seconds of penalty allowed before input is held */
+#define U_FLOOD_BURST 10
 
-/* Refil after this time of no activity */
-#define REFILLPERIOD 10 
+/* Tokens of penalty that drain away per second */
+#define U_FLOOD_RATE 2
 
 typedef struct {
-	/* Token count */
-	unsigned int tokens;
+	/* When the penalty runs out, in milliseconds on the u_mono_usec
+	 * clock. Anything in the past means there is no penalty.
+	 */
+	uint64_t lag;
 
 	/* WHO tokens left 
 	 *
@@ -28,20 +33,16 @@ typedef struct {
 	 */
 	unsigned int whotokens;
 
-	/* Time of last token deduction
-	 *
-	 * When REFILLPERIOD has elapsed, we refill a token
-	 */
-	time_t last;
+	/* Whether input is held, and our node in the list of such users */
+	bool held;
+	mowgli_node_t n;
 } u_ratelimit_t;
 
 typedef struct {
-	/* Number of tokens deducted per use */
+	/* Tokens of penalty per use */
 	unsigned int deduction;
 
-	/* Send LOAD2HI upon fail 
-	 * If set false, it will disconnect the user
-	 */
+	/* Send LOAD2HI when this holds the user's input (not yet used) */
 	bool warn;
 } u_ratelimit_cmd_t;
 
@@ -61,7 +62,8 @@ typedef struct {
 
 /* Functions */
 void u_ratelimit_init(u_user *user);
-bool u_ratelimit_allow(u_user *user, u_ratelimit_cmd_t *deduct, const char *cmd);
+void u_ratelimit_fini(u_user *user);
+void u_ratelimit_penalize(u_user *user, u_ratelimit_cmd_t *deduct, const char *cmd);
 void u_ratelimit_who_credit(u_user *user);
 void u_ratelimit_who_deduct(u_user *user);
 mowgli_json_t *u_ratelimit_to_json(u_ratelimit_t *limit);
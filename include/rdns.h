@@ -0,0 +1,39 @@
+/* Tethys, rdns.h -- cached reverse DNS lookups
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_RDNS_H__
+#define __INC_RDNS_H__
+
+typedef struct u_rdns_query u_rdns_query;
+typedef struct u_rdns_stats u_rdns_stats;
+
+/* host is the forward-confirmed name, or NULL with err saying why there
+   isn't one */
+typedef void (u_rdns_cb_t)(void *priv, const char *host, const char *err);
+
+struct u_rdns_stats {
+	ulong hits;
+	ulong misses;
+	ulong joined;     /* waited on a lookup that was already running */
+	ulong queries;    /* PTR and forward queries sent */
+	ulong entries;
+};
+
+extern u_rdns_stats rdns_stats;
+
+/* Looks up the name for the address and calls cb with the result. If the
+   answer is in the cache, cb is called before this returns, and NULL is
+   returned. Otherwise the returned query can be cancelled until cb has
+   been called. Lookups for the same address share a single query. */
+extern u_rdns_query *u_rdns_lookup(const struct sockaddr*, u_rdns_cb_t *cb,
+                                   void *priv);
+
+/* cb won't be called. The lookup itself continues, to fill the cache. */
+extern void u_rdns_cancel(u_rdns_query*);
+
+extern int init_rdns(void);
+
+#endif
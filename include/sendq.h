@@ -9,23 +9,99 @@
 
 typedef struct u_sendq u_sendq;
 typedef struct u_sendq_chunk u_sendq_chunk;
+typedef struct u_sendq_buf u_sendq_buf;
+typedef struct u_sendq_stats u_sendq_stats;
+typedef struct u_sendq_class_stats u_sendq_class_stats;
+
+/* chunk size classes, see sendq.c */
+#define U_SENDQ_NUM_CLASSES 5
+
+/* queued bytes are accounted per link type */
+#define U_SENDQ_NUM_ACCT 3
+
+/* called once the sendq no longer needs memory appended with put_ref */
+typedef void u_sendq_release_fn(void *priv);
 
 struct u_sendq {
 	size_t size;
 	u_sendq_chunk *head, *tail;
+	int acct;
+};
+
+/* An immutable, reference counted message. Fan-out code renders a line
+   into one of these once and then appends it to each recipient's sendq
+   by reference. Once a buffer has been put in a sendq, its contents
+   must not change. */
+struct u_sendq_buf {
+	int refs;
+	size_t len;
+	uchar data[];
 };
 
+struct u_sendq_class_stats {
+	ulong size;         /* chunk payload size, 0 for by-reference chunks */
+	ulong live;         /* chunks in queues */
+	ulong slots;        /* chunks that fit in the mapped slabs */
+	ulong slabs;
+};
+
+struct u_sendq_stats {
+	ulong bytes_copied; /* written into sendq chunks by formatters */
+	ulong bytes_shared; /* appended by reference, without copying */
+	ulong bufs_shared;  /* of those, how many were u_sendq_bufs */
+
+	u_sendq_class_stats classes[U_SENDQ_NUM_CLASSES];
+	ulong large_live;   /* oversized chunks, malloc()ed one by one */
+
+	ulong queued[U_SENDQ_NUM_ACCT];
+};
+
+extern u_sendq_stats sendq_stats;
+
 extern void u_sendq_init(u_sendq*);
 extern void u_sendq_clear(u_sendq*);
 
-/* TODO: extern void u_sendq_put(u_sendq*, uchar*, size_t); */
+/* moves the queue's bytes to another line in sendq_stats.queued */
+extern void u_sendq_set_acct(u_sendq*, int acct);
+
+/* copies the data into the queue, spanning as many chunks as needed, so
+   there is no limit on sz */
+extern size_t u_sendq_put(u_sendq*, const uchar*, size_t sz);
+extern size_t u_sendq_putv(u_sendq*, const struct iovec*, int iovcnt);
+
+/* appends the data by reference. The memory must stay valid and
+   unmodified until release(priv) is called, which happens once the data
+   has been written or the queue is cleared. release may be NULL. */
+extern size_t u_sendq_put_ref(u_sendq*, const uchar*, size_t sz,
+                              u_sendq_release_fn *release, void *priv);
+
+/* the returned buffer has refs=1 and len=0, with room for sz bytes */
+extern u_sendq_buf *u_sendq_buf_new(size_t sz);
+extern u_sendq_buf *u_sendq_buf_ref(u_sendq_buf*);
+extern void u_sendq_buf_unref(u_sendq_buf*);
 
-/* to allow vsnf, sprintf, etc. directly into the send queue */
+extern size_t u_sendq_put_buf(u_sendq*, u_sendq_buf*);
+
+/* to allow vsnf, sprintf, etc. directly into the send queue. Requests
+   larger than a chunk get a dedicated chunk of their own. */
 extern uchar *u_sendq_get_buffer(u_sendq*, size_t sz);
 extern size_t u_sendq_end_buffer(u_sendq*, size_t sz);
 
 extern int u_sendq_write(u_sendq*, int fd);
 
+/* u_sendq_write in two halves. u_sendq_send only calls writev() and
+   leaves the queue alone, so it is safe to call from an I/O worker while
+   the main thread is not touching the queue. u_sendq_consume then drops
+   the bytes that were written. */
+extern ssize_t u_sendq_send(u_sendq*, int fd);
+extern void u_sendq_consume(u_sendq*, size_t sz);
+
+/* fills in up to max iovecs describing the front of the queue, for
+   callers that do the write themselves. Returns how many were used. */
+extern int u_sendq_iov(u_sendq*, struct iovec*, int max);
+
+extern int init_sendq(void);
+
 extern mowgli_json_t *u_sendq_to_json(u_sendq *sq);
 extern int u_sendq_from_json(mowgli_json_t *sjq, u_sendq *sq);
 
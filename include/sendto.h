@@ -37,12 +37,27 @@ extern void u_sendto_servers(u_link*, char*, ...);
 extern void u_sendto_list(mowgli_list_t *list, u_link*, char*, ...);
 extern void u_sendto_map(u_map *map, u_link*, char*, ...); /* to values */
 
+/* to local users with all the given caps (CAP_*) only. Caps in
+   CAP_MASK_FANOUT are the cheap ones to ask for. */
+extern void u_sendto_chan_cap(u_chan*, u_link*, ulong caps, char*, ...);
+extern void u_sendto_visible_cap(u_user*, u_link*, ulong caps, char*, ...);
+
+/* like u_sendto_chan, but local users with caps get the first format
+   instead of the second. Both are given the same arguments, so the
+   second can use fewer of them. Each is formatted once. */
+extern void u_sendto_chan_split(u_chan*, u_link*, uint, ulong caps,
+                                char *fmt_cap, char *fmt, ...);
+
 typedef struct u_sendto_state u_sendto_state;
 
 struct u_sendto_state {
 	u_map_each_state chans;
-	u_map_each_state members;
 	u_chan *c;
+	uint local_i, links_i;
+	/* see u_sendto_visible_next */
+	bool merged;
+	uint nwords, word;
+	uint64_t bits;
 	uint type;
 	mowgli_patricia_iteration_state_t pstate;
 };
@@ -68,6 +83,27 @@ extern bool u_sendto_servers_next(u_sendto_state*, u_link**);
 	for (u_sendto_servers_start((STATE), (EXCLUDE)); \
 	     u_sendto_servers_next((STATE), (CONN)); )
 
+/* sends to channels with more local members than this are turned into
+   jobs, which give the message to this many members per turn of the
+   event loop. 0 sends everything at once. */
+#define U_SENDTO_SLICE 1000
+extern uint u_sendto_slice;
+
+extern uint u_sendto_njobs;
+/* how long jobs took to finish, in microseconds */
+extern u_histogram sendto_job_time;
+/* how many times a job was run early for a link, to keep order */
+extern uint64_t sendto_catch_ups;
+
+/* moves the jobs along by one slice. Returns true if some are left. */
+extern bool u_sendto_run_jobs(void);
+/* runs all the jobs to the end */
+extern void u_sendto_finish_jobs(void);
+/* gives the link anything the jobs still have for it. This is done
+   before anything else is sent to a user link. */
+extern void u_sendto_catch_up(u_link*);
+extern void u_sendto_chan_dropped(u_chan*);
+
 extern int init_sendto(void);
 
 #endif
@@ -55,6 +55,9 @@ struct u_server {
 	/* statistics */
 	uint nusers;
 	uint nlinks;
+
+	/* this server's users, by the last 6 digits of their UID */
+	u_uid_table uids;
 };
 
 #define IS_SERVER_LOCAL(sv) ((sv)->hops == 1)
@@ -64,12 +67,17 @@ struct u_server {
 extern mowgli_patricia_t *servers_by_sid;
 extern mowgli_patricia_t *servers_by_name;
 
+/* changes whenever a server is added, removed, or named, so that anything
+   worked out from the set of servers knows when to work it out again */
+extern uint u_server_topology;
+
 extern u_server me;
 extern mowgli_list_t my_motd;
 extern mowgli_list_t my_admininfo;
 extern char my_net_name[MAXNETNAME+1];
 
 extern u_server *u_server_by_sid(const char *sid);
+extern u_server *u_server_by_sid_index(int sidx);
 extern u_server *u_server_by_name(const char *name);
 extern u_server *u_server_find(char *str);
 
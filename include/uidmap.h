@@ -0,0 +1,40 @@
+/* Tethys, uidmap.h -- direct lookup of TS6 SIDs and UIDs
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_UIDMAP_H__
+#define __INC_UIDMAP_H__
+
+/* A TS6 SID is a digit and two base-36 digits, and a UID is a SID and six
+   more base-36 digits. Both decode to small integers, so a SID can index
+   an array directly, and the rest of a UID fits in 32 bits. Letters are
+   matched without regard to case, as the patricias do. */
+
+#define U_SID_INDEX_MAX  (10 * 36 * 36)
+
+typedef struct u_uid_table u_uid_table;
+
+/* an open-addressed map from the 6-digit part of a UID to the user. An
+   all-zero u_uid_table is a valid empty one. */
+struct u_uid_table {
+	uint mask;
+	uint count;
+	struct u_uid_slot *slots;
+};
+
+/* decodes the first 3 chars of s, or returns -1 if they're not a SID.
+   What comes after them isn't looked at. */
+extern int u_sid_index(const char *s);
+
+/* decodes the first 6 chars of s, or returns -1 */
+extern long u_uid_index(const char *s);
+
+extern void *u_uid_table_get(u_uid_table*, uint id);
+extern void u_uid_table_add(u_uid_table*, uint id, void *u);
+/* only removes id if it maps to u */
+extern bool u_uid_table_del(u_uid_table*, uint id, void *u);
+extern void u_uid_table_free(u_uid_table*);
+
+#endif
@@ -0,0 +1,46 @@
+/* Tethys, uring.h -- batched socket I/O with io_uring
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_URING_H__
+#define __INC_URING_H__
+
+/* how many registered buffers reads can land in, and their size. This
+   also limits how many connections are read in one batch. */
+#define U_URING_BUFS 256
+#define U_URING_BUFSIZE 4096
+
+/* how much of a send queue is offered to the kernel in one batch */
+#define U_URING_IOVECS 16
+
+typedef struct u_uring_op u_uring_op;
+
+/* A single read or writev. Reads go into buffer number buf, which can be
+   found with u_uring_buf; writes have buf = -1 and use iov. After
+   u_uring_run, res holds what the syscall would have returned, or
+   -errno. */
+struct u_uring_op {
+	int fd;
+	int buf;
+	const struct iovec *iov;
+	int iovcnt;
+	ssize_t res;
+};
+
+/* true if the ring was set up. If liburing was missing at configure time,
+   or the kernel refuses to create a ring, this is false and the caller
+   should make the syscalls itself. */
+extern bool u_uring_enabled(void);
+
+extern uchar *u_uring_buf(int buf);
+
+/* submits all of the operations, usually with a single io_uring_enter(),
+   and waits for them to complete. The sockets are nonblocking, so the
+   wait is short; a socket that isn't ready gets -EAGAIN. */
+extern void u_uring_run(u_uring_op *ops, int count);
+
+extern int init_uring(void);
+
+#endif
@@ -32,6 +32,14 @@
 #define CAP_MULTI_PREFIX       0x00000100
 #define CAP_AWAY_NOTIFY        0x00000200
 
+/* caps that gate messages to channels. Each channel keeps a list of its
+   local members with each of these, see u_sendto_chan_cap. There can
+   be at most U_CAP_LISTS of them. */
+#define CAP_MASK_FANOUT        (CAP_AWAY_NOTIFY)
+#define U_CAP_LISTS            4
+/* which list a cap in CAP_MASK_FANOUT has */
+#define CAP_LIST(cap)          __builtin_popcount(CAP_MASK_FANOUT & ((cap) - 1))
+
 /* registration postpone */
 #define USER_MASK_WAIT         0x00ff0000
 #define USER_WAIT_CAPS         0x00010000
@@ -47,6 +55,8 @@ struct u_user {
 	char uid[10];
 
 	uint mode, flags;
+	/* counted in uid_strays, see user.c */
+	bool uid_stray;
 	u_map *channels;
 	u_map *invites;
 
@@ -82,8 +92,18 @@ struct u_user {
 #define IS_REGISTERED(u) (!IS_LOCAL_USER(u) || \
                           ((u)->link->flags & U_LINK_REGISTERED) != 0)
 
+/* phases of registration timed in reg_hist, in microseconds */
+#define U_REG_RDNS        0
+#define U_REG_CAPS        1
+#define U_REG_AUTH        2
+#define U_REG_TOTAL       3 /* accept to RPL_WELCOME */
+#define U_REG_NUM_PHASES  4
+
 extern mowgli_patricia_t *users_by_nick;
-extern mowgli_patricia_t *users_by_uid;
+extern mowgli_patricia_t *users_by_uid; /* for iterating */
+
+extern u_histogram reg_hist[U_REG_NUM_PHASES];
+extern const char *reg_phase_names[U_REG_NUM_PHASES];
 
 extern u_mode_info umode_infotab[128];
 extern u_mode_ctx umodes;
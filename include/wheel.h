@@ -0,0 +1,71 @@
+/* Tethys, wheel.h -- hierarchical timing wheel
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#ifndef __INC_WHEEL_H__
+#define __INC_WHEEL_H__
+
+/* Timeouts that are set on every connection, and usually put off or
+   cancelled before they go off. mowgli's own timers are kept in one
+   list that is walked on every turn of the event loop, which is fine for
+   a few of them but not one per connection. Here, arming, cancelling and
+   rearming a timer are O(1), and a turn of the loop only looks at the
+   slots for the ticks that have gone by.
+
+   There are U_WHEEL_LEVELS wheels of U_WHEEL_SLOTS slots each. A timer
+   due within U_WHEEL_SLOTS ticks goes in a slot of the first wheel, a
+   timer due later in the next, and so on. When the first wheel comes
+   round, the next slot of the second is emptied into it, and likewise
+   for the ones above. A timer is moved at most U_WHEEL_LEVELS-1 times.
+
+   The wheel has no idea what a tick is; u_timers, the one the IRC
+   server runs, counts seconds. */
+
+#define U_WHEEL_BITS    6
+#define U_WHEEL_SLOTS   (1 << U_WHEEL_BITS)
+#define U_WHEEL_LEVELS  4
+
+/* timers further out than this are made to go off at this point */
+#define U_WHEEL_MAX_DELAY  ((1ull << (U_WHEEL_BITS * U_WHEEL_LEVELS)) - 1)
+
+typedef struct u_timer u_timer;
+typedef struct u_wheel u_wheel;
+
+typedef void (u_timer_cb_t)(u_timer*, void *priv);
+
+struct u_timer {
+	mowgli_node_t n;
+	mowgli_list_t *slot; /* NULL if not armed */
+	uint64_t when;
+	u_timer_cb_t *cb;
+	void *priv;
+};
+
+struct u_wheel {
+	uint64_t now;
+	uint count;
+	mowgli_list_t slots[U_WHEEL_LEVELS][U_WHEEL_SLOTS];
+};
+
+/* the server's timers, in seconds of the monotonic clock. They're run
+   once per turn of the event loop, by u_conn_run. */
+extern u_wheel u_timers;
+
+extern void u_wheel_init(u_wheel*, uint64_t now);
+
+/* runs the timers due up to and including tick now. A timer's callback
+   may arm or cancel any timer, itself included. Returns how many ran. */
+extern uint u_wheel_run(u_wheel*, uint64_t now);
+
+extern void u_timer_init(u_timer*, u_timer_cb_t*, void *priv);
+
+/* makes the timer go off delay ticks from now, at least 1, whether or
+   not it was already armed */
+extern void u_timer_arm(u_wheel*, u_timer*, uint64_t delay);
+extern void u_timer_cancel(u_wheel*, u_timer*);
+
+#define u_timer_armed(T) ((T)->slot != NULL)
+
+#endif
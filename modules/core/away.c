@@ -15,11 +15,15 @@ static int c_u_away(u_sourceinfo *si, u_msg *msg)
 		if (IS_LOCAL_USER(si->u))
 			u_user_num(si->u, RPL_UNAWAY);
 		u_sendto_servers(si->source, ":%I AWAY", si);
+		u_sendto_visible_cap(si->u, si->u->link, CAP_AWAY_NOTIFY,
+		                     ":%H AWAY", si->u);
 	} else {
 		u_strlcpy(si->u->away, r, MAXAWAY);
 		if (IS_LOCAL_USER(si->u))
 			u_user_num(si->u, RPL_NOWAWAY);
 		u_sendto_servers(si->source, ":%I AWAY :%s", si, r);
+		u_sendto_visible_cap(si->u, si->u->link, CAP_AWAY_NOTIFY,
+		                     ":%H AWAY :%s", si->u, si->u->away);
 	}
 
 	return 0;
@@ -38,6 +38,15 @@ static int cap_add(u_user *u, char *cap)
 	return 0;
 }
 
+/* registration waits for CAP END once negotiation has started */
+static void cap_wait(u_sourceinfo *si)
+{
+	if (!si->link->reg.caps_start)
+		si->link->reg.caps_start = u_mono_usec();
+
+	si->u->flags |= USER_WAIT_CAPS;
+}
+
 static int c_lu_cap(u_sourceinfo *si, u_msg *msg)
 {
 	char *s, *p, buf[512];
@@ -59,7 +68,7 @@ static int c_lu_cap(u_sourceinfo *si, u_msg *msg)
 			u_log(LG_FINE, "Built CAPs list: %s", caps_str);
 		}
 
-		si->u->flags |= USER_WAIT_CAPS;
+		cap_wait(si);
 		u_link_f(si->link, ":%S CAP %U LS :%s", &me, si->u, caps_str);
 
 	} else if (streq(subcmd, "REQ")) {
@@ -81,12 +90,15 @@ static int c_lu_cap(u_sourceinfo *si, u_msg *msg)
 		}
 
 		u_log(LG_FINE, "%U flags: %x", si->u, si->u->flags);
+		u_chan_user_caps_changed(si->u, old);
 
-		si->u->flags |= USER_WAIT_CAPS;
+		cap_wait(si);
 		u_link_f(si->link, ":%S CAP %U %s :%s", &me, si->u,
 		         ack ? "ACK" : "NAK", msg->argv[1]);
 
 	} else if (streq(msg->argv[0], "END")) {
+		if (si->u->flags & USER_WAIT_CAPS)
+			si->link->reg.caps_end = u_mono_usec();
 		si->u->flags &= ~USER_WAIT_CAPS;
 
 	} else if (streq(msg->argv[0], "LIST")) {
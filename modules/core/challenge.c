@@ -38,10 +38,19 @@ err:
 
 static void cleanup_challenge(u_oper_block *oper)
 {
+	u_timer_cancel(&u_timers, &oper->challenge_timer);
 	oper->challenge_time = (time_t) 0;
 	memset(oper->challenge, 0, sizeof(oper->challenge));
 }
 
+/* challenge_time is left set, so the response gets ERR_CHALLENGE_EXPIRED */
+static void expire_challenge(u_timer *t, void *priv)
+{
+	u_oper_block *oper = priv;
+
+	memset(oper->challenge, 0, sizeof(oper->challenge));
+}
+
 static int generate_challenge(unsigned char *challenge, int challenge_len)
 {
 	int rfd, ret;
@@ -80,11 +89,9 @@ static int c_lu_challenge(u_sourceinfo *si, u_msg *msg)
 	if (strlen(oper->pubkey) < 1)
 		return u_user_num(si->u, ERR_CHALLENGE_NOPUBKEY);
 
-	time_t cur_time = time(NULL);
-
 	if (strcmp(msg->argv[1], "REQUEST") == 0) {
 		if (oper->challenge_time > 0) {
-			if ((cur_time - oper->challenge_time) < CHALLENGE_EXPIRE_TIME)
+			if (u_timer_armed(&oper->challenge_timer))
 				return u_user_num(si->u, ERR_CHALLENGE_INPROG);
 
 			cleanup_challenge(oper);
@@ -93,7 +100,10 @@ static int c_lu_challenge(u_sourceinfo *si, u_msg *msg)
 		if (! generate_challenge(oper->challenge, sizeof(oper->challenge)))
 			return u_user_num(si->u, ERR_CHALLENGE_GENERATE);
 
-		oper->challenge_time = cur_time;
+		oper->challenge_time = time(NULL);
+		u_timer_init(&oper->challenge_timer, expire_challenge, oper);
+		u_timer_arm(&u_timers, &oper->challenge_timer,
+		            CHALLENGE_EXPIRE_TIME);
 		return send_challenge(si, oper);
 	}
 
@@ -101,7 +111,7 @@ static int c_lu_challenge(u_sourceinfo *si, u_msg *msg)
 		u_user_num(si->u, ERR_CHALLENGE_NINPROG);
 		goto cleanup;
 	}
-	if ((cur_time - oper->challenge_time) >= CHALLENGE_EXPIRE_TIME) {
+	if (!u_timer_armed(&oper->challenge_timer)) {
 		u_user_num(si->u, ERR_CHALLENGE_EXPIRED);
 		goto cleanup;
 	}
@@ -152,6 +162,20 @@ static int c_lu_challenge(u_sourceinfo *si, u_msg *msg)
 
 #endif /* HAVE_LIBCRYPTO */
 
+/* the expiry timers would otherwise call into the unloaded module. A
+   challenge cut short this way looks expired to the response. */
+static void challenge_deinit(u_module *m)
+{
+	u_map_each_state st;
+	u_oper_block *oper;
+	char *name;
+
+	U_MAP_EACH(&st, all_opers, &name, &oper) {
+		u_timer_cancel(&u_timers, &oper->challenge_timer);
+		memset(oper->challenge, 0, sizeof(oper->challenge));
+	}
+}
+
 static u_cmd challenge_cmdtab[] = {
 	{ "CHALLENGE", SRC_LOCAL_USER, c_lu_challenge, 2 },
 	{ }
@@ -159,5 +183,5 @@ static u_cmd challenge_cmdtab[] = {
 
 TETHYS_MODULE_V1(
 	"core/challenge", "Aaron Jones <aaronmdjones@gmail.com>",
-	"CHALLENGE command", NULL, NULL, challenge_cmdtab);
+	"CHALLENGE command", NULL, challenge_deinit, challenge_cmdtab);
 
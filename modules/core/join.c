@@ -42,6 +42,10 @@ static int try_local_join_chan(u_sourceinfo *si, char *chan, char *key)
 	/* send messages */
 
 	u_sendto_chan(c, NULL, ST_USERS, ":%H JOIN %C", si->u, c);
+	if (IS_AWAY(si->u)) {
+		u_sendto_chan_cap(c, si->link, CAP_AWAY_NOTIFY, ":%H AWAY :%s",
+		                  si->u, si->u->away);
+	}
 
 	modes = u_chan_modes(c, 1);
 	if (created) {
@@ -102,6 +106,10 @@ static u_chanuser *do_remote_join_chan(u_user *u, u_chan *c)
 	}
 
 	u_sendto_chan(c, NULL, ST_USERS, ":%H JOIN :%C", u, c);
+	if (IS_AWAY(u)) {
+		u_sendto_chan_cap(c, NULL, CAP_AWAY_NOTIFY, ":%H AWAY :%s",
+		                  u, u->away);
+	}
 
 	return cu;
 }
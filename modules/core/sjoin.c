@@ -186,6 +186,10 @@ static void join_uids(u_sourceinfo *si, u_chan *c, bool use_status,
 		}
 
 		u_sendto_chan(c, NULL, ST_USERS, ":%H JOIN :%C", u, c);
+		if (IS_AWAY(u)) {
+			u_sendto_chan_cap(c, NULL, CAP_AWAY_NOTIFY,
+			                  ":%H AWAY :%s", u, u->away);
+		}
 
 		cu->flags |= flags;
 		get_status(cu, 1, m, &p);
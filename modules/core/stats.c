@@ -71,7 +71,8 @@ static void stats_u(u_sourceinfo *si, struct stats_info *info)
 static void do_command(u_sourceinfo *si, u_cmd *cmd)
 {
 	char mask[15], *prop;
-	char usecs[15];
+	char runs[21], times[40];
+	u_histogram *h;
 	int i;
 
 	for (i=0; i<12; i++)
@@ -87,13 +88,20 @@ static void do_command(u_sourceinfo *si, u_cmd *cmd)
 	case CMD_PROP_HUNTED:      prop = "hnt"; break;
 	}
 
-	usecs[0] = '-';
-	usecs[1] = '\0';
-	if (cmd->runs > 0)
-		snprintf(usecs, 15, "%d,%dus", cmd->runs, cmd->usecs / cmd->runs);
+	runs[0] = '-';
+	runs[1] = '\0';
+	times[0] = '\0';
+	if (cmd->stats && cmd->stats->runs > 0) {
+		h = &cmd->stats->hist;
+		snprintf(runs, 21, "%lu", (ulong)cmd->stats->runs);
+		snprintf(times, 40, "%.1f/%.1f/%.1f",
+		         u_hist_percentile(h, 50) / 1000.0,
+		         u_hist_percentile(h, 99) / 1000.0,
+		         h->max / 1000.0);
+	}
 
-	notice(si, "%16s  %s  %2d  %s  %15s  module %s", cmd->name, mask,
-	       cmd->nargs, prop, usecs,
+	notice(si, "%16s  %s  %2d  %s  %10s  %-20s  module %s", cmd->name,
+	       mask, cmd->nargs, prop, runs, times,
 	       cmd->owner ? cmd->owner->info->name : "(none)");
 }
 
@@ -103,7 +111,8 @@ static void stats_commands(u_sourceinfo *si, struct stats_info *info)
 	u_cmd *cmd;
 
 	notice(si, "                    UU EERL RLRL");
-	notice(si, "                   FSU SUSS UUOO");
+	notice(si, "                   FSU SUSS UUOO  "
+	       "na  prp        runs  p50/p99/max (us)");
 	MOWGLI_PATRICIA_FOREACH(cmd, &state, all_commands) {
 		MOWGLI_ITER_FOREACH(cmd, cmd) {
 			do_command(si, cmd);
@@ -150,14 +159,157 @@ static void stats_modules(u_sourceinfo *si, struct stats_info *info)
 	}
 }
 
+static void stats_sendq(u_sourceinfo *si, struct stats_info *info)
+{
+	char copied[32], shared[32], bufs[32];
+
+	snprintf(copied, 32, "%lu", sendq_stats.bytes_copied);
+	snprintf(shared, 32, "%lu", sendq_stats.bytes_shared);
+	snprintf(bufs, 32, "%lu", sendq_stats.bufs_shared);
+
+	notice(si, "sendq: %s bytes copied", copied);
+	notice(si, "sendq: %s bytes shared in %s appends", shared, bufs);
+}
+
+static void stats_sendqmem(u_sourceinfo *si, struct stats_info *info)
+{
+	static char *acct_names[U_SENDQ_NUM_ACCT] = {
+		[LINK_NONE]   = "unregistered",
+		[LINK_USER]   = "user",
+		[LINK_SERVER] = "server",
+	};
+	u_sendq_class_stats *cls;
+	char live[32], avail[32], slabs[32], queued[32];
+	int i;
+
+	for (i=0; i<U_SENDQ_NUM_CLASSES; i++) {
+		cls = &sendq_stats.classes[i];
+
+		snprintf(live, 32, "%lu", cls->live);
+		snprintf(avail, 32, "%lu", cls->slots - cls->live);
+		snprintf(slabs, 32, "%lu", cls->slabs);
+
+		if (cls->size == 0) {
+			notice(si, "sendq chunks (by reference): %s live, "
+			       "%s free, %s slabs", live, avail, slabs);
+		} else {
+			notice(si, "sendq chunks (%d bytes): %s live, "
+			       "%s free, %s slabs", (int)cls->size, live,
+			       avail, slabs);
+		}
+	}
+
+	snprintf(live, 32, "%lu", sendq_stats.large_live);
+	notice(si, "sendq chunks (oversized): %s live", live);
+
+	for (i=0; i<U_SENDQ_NUM_ACCT; i++) {
+		snprintf(queued, 32, "%lu", sendq_stats.queued[i]);
+		notice(si, "sendq: %s bytes queued to %s links", queued,
+		       acct_names[i]);
+	}
+}
+
+static void stats_rdns(u_sourceinfo *si, struct stats_info *info)
+{
+	char hits[32], misses[32], joined[32], queries[32], entries[32];
+
+	snprintf(hits, 32, "%lu", rdns_stats.hits);
+	snprintf(misses, 32, "%lu", rdns_stats.misses);
+	snprintf(joined, 32, "%lu", rdns_stats.joined);
+	snprintf(queries, 32, "%lu", rdns_stats.queries);
+	snprintf(entries, 32, "%lu", rdns_stats.entries);
+
+	notice(si, "rdns: %s hits, %s misses, %s joined a running lookup",
+	       hits, misses, joined);
+	notice(si, "rdns: %s queries sent, %s cached", queries, entries);
+}
+
+static void stats_r(u_sourceinfo *si, struct stats_info *info)
+{
+	static int pct[] = { 50, 90, 99 };
+	char count[32], pbuf[3][16], max[16];
+	u_histogram *h;
+	int i, j;
+
+	for (i=0; i<U_REG_NUM_PHASES; i++) {
+		h = &reg_hist[i];
+
+		snprintf(count, 32, "%lu", (ulong)h->count);
+		for (j=0; j<3; j++) {
+			snprintf(pbuf[j], 16, "%.3f",
+			         u_hist_percentile(h, pct[j]) / 1000.0);
+		}
+		snprintf(max, 16, "%.3f", h->max / 1000.0);
+
+		notice(si, "registration %s: %s samples, p50 %sms, p90 %sms, "
+		       "p99 %sms, max %sms", reg_phase_names[i], count,
+		       pbuf[0], pbuf[1], pbuf[2], max);
+	}
+}
+
+static void stats_input(u_sourceinfo *si, struct stats_info *info)
+{
+	static int pct[] = { 50, 90, 99 };
+	char count[32], deferred[32], pbuf[3][16], max[16];
+	u_histogram *h = &input_delay;
+	int j;
+
+	snprintf(count, 32, "%lu", (ulong)h->count);
+	snprintf(deferred, 32, "%lu", (ulong)input_deferred);
+	for (j=0; j<3; j++) {
+		snprintf(pbuf[j], 16, "%.3f",
+		         u_hist_percentile(h, pct[j]) / 1000.0);
+	}
+	snprintf(max, 16, "%.3f", h->max / 1000.0);
+
+	notice(si, "input queue delay: %s turns, p50 %sms, p90 %sms, "
+	       "p99 %sms, max %sms", count, pbuf[0], pbuf[1], pbuf[2], max);
+	notice(si, "input: %s turns ended with lines left over", deferred);
+}
+
+static void stats_broadcast(u_sourceinfo *si, struct stats_info *info)
+{
+	static int pct[] = { 50, 90, 99 };
+	char count[32], catch_ups[32], pbuf[3][16], max[16];
+	u_histogram *h = &sendto_job_time;
+	int j;
+
+	snprintf(count, 32, "%lu", (ulong)h->count);
+	snprintf(catch_ups, 32, "%lu", (ulong)sendto_catch_ups);
+	for (j=0; j<3; j++) {
+		snprintf(pbuf[j], 16, "%.3f",
+		         u_hist_percentile(h, pct[j]) / 1000.0);
+	}
+	snprintf(max, 16, "%.3f", h->max / 1000.0);
+
+	notice(si, "broadcast: slice %u, %u in progress",
+	       u_sendto_slice, u_sendto_njobs);
+	notice(si, "broadcast time: %s sent, p50 %sms, p90 %sms, "
+	       "p99 %sms, max %sms", count, pbuf[0], pbuf[1], pbuf[2], max);
+	notice(si, "broadcast: %s members given a message early", catch_ups);
+}
+
+static void stats_resetcommands(u_sourceinfo *si, struct stats_info *info)
+{
+	u_cmd_stats_reset();
+	notice(si, "Command statistics reset");
+}
+
 struct stats_info stats[] = {
 	{ "o", NEED_OPER, stats_o },
 	{ "i", NEED_OPER, stats_i },
+	{ "r", NEED_OPER, stats_r },
 	{ "u", 0,         stats_u },
 
 	/* extended stats */
 	{ "commands", NEED_OPER, stats_commands },
+	{ "resetcommands", NEED_OPER, stats_resetcommands },
 	{ "modules",  NEED_OPER, stats_modules  },
+	{ "sendq",    NEED_OPER, stats_sendq    },
+	{ "sendqmem", NEED_OPER, stats_sendqmem },
+	{ "rdns",     NEED_OPER, stats_rdns     },
+	{ "input",    NEED_OPER, stats_input    },
+	{ "broadcast", NEED_OPER, stats_broadcast },
 
 	{ }
 };
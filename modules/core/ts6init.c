@@ -64,6 +64,8 @@ static int c_us_server(u_sourceinfo *si, u_msg *msg)
 	}
 
 	si->source->flags |= U_LINK_REGISTERED;
+	u_link_set_recvq(si->source, block->cls->recvq);
+	u_link_set_ping(si->source, block->cls->timeout);
 
 	u_sendto_servers(si->source, ":%S SID %s %d %s :%s", &me,
 	                 si->s->name, si->s->hops, si->s->sid, si->s->desc);
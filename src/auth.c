@@ -13,10 +13,13 @@ static char *msg_classmissing = "%s block %s missing class! Using default class"
 static char *msg_authnotfound = "Oper block %s asks for auth %s, but no such auth exists! Ignoring auth setting";
 static char *msg_timeouttooshort = "Timeout of %d seconds for class %s too short. Setting to %d seconds";
 static char *msg_sendqtoosmall = "SendQ size of %d bytes for class %s too small. Setting to %d bytes";
+static char *msg_floodtoosmall = "Flood %s for class %s must be at least 1";
+static char *msg_recvqtoosmall = "RecvQ size of %d bytes for class %s too small. Setting to %d bytes";
 static char *msg_portinvalid = "Port %d for link %s invalid. Using %d";
 
 static u_class_block class_default =
-	{ "<default>", 300, 32<<10 };
+	{ "<default>", 300, 32<<10, U_LINK_SERVER_RECVQ,
+	  U_FLOOD_BURST, U_FLOOD_RATE };
 static u_auth_block auth_default =
 	{ "<default>", "default", NULL, { { 0 }, 0 }, "" };
 
@@ -178,6 +181,34 @@ void conf_class_sendq(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
 	}
 }
 
+void conf_class_recvq(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	cur_class->recvq = parse_size(ce->vardata);
+	if (cur_class->recvq < IBUFSIZE) {
+		u_log(LG_WARN, msg_recvqtoosmall, cur_class->recvq,
+		      cur_class->name, IBUFSIZE);
+		cur_class->recvq = IBUFSIZE;
+	}
+}
+
+void conf_class_flood_burst(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	cur_class->flood_burst = atoi(ce->vardata);
+	if (cur_class->flood_burst < 1) {
+		u_log(LG_WARN, msg_floodtoosmall, "burst", cur_class->name);
+		cur_class->flood_burst = 1;
+	}
+}
+
+void conf_class_flood_rate(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	cur_class->flood_rate = atoi(ce->vardata);
+	if (cur_class->flood_rate < 1) {
+		u_log(LG_WARN, msg_floodtoosmall, "rate", cur_class->name);
+		cur_class->flood_rate = 1;
+	}
+}
+
 static u_auth_block *cur_auth = NULL;
 
 void conf_auth(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
@@ -299,6 +330,9 @@ int init_auth(void)
 	u_conf_add_handler("class", conf_class, NULL);
 	u_conf_add_handler("timeout", conf_class_timeout, u_conf_class_handlers);
 	u_conf_add_handler("sendq", conf_class_sendq, u_conf_class_handlers);
+	u_conf_add_handler("recvq", conf_class_recvq, u_conf_class_handlers);
+	u_conf_add_handler("flood_burst", conf_class_flood_burst, u_conf_class_handlers);
+	u_conf_add_handler("flood_rate", conf_class_flood_rate, u_conf_class_handlers);
 
 	u_conf_auth_handlers = mowgli_patricia_create(ascii_canonize);
 
@@ -249,15 +249,23 @@ static u_chan *chan_create_real(const char *name)
 	chan->mode = cmode_default;
 	chan->flags = 0;
 	u_cookie_reset(&chan->ck_flags);
-	chan->members = u_map_new(0);
+	chan->members = u_map_new(MAP_HASH);
 	mowgli_list_init(&chan->ban);
 	mowgli_list_init(&chan->quiet);
 	mowgli_list_init(&chan->banex);
 	mowgli_list_init(&chan->invex);
-	chan->invites = u_map_new(0);
+	chan->invites = u_map_new(MAP_HASH);
 	chan->forward = NULL;
 	chan->key = NULL;
 	chan->limit = -1;
+	chan->local = NULL;
+	chan->nlocal = chan->local_size = 0;
+	chan->holds = chan->nlocal_dead = 0;
+	chan->links = NULL;
+	chan->nlinks = chan->links_size = 0;
+	chan->bits = NULL;
+	chan->nwords = 0;
+	memset(chan->caplist, 0, sizeof(chan->caplist));
 
 	if (name[0] == '&')
 		chan->flags |= CHAN_LOCAL;
@@ -317,6 +325,8 @@ static void drop_param(char **p)
 
 void u_chan_drop(u_chan *chan)
 {
+	int i;
+
 	/* TODO: u_map_free callback! */
 	/* TODO: send PART to all users in this channel! */
 	u_map_free(chan->members);
@@ -325,8 +335,15 @@ void u_chan_drop(u_chan *chan)
 	drop_list(&chan->banex);
 	drop_list(&chan->invex);
 	u_clr_invites_chan(chan);
+	if (chan->holds)
+		u_sendto_chan_dropped(chan);
 	drop_param(&chan->forward);
 	drop_param(&chan->key);
+	free(chan->local);
+	free(chan->links);
+	free(chan->bits);
+	for (i=0; i<U_CAP_LISTS; i++)
+		free(chan->caplist[i].cu);
 
 	mowgli_patricia_delete(all_chans, chan->name);
 	free(chan);
@@ -524,17 +541,41 @@ int u_chan_send_list(u_chan *c, u_user *u, mowgli_list_t *list)
 	return 0;
 }
 
+static void invite_expire(u_timer *t, void *priv)
+{
+	u_invite *inv = priv;
+
+	u_del_invite(inv->c, inv->u);
+}
+
+/* inviting someone again starts the expiry over */
 void u_add_invite(u_chan *c, u_user *u)
 {
+	u_invite *inv;
+
 	/* TODO: check invite limits */
-	u_map_set(c->invites, u, u);
-	u_map_set(u->invites, c, c);
+	if (!(inv = u_map_get(c->invites, u))) {
+		inv = malloc(sizeof(*inv));
+		inv->c = c;
+		inv->u = u;
+		u_timer_init(&inv->timer, invite_expire, inv);
+		u_map_set(c->invites, u, inv);
+		u_map_set(u->invites, c, inv);
+	}
+
+	u_timer_arm(&u_timers, &inv->timer, U_INVITE_EXPIRE);
 }
 
 void u_del_invite(u_chan *c, u_user *u)
 {
-	u_map_del(c->invites, u);
+	u_invite *inv;
+
+	if (!(inv = u_map_del(c->invites, u)))
+		return;
 	u_map_del(u->invites, c);
+
+	u_timer_cancel(&u_timers, &inv->timer);
+	free(inv);
 }
 
 int u_has_invite(u_chan *c, u_user *u)
@@ -542,7 +583,7 @@ int u_has_invite(u_chan *c, u_user *u)
 	return !!u_map_get(c->invites, u);
 }
 
-static void inv_chan_cb(u_map *map, u_user *u, u_user *u_, u_chan *c)
+static void inv_chan_cb(u_map *map, u_user *u, u_invite *inv, u_chan *c)
 {
 	u_del_invite(c, u);
 }
@@ -551,7 +592,7 @@ void u_clr_invites_chan(u_chan *c)
 	u_map_each(c->invites, (u_map_cb_t*)inv_chan_cb, c);
 }
 
-static void inv_user_cb(u_map *map, u_chan *c, u_chan *c_, u_user *u)
+static void inv_user_cb(u_map *map, u_chan *c, u_invite *inv, u_user *u)
 {
 	u_del_invite(c, u);
 }
@@ -560,6 +601,214 @@ void u_clr_invites_user(u_user *u)
 	u_map_each(u->invites, (u_map_cb_t*)inv_user_cb, u);
 }
 
+static void *grow(void *p, uint *size, size_t elem)
+{
+	*size = *size ? *size * 2 : 8;
+	if (!(p = realloc(p, *size * elem))) {
+		u_log(LG_SEVERE, "realloc() failed");
+		abort();
+	}
+	return p;
+}
+
+/* Removal moves the last entry into the hole. The sendto iterators walk
+   these arrays from the end, so when a member leaves in the middle of a
+   sendto (e.g. on a full sendq), the one moved has already been seen,
+   and its cookie keeps it from getting the message twice.
+
+   While a broadcast job is working through c->local, it's held, and a
+   member leaving leaves NULL behind instead, so nobody moves past the
+   job's cursor. The NULLs are squeezed out when the last hold goes. */
+
+/* A bitset takes u_link_nslots bits, whatever the size of the channel,
+   so it's only kept while that's no more than c->local takes. There's
+   some slack before it's dropped, so a member coming and going at the
+   edge doesn't rebuild it each time. */
+#define NLOCAL(c) ((c)->nlocal - (c)->nlocal_dead)
+#define WANT_BITS(c) (NLOCAL(c) >= 64 && NLOCAL(c) * 64 >= u_link_nslots)
+#define DROP_BITS(c) (NLOCAL(c) < 32 || NLOCAL(c) * 128 < u_link_nslots)
+
+static void bits_set(u_chan *c, uint slot)
+{
+	uint w = slot / 64, nwords;
+
+	if (w >= c->nwords) {
+		/* slots are added one at a time, so leave room for more */
+		nwords = (u_link_nslots + 63) / 64 + 16;
+		if (!(c->bits = realloc(c->bits, nwords * sizeof(*c->bits)))) {
+			u_log(LG_SEVERE, "realloc() failed");
+			abort();
+		}
+		memset(c->bits + c->nwords, 0,
+		       (nwords - c->nwords) * sizeof(*c->bits));
+		c->nwords = nwords;
+	}
+
+	c->bits[w] |= 1ull << (slot % 64);
+}
+
+static void bits_build(u_chan *c)
+{
+	uint i;
+
+	for (i=0; i<c->nlocal; i++) {
+		if (c->local[i] != NULL)
+			bits_set(c, c->local[i]->u->link->slot);
+	}
+}
+
+static void bits_drop(u_chan *c)
+{
+	free(c->bits);
+	c->bits = NULL;
+	c->nwords = 0;
+}
+
+static void local_add(u_chan *c, u_chanuser *cu)
+{
+	if (c->nlocal == c->local_size)
+		c->local = grow(c->local, &c->local_size, sizeof(*c->local));
+
+	cu->local_idx = c->nlocal;
+	c->local[c->nlocal++] = cu;
+
+	if (c->bits)
+		bits_set(c, cu->u->link->slot);
+	else if (WANT_BITS(c))
+		bits_build(c);
+}
+
+static void local_del(u_chan *c, u_chanuser *cu)
+{
+	u_chanuser *last;
+	uint slot = cu->u->link->slot;
+
+	if (c->holds) {
+		c->local[cu->local_idx] = NULL;
+		c->nlocal_dead++;
+	} else {
+		last = c->local[--c->nlocal];
+		c->local[cu->local_idx] = last;
+		last->local_idx = cu->local_idx;
+	}
+
+	if (!c->bits)
+		return;
+
+	if (DROP_BITS(c))
+		bits_drop(c);
+	else
+		c->bits[slot / 64] &= ~(1ull << (slot % 64));
+}
+
+void u_chan_hold_local(u_chan *c)
+{
+	c->holds++;
+}
+
+void u_chan_release_local(u_chan *c)
+{
+	uint i, n = 0;
+
+	if (--c->holds > 0 || c->nlocal_dead == 0)
+		return;
+
+	for (i=0; i<c->nlocal; i++) {
+		if (c->local[i] == NULL)
+			continue;
+		c->local[i]->local_idx = n;
+		c->local[n++] = c->local[i];
+	}
+
+	c->nlocal = n;
+	c->nlocal_dead = 0;
+}
+
+static void caplist_add(u_chan *c, u_chanuser *cu, uint cap)
+{
+	u_chan_caplist *l = &c->caplist[CAP_LIST(cap)];
+
+	if (l->n == l->size)
+		l->cu = grow(l->cu, &l->size, sizeof(*l->cu));
+
+	cu->cap_idx[CAP_LIST(cap)] = l->n;
+	l->cu[l->n++] = cu;
+}
+
+static void caplist_del(u_chan *c, u_chanuser *cu, uint cap)
+{
+	u_chan_caplist *l = &c->caplist[CAP_LIST(cap)];
+	u_chanuser *last = l->cu[--l->n];
+	uint i = cu->cap_idx[CAP_LIST(cap)];
+
+	l->cu[i] = last;
+	last->cap_idx[CAP_LIST(cap)] = i;
+}
+
+/* adds cu to, or removes it from, the caplists for the caps in mask */
+static void caplists_update(u_chan *c, u_chanuser *cu, uint mask, bool add)
+{
+	uint m;
+
+	for (m = mask & CAP_MASK_FANOUT; m; m &= m - 1) {
+		if (add)
+			caplist_add(c, cu, m & -m);
+		else
+			caplist_del(c, cu, m & -m);
+	}
+}
+
+void u_chan_user_caps_changed(u_user *u, uint old)
+{
+	u_map_each_state st;
+	u_chan *c;
+	u_chanuser *cu;
+	uint gained = u->flags & ~old, lost = old & ~u->flags;
+
+	if (!IS_LOCAL_USER(u) || !((gained | lost) & CAP_MASK_FANOUT))
+		return;
+
+	U_MAP_EACH(&st, u->channels, &c, &cu) {
+		caplists_update(c, cu, lost, false);
+		caplists_update(c, cu, gained, true);
+	}
+}
+
+/* there are only ever a few server links, so these are just searched */
+static void links_add(u_chan *c, u_link *link)
+{
+	uint i;
+
+	for (i=0; i<c->nlinks; i++) {
+		if (c->links[i].link == link) {
+			c->links[i].members++;
+			return;
+		}
+	}
+
+	if (c->nlinks == c->links_size)
+		c->links = grow(c->links, &c->links_size, sizeof(*c->links));
+
+	c->links[c->nlinks].link = link;
+	c->links[c->nlinks].members = 1;
+	c->nlinks++;
+}
+
+static void links_del(u_chan *c, u_link *link)
+{
+	uint i;
+
+	for (i=0; i<c->nlinks; i++) {
+		if (c->links[i].link != link)
+			continue;
+		if (--c->links[i].members == 0)
+			c->links[i] = c->links[--c->nlinks];
+		return;
+	}
+
+	u_log(LG_ERROR, "%C has no members behind link %p", c, link);
+}
+
 /* XXX: assumes the chanuser doesn't already exist */
 u_chanuser *u_chan_user_add(u_chan *c, u_user *u)
 {
@@ -570,10 +819,17 @@ u_chanuser *u_chan_user_add(u_chan *c, u_user *u)
 	u_cookie_reset(&cu->ck_flags);
 	cu->c = c;
 	cu->u = u;
+	cu->job_seq = 0;
 
 	u_map_set(c->members, u, cu);
 	u_map_set(u->channels, c, cu);
 
+	if (IS_LOCAL_USER(u)) {
+		local_add(c, cu);
+		caplists_update(c, cu, u->flags, true);
+	} else if (u->link)
+		links_add(c, u->link);
+
 	return cu;
 }
 
@@ -582,9 +838,21 @@ void u_chan_user_del(u_chanuser *cu)
 	u_chan *c = cu->c;
 	u_user *u = cu->u;
 
+	/* a member leaving still gets what was sent to the channel before,
+	   like their own PART */
+	if (c->holds && IS_LOCAL_USER(u) &&
+	    !(u->link->flags & U_LINK_SENT_QUIT))
+		u_sendto_catch_up(u->link);
+
 	u_map_del(c->members, u);
 	u_map_del(u->channels, c);
 
+	if (IS_LOCAL_USER(u)) {
+		local_del(c, cu);
+		caplists_update(c, cu, u->flags, false);
+	} else if (u->link)
+		links_del(c, u->link);
+
 	free(cu);
 
 	if (c->members->size == 0) {
@@ -964,6 +1232,7 @@ static int dump_specific_chan(u_chan *ch, mowgli_json_t *j_chans)
 	u_map_each_state st;
 	u_user *u;
 	u_chanuser *cu;
+	u_invite *inv;
 	mowgli_json_t *jch, *jmask, *jmasks, *jmasktype,
 	              *jinvites, *jinvite,
 	              *jmems, *jmem;
@@ -1016,7 +1285,8 @@ static int dump_specific_chan(u_chan *ch, mowgli_json_t *j_chans)
 	json_oseto  (jch, "invites",       jinvites);
 
 
-	U_MAP_EACH(&st, ch->invites, &u, &u) {
+	/* invites are restored with a fresh expiry */
+	U_MAP_EACH(&st, ch->invites, &u, &inv) {
 		jinvite = mowgli_json_create_string(u->uid);
 		json_append(jinvites, jinvite);
 	}
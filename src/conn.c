@@ -4,15 +4,27 @@
    This file is protected under the terms contained
    in the COPYING file in the project root */
 
+#define _GNU_SOURCE /* accept4 */
+
 #include "ircd.h"
 
 /* globals */
 
 static mowgli_list_t awaiting_cleanup;
 
+/* connections that have had data queued since the end of the last loop
+   iteration. Instead of poking the event loop for every line queued, we
+   try to write out everything at once at the end of the iteration, and
+   only ask to be woken up for writing if the socket wouldn't take it. */
+static mowgli_list_t dirty_conns;
+
+/* with io_uring, readable connections are collected here during a loop
+   iteration and read together with the flush */
+static mowgli_list_t readable_conns;
+
 /* forward declarations */
 
-static void rdns_start(u_conn*, const struct sockaddr*, socklen_t);
+static void rdns_start(u_conn*, const struct sockaddr*);
 
 static void connect_end(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
                         mowgli_eventloop_io_dir_t dir, void *priv);
@@ -25,6 +37,8 @@ static void set_recv(u_conn *conn, mowgli_eventloop_io_cb_t *cb);
 static void set_send(u_conn *conn, mowgli_eventloop_io_cb_t *cb);
 
 static void sync_on_update(u_conn *conn);
+static void mark_dirty(u_conn *conn);
+static void start_reading(u_conn *conn);
 
 /* connection creation and shutdown */
 /* -------------------------------- */
@@ -61,11 +75,16 @@ static void final_cleanup(u_conn *conn)
 	if (conn->ctx->cleanup)
 		conn->ctx->cleanup(conn);
 
-	if (conn->dnsq)
-		mowgli_dns_delete_query(base_dns, conn->dnsq);
+	if (conn->rdnsq)
+		u_rdns_cancel(conn->rdnsq);
 
 	u_sendq_clear(&conn->sendq);
 
+	if (conn->dirty)
+		mowgli_node_delete(&conn->dirty_n, &dirty_conns);
+	if (conn->readable)
+		mowgli_node_delete(&conn->readable_n, &readable_conns);
+
 	mowgli_pollable_destroy(ev, conn->poll);
 	close(fd);
 
@@ -114,6 +133,31 @@ static int start_nonblocking_connect(const struct sockaddr *sa, socklen_t salen)
 	return fd;
 }
 
+/* Client sockets are deliberately not close-on-exec, since they are
+   inherited across upgrades. */
+static int accept_nonblocking(int listener, struct sockaddr *sa,
+                              socklen_t *salen)
+{
+	int fd;
+
+	do {
+#ifdef HAVE_ACCEPT4
+		fd = accept4(listener, sa, salen, SOCK_NONBLOCK);
+#else
+		fd = accept(listener, sa, salen);
+#endif
+	} while (fd < 0 && (errno == EINTR || errno == ECONNABORTED));
+
+#ifndef HAVE_ACCEPT4
+	if (fd >= 0 && make_nonblocking(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+#endif
+
+	return fd;
+}
+
 u_conn *u_conn_accept(mowgli_eventloop_t *ev, u_conn_ctx *ctx, void *priv,
                       ulong flags, int listener)
 {
@@ -124,36 +168,20 @@ u_conn *u_conn_accept(mowgli_eventloop_t *ev, u_conn_ctx *ctx, void *priv,
 	socklen_t addrlen = sizeof(addr);
 	memset(&addr, 0, addrlen);
 
-	if ((fd = accept(listener, (struct sockaddr*) &addr, &addrlen)) < 0) {
-		u_perror("accept");
-		return NULL;
-	}
-
-	if (make_nonblocking(fd) < 0) {
-		close(fd);
+	if ((fd = accept_nonblocking(listener, (struct sockaddr*) &addr,
+	                             &addrlen)) < 0) {
+		/* the listener has been drained */
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			u_perror("accept");
 		return NULL;
 	}
 
 	conn = conn_create(ev, ctx, priv, fd, (const struct sockaddr*) &addr, addrlen);
 	conn->state = U_CONN_ACTIVE;
 
-	set_recv(conn, recv_ready);
-
-	if (addrlen == sizeof(struct sockaddr_in6)) {
-
-		u_strlcpy(conn->host, conn->ip, U_CONN_HOSTSIZE);
+	start_reading(conn);
 
-		/*
-		 * We're going to skip DNS resolution of IPv6 hosts for now,
-		 * as it doesn't seem to "work". Therefore, make sure the RDNS
-		 * wait flag is cleared, otherwise the client cannot register.
-		 */
-		u_link* link = conn->priv;
-		link->flags &= ~U_LINK_WAIT_RDNS;
-
-	} else {
-		rdns_start(conn, (struct sockaddr*) &addr, addrlen);
-	}
+	rdns_start(conn, (struct sockaddr*) &addr);
 
 	return conn;
 }
@@ -172,7 +200,7 @@ u_conn *u_conn_connect(mowgli_eventloop_t *ev, u_conn_ctx *ctx, void *priv,
 
 	set_send(conn, connect_end);
 
-	rdns_start(conn, sa, salen);
+	rdns_start(conn, sa);
 
 	return conn;
 }
@@ -197,6 +225,9 @@ static void mark_for_cleanup(u_conn *conn)
 	set_recv(conn, NULL);
 	set_send(conn, NULL);
 
+	/* the connection is only cleaned up once the worker lets go */
+	u_io_detach(conn);
+
 	sync_on_update(conn);
 
 	mowgli_node_add(conn, &conn->n, &awaiting_cleanup);
@@ -217,70 +248,24 @@ static void fatal_error(u_conn *conn, const char *msg, int err)
 /* RDNS */
 /* ---- */
 
-struct rdns_query {
-	u_conn *conn;
-	mowgli_dns_query_t q;
-};
-
-static void rdns_callback(mowgli_dns_reply_t *reply, int reason, void *vptr)
+static void rdns_callback(void *priv, const char *host, const char *err)
 {
-	struct rdns_query *q = vptr;
-	u_conn *conn = q->conn;
-	const char *rstr = "Unknown error";
-
-	sync_time();
-
-	if (reply && reply->addr.addr.ss_family != AF_INET) {
-		/* XXX: but why? */
-		reply = NULL;
-		rstr = "IPv4 RDNS only";
-		reason = 0;
-	}
-
-	if (reply == NULL) {
-		u_strlcpy(conn->host, conn->ip, U_CONN_HOSTSIZE);
-
-		switch (reason) {
-		case MOWGLI_DNS_RES_NXDOMAIN:
-			rstr = "No such domain";
-			break;
-		case MOWGLI_DNS_RES_INVALID:
-			rstr = "Invalid domain";
-			break;
-		case MOWGLI_DNS_RES_TIMEOUT:
-			rstr = "Request timeout";
-			break;
-		}
-	} else {
-		/* TODO: initiate forward DNS check here */
-
-		u_strlcpy(conn->host, reply->h_name, U_CONN_HOSTSIZE);
-		rstr = NULL;
-	}
+	u_conn *conn = priv;
 
-	conn->dnsq = NULL;
-	free(q);
+	conn->rdnsq = NULL;
+	u_strlcpy(conn->host, host ? host : conn->ip, U_CONN_HOSTSIZE);
 
 	if (conn->ctx->rdns_finish != NULL)
-		conn->ctx->rdns_finish(conn, rstr);
+		conn->ctx->rdns_finish(conn, err);
 }
 
-static void rdns_start(u_conn *conn, const struct sockaddr *sa, socklen_t alen)
+/* a cached answer finishes the lookup before this returns */
+static void rdns_start(u_conn *conn, const struct sockaddr *sa)
 {
-	struct rdns_query *q;
-
-	q = calloc(1, sizeof(*q));
-	q->conn = conn;
-	q->q.ptr = q;
-	q->q.callback = rdns_callback;
-
-	conn->dnsq = &q->q;
-
-	mowgli_dns_gethost_byaddr(base_dns, (struct sockaddr_storage*)sa,
-	                          conn->dnsq);
-
 	if (conn->ctx->rdns_start != NULL)
 		conn->ctx->rdns_start(conn);
+
+	conn->rdnsq = u_rdns_lookup(sa, rdns_callback, conn);
 }
 
 /* User data transfer API */
@@ -304,6 +289,34 @@ static inline bool send_permitted(u_conn *conn)
 	return true;
 }
 
+/* hands out input that the io_uring batch has already read. Once that
+   runs out, the context is told to wait for the next batch rather than
+   reading the socket itself. */
+static ssize_t recv_pending(u_conn *conn, uchar *data, size_t sz)
+{
+	ssize_t rsz = conn->rlen;
+
+	if (rsz <= 0) {
+		if (rsz < 0) {
+			errno = -rsz;
+			rsz = -1;
+		}
+		return rsz;
+	}
+
+	if ((size_t)rsz > sz)
+		rsz = sz;
+
+	memcpy(data, conn->rdata, rsz);
+	conn->rdata += rsz;
+	conn->rlen -= rsz;
+
+	if (conn->rlen == 0)
+		conn->rlen = -EAGAIN;
+
+	return rsz;
+}
+
 ssize_t u_conn_recv(u_conn *conn, uchar *data, size_t sz)
 {
 	ssize_t rsz;
@@ -311,11 +324,18 @@ ssize_t u_conn_recv(u_conn *conn, uchar *data, size_t sz)
 	if (!recv_permitted(conn))
 		return 0;
 
-	rsz = read(conn->poll->fd, data, sz);
+	if (conn->rpending)
+		rsz = recv_pending(conn, data, sz);
+	else
+		rsz = read(conn->poll->fd, data, sz);
 
 	if (rsz < 0) {
 		int e = errno;
 
+		/* contexts may read until there is nothing left */
+		if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR)
+			return rsz;
+
 		/* TODO: determine if error is recoverable */
 		u_perror("read");
 
@@ -336,11 +356,39 @@ ssize_t u_conn_send(u_conn *conn, const uchar *data, size_t sz)
 	if (!send_permitted(conn))
 		return 0;
 
-	/* TODO */
+	sz = u_sendq_put(&conn->sendq, data, sz);
 
-	return 0;
+	mark_dirty(conn);
 
-	sync_on_update(conn);
+	return sz;
+}
+
+ssize_t u_conn_sendv(u_conn *conn, const struct iovec *iov, int iovcnt)
+{
+	size_t sz;
+
+	if (!send_permitted(conn))
+		return 0;
+
+	sz = u_sendq_putv(&conn->sendq, iov, iovcnt);
+
+	mark_dirty(conn);
+
+	return sz;
+}
+
+ssize_t u_conn_send_ref(u_conn *conn, const uchar *data, size_t sz,
+                        u_sendq_release_fn *release, void *priv)
+{
+	if (!send_permitted(conn)) {
+		if (release)
+			release(priv);
+		return 0;
+	}
+
+	sz = u_sendq_put_ref(&conn->sendq, data, sz, release, priv);
+
+	mark_dirty(conn);
 
 	return sz;
 }
@@ -354,7 +402,18 @@ size_t u_conn_end_send_buffer(u_conn *conn, size_t sz)
 {
 	sz = u_sendq_end_buffer(&conn->sendq, sz);
 
-	sync_on_update(conn);
+	mark_dirty(conn);
+
+	return sz;
+}
+
+size_t u_conn_put_send_buf(u_conn *conn, u_sendq_buf *buf)
+{
+	size_t sz;
+
+	sz = u_sendq_put_buf(&conn->sendq, buf);
+
+	mark_dirty(conn);
 
 	return sz;
 }
@@ -405,6 +464,7 @@ static void connect_end(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
 
 	cb(conn, 0);
 
+	start_reading(conn);
 	sync_on_update(conn);
 }
 
@@ -415,6 +475,16 @@ static void recv_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
 
 	sync_time();
 
+	/* read later, together with everything else */
+	if (u_uring_enabled()) {
+		if (!conn->readable) {
+			conn->readable = true;
+			mowgli_node_add(conn, &conn->readable_n,
+			                &readable_conns);
+		}
+		return;
+	}
+
 	if (conn->ctx->data_ready != NULL)
 		conn->ctx->data_ready(conn);
 }
@@ -442,14 +512,22 @@ static void send_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
 	sync_on_update(conn);
 }
 
+/* setselect can mean a syscall, so skip it when nothing changes */
+
 static void set_recv(u_conn *conn, mowgli_eventloop_io_cb_t *cb)
 {
+	if (conn->poll->read_function == cb)
+		return;
+
 	mowgli_pollable_setselect(conn->poll->eventloop, conn->poll,
 	                          MOWGLI_EVENTLOOP_IO_READ, cb);
 }
 
 static void set_send(u_conn *conn, mowgli_eventloop_io_cb_t *cb)
 {
+	if (conn->poll->write_function == cb)
+		return;
+
 	mowgli_pollable_setselect(conn->poll->eventloop, conn->poll,
 	                          MOWGLI_EVENTLOOP_IO_WRITE, cb);
 }
@@ -478,29 +556,333 @@ static void sync_on_update(u_conn *conn)
 		break;
 	}
 
+	if (conn->io || conn->recv_held)
+		use_recv = false;
+
 	set_recv(conn, use_recv ? recv_ready : NULL);
 }
 
+void u_conn_hold_recv(u_conn *conn, bool hold)
+{
+	conn->recv_held = hold;
+	sync_on_update(conn);
+}
+
+static void start_reading(u_conn *conn)
+{
+	if (conn->ctx->line_ready != NULL && u_io_enabled())
+		u_io_attach(conn);
+	else
+		set_recv(conn, recv_ready);
+}
+
+static void mark_dirty(u_conn *conn)
+{
+	if (conn->dirty)
+		return;
+
+	conn->dirty = true;
+	mowgli_node_add(conn, &conn->dirty_n, &dirty_conns);
+}
+
+static void flush_result(u_conn *conn, ssize_t sz)
+{
+	if (sz < 0 && sz != -EAGAIN && sz != -EWOULDBLOCK) {
+		errno = -sz;
+		u_perror("send");
+
+		fatal_error(conn, "Write error", -sz);
+		return;
+	}
+
+	if (sz > 0)
+		u_sendq_consume(&conn->sendq, sz);
+
+	sync_on_update(conn);
+}
+
+static void recv_result(u_conn *conn, const uchar *data, ssize_t sz)
+{
+	ssize_t left;
+
+	if (sz == -EAGAIN || sz == -EWOULDBLOCK)
+		return;
+
+	if (!recv_permitted(conn) || conn->ctx->data_ready == NULL)
+		return;
+
+	conn->rpending = true;
+	conn->rdata = data;
+	conn->rlen = sz;
+
+	/* the context can take less than was read if its buffer is nearly
+	   full, so keep offering the rest as long as it makes progress */
+	do {
+		left = conn->rlen;
+		conn->ctx->data_ready(conn);
+	} while (conn->rlen > 0 && conn->rlen < left && recv_permitted(conn));
+
+	conn->rpending = false;
+}
+
+/* Writes out the given connections' send queues and reads from the
+   readable connections in one io_uring submission. */
+static void run_uring(u_conn **writes, int nwrites)
+{
+	static u_uring_op *ops = NULL;
+	static u_conn **conns = NULL;
+	static struct iovec *iovs = NULL;
+	static int size = 0;
+	mowgli_node_t *n, *tn;
+	int i, count, nreads = 0;
+
+	count = nwrites + readable_conns.count;
+
+	if (size < count) {
+		size = count;
+		ops = realloc(ops, size * sizeof(*ops));
+		conns = realloc(conns, size * sizeof(*conns));
+		iovs = realloc(iovs, size * U_URING_IOVECS * sizeof(*iovs));
+	}
+
+	for (i=0; i<nwrites; i++) {
+		ops[i].fd = writes[i]->poll->fd;
+		ops[i].buf = -1;
+		ops[i].iov = iovs + i * U_URING_IOVECS;
+		ops[i].iovcnt = u_sendq_iov(&writes[i]->sendq,
+		                            iovs + i * U_URING_IOVECS,
+		                            U_URING_IOVECS);
+		conns[i] = writes[i];
+	}
+
+	/* connections that don't fit in the read buffers stay in the list
+	   for the next pass */
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, readable_conns.head) {
+		u_conn *conn = n->data;
+
+		if (nreads == U_URING_BUFS)
+			break;
+
+		mowgli_node_delete(&conn->readable_n, &readable_conns);
+		conn->readable = false;
+
+		if (!recv_permitted(conn) || conn->recv_held)
+			continue;
+
+		ops[i].fd = conn->poll->fd;
+		ops[i].buf = nreads++;
+		ops[i].iov = NULL;
+		ops[i].iovcnt = 0;
+		conns[i++] = conn;
+	}
+
+	if ((count = i) == 0)
+		return;
+
+	u_uring_run(ops, count);
+
+	sync_time();
+
+	for (i=0; i<nwrites; i++)
+		flush_result(conns[i], ops[i].res);
+
+	for (; i<count; i++)
+		recv_result(conns[i], u_uring_buf(ops[i].buf), ops[i].res);
+}
+
+static void flush_dirty(void)
+{
+	static u_conn **batch = NULL;
+	static u_conn **writes = NULL;
+	static ssize_t *results = NULL;
+	static int batch_size = 0;
+	mowgli_node_t *n, *tn;
+	ssize_t sz;
+	int i, count = 0, nwrites = 0;
+
+	if ((u_io_enabled() || u_uring_enabled()) &&
+	    batch_size < dirty_conns.count) {
+		batch_size = dirty_conns.count;
+		batch = realloc(batch, batch_size * sizeof(*batch));
+		writes = realloc(writes, batch_size * sizeof(*writes));
+		results = realloc(results, batch_size * sizeof(*results));
+	}
+
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, dirty_conns.head) {
+		u_conn *conn = n->data;
+
+		mowgli_node_delete(&conn->dirty_n, &dirty_conns);
+		conn->dirty = false;
+
+		if (conn->state == U_CONN_AWAIT_CLEANUP)
+			continue;
+
+		if (conn->state != U_CONN_ACTIVE || conn->sendq.size == 0) {
+			sync_on_update(conn);
+			continue;
+		}
+
+		if (conn->io != NULL) {
+			batch[count++] = conn;
+			continue;
+		}
+
+		if (u_uring_enabled()) {
+			writes[nwrites++] = conn;
+			continue;
+		}
+
+		/* Opportunistically write directly. Most of the time the
+		   socket buffer has room for everything, and we never have
+		   to wait for the socket to become writable. */
+		sz = u_sendq_send(&conn->sendq, conn->poll->fd);
+		flush_result(conn, sz < 0 ? -errno : sz);
+	}
+
+	if (u_uring_enabled())
+		run_uring(writes, nwrites);
+
+	if (count == 0)
+		return;
+
+	if (count < U_IO_FLUSH_MIN) {
+		for (i=0; i<count; i++) {
+			sz = u_sendq_send(&batch[i]->sendq, batch[i]->poll->fd);
+			results[i] = sz < 0 ? -errno : sz;
+		}
+	} else {
+		u_io_flush(batch, results, count);
+	}
+
+	for (i=0; i<count; i++)
+		flush_result(batch[i], results[i]);
+}
+
+static int run_cleanup(void)
+{
+	mowgli_node_t *n, *tn;
+	int cleaned = 0;
+
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, awaiting_cleanup.head) {
+		u_conn *conn = n->data;
+
+		/* still waiting for an I/O worker to let go */
+		if (conn->io != NULL)
+			continue;
+
+		final_cleanup(conn);
+		cleaned++;
+	}
+
+	return cleaned;
+}
+
+/* I/O worker events */
+/* ----------------- */
+
+void u_conn_io_line(u_conn *conn, char *line)
+{
+	/* dispatching an earlier line can end the connection */
+	if (!recv_permitted(conn))
+		return;
+
+	conn->ctx->line_ready(conn, line);
+}
+
+void u_conn_io_error(u_conn *conn, int err)
+{
+	if (!recv_permitted(conn))
+		return;
+
+	if (err != 0) {
+		errno = err;
+		u_perror("read");
+
+		fatal_error(conn, "Read error", err);
+		return;
+	}
+
+	if (conn->ctx->end_of_stream)
+		conn->ctx->end_of_stream(conn);
+
+	u_conn_shut_down(conn);
+}
+
+void u_conn_io_flood(u_conn *conn)
+{
+	if (!recv_permitted(conn))
+		return;
+
+	if (conn->ctx->excess_flood)
+		conn->ctx->excess_flood(conn);
+	else
+		fatal_error(conn, "Excess flood", 0);
+}
+
+void u_conn_io_returned(u_conn *conn, const uchar *data, size_t len)
+{
+	if (!recv_permitted(conn) || len == 0)
+		return;
+
+	if (conn->ctx->data_returned)
+		conn->ctx->data_returned(conn, data, len);
+}
+
+void u_conn_io_detached(u_conn *conn, const uchar *pending, size_t len)
+{
+	conn->io = NULL;
+
+	u_conn_io_returned(conn, pending, len);
+
+	if (conn->state != U_CONN_AWAIT_CLEANUP)
+		sync_on_update(conn);
+}
+
 /* main() API */
 /* ---------- */
 
+bool (*u_conn_after_events)(void) = NULL;
+
+/* only here so a quiet loop still wakes up to run u_timers */
+static void timers_tick(void *unused)
+{
+}
+
 void u_conn_run(mowgli_eventloop_t *ev)
 {
-	mowgli_node_t *n, *tn;
+	bool busy = false;
+	int cleaned;
 
-	while (!ev->death_requested) {
-		mowgli_eventloop_run_once(ev);
+	mowgli_timer_add(ev, "timers_tick", timers_tick, NULL, 1);
 
-		MOWGLI_LIST_FOREACH_SAFE(n, tn, awaiting_cleanup.head) {
-			u_conn *conn = n->data;
-			final_cleanup(conn);
-		}
+	while (!ev->death_requested) {
+		if (busy)
+			mowgli_eventloop_timeout_once(ev, 0);
+		else
+			mowgli_eventloop_run_once(ev);
+
+		if (u_conn_after_events != NULL)
+			busy = u_conn_after_events();
+
+		u_wheel_run(&u_timers, u_mono_usec() / 1000000);
+
+		/* cleanup callbacks may queue data to other connections,
+		   flushing may uncover dead connections, and reading makes
+		   more to flush, so go until none has anything left to do */
+		do {
+			flush_dirty();
+			cleaned = run_cleanup();
+		} while (dirty_conns.count || readable_conns.count || cleaned);
 	}
 }
 
 int init_conn(void)
 {
 	mowgli_list_init(&awaiting_cleanup);
+	mowgli_list_init(&dirty_conns);
+	mowgli_list_init(&readable_conns);
+
+	u_wheel_init(&u_timers, u_mono_usec() / 1000000);
 
 	return 0;
 }
@@ -545,10 +927,10 @@ mowgli_json_t *u_conn_to_json(u_conn *conn)
 	json_osets  (jc, "host",  conn->host);
 	json_oseto  (jc, "sendq", u_sendq_to_json(&conn->sendq));
 
-	/* If we have dnsq then we are waiting on RDNS, we will reissue it on
+	/* If we have rdnsq then we are waiting on RDNS, we will reissue it on
 	 * restore.
 	 */
-	json_osetb  (jc, "rdns_pending",  !!conn->dnsq);
+	json_osetb  (jc, "rdns_pending",  !!conn->rdnsq);
 
 	return jc;
 }
@@ -607,12 +989,15 @@ u_conn *u_conn_from_json(
 	socklen_t addrlen = sizeof(addr);
 	if (json_ogetb(jc, "rdns_pending")) {
 		if (u_pton(conn->ip, (struct sockaddr*) &addr, &addrlen)) {
-			rdns_start(conn, (struct sockaddr*) &addr, addrlen);
+			rdns_start(conn, (struct sockaddr*) &addr);
 		} else {
 			u_log(LG_WARN, "restoring client IP [%s] failed", conn->ip);
 		}
 	}
 
+	if (conn->state == U_CONN_ACTIVE)
+		start_reading(conn);
+
 	sync_on_update(conn);
 
 	return conn;
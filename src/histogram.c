@@ -0,0 +1,124 @@
+/* Tethys, histogram.c -- log-linear latency histograms
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+#define SUB_COUNT (1 << U_HIST_SUB_BITS)
+
+static int bucket_of(uint64_t v)
+{
+	int shift;
+
+	if (v >= (1ULL << U_HIST_MAX_BITS))
+		return U_HIST_BUCKETS - 1;
+
+	if (v < SUB_COUNT)
+		return v;
+
+	/* position of the highest set bit, less the bits kept */
+	shift = 63 - __builtin_clzll(v) - U_HIST_SUB_BITS;
+
+	return ((shift + 1) << U_HIST_SUB_BITS) + (v >> shift) - SUB_COUNT;
+}
+
+static uint64_t bucket_max(int b)
+{
+	int shift;
+
+	if (b < SUB_COUNT)
+		return b;
+
+	shift = (b >> U_HIST_SUB_BITS) - 1;
+
+	return (((uint64_t)(b & (SUB_COUNT - 1)) + SUB_COUNT + 1) << shift) - 1;
+}
+
+void u_hist_add(u_histogram *h, uint64_t v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->buckets[bucket_of(v)]++;
+}
+
+void u_hist_clear(u_histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+uint64_t u_hist_percentile(u_histogram *h, int p)
+{
+	uint64_t want, seen = 0;
+	int b;
+
+	if (h->count == 0)
+		return 0;
+
+	want = (h->count * p + 99) / 100;
+	if (want == 0)
+		want = 1;
+
+	for (b=0; b<U_HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= want)
+			break;
+	}
+
+	/* the top bucket is unbounded, and the max is a tighter bound
+	   anyway when it's in the same bucket */
+	if (b >= U_HIST_BUCKETS || bucket_max(b) > h->max)
+		return h->max;
+
+	return bucket_max(b);
+}
+
+/* The dump is only ever read back by a build on the same machine, so the
+   struct goes as it is. */
+mowgli_json_t *u_hist_to_json(u_histogram *h)
+{
+	mowgli_json_t *jh = mowgli_json_create_object();
+
+	json_oseti  (jh, "buckets", U_HIST_BUCKETS);
+	json_osetb64(jh, "data", h, sizeof(*h));
+
+	return jh;
+}
+
+int u_hist_from_json(mowgli_json_t *jh, u_histogram *h)
+{
+	uchar buf[sizeof(*h) + 8]; /* base64 decoding wants some slack */
+	int buckets;
+
+	/* a different layout is not an error, just a fresh start */
+	if (!json_ogeti(jh, "buckets", &buckets) || buckets != U_HIST_BUCKETS)
+		return 0;
+
+	if (json_ogetb64(jh, "data", buf, sizeof(buf)) != sizeof(*h))
+		return -1;
+
+	memcpy(h, buf, sizeof(*h));
+
+	return 0;
+}
+
+uint64_t u_mono_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t u_mono_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
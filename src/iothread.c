@@ -0,0 +1,854 @@
+/* Tethys, iothread.c -- I/O worker threads
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+#include <pthread.h>
+
+/* When io{} asks for threads, reading, line framing and writing of client
+   and server connections are spread over that many worker threads, while
+   everything else stays on the main thread. Each attached connection
+   belongs to one worker. The worker reads from the socket in its own
+   event loop and passes complete lines to the main thread.
+
+   The main thread and each worker talk through a pair of single-producer
+   single-consumer queues, one in each direction. Workers only touch the
+   socket and their own state, with one exception: when the main thread
+   has a lot to flush at the end of a loop iteration, it hands the writev()
+   calls to the workers and blocks until they're done, so the send queues
+   are never used by two threads at once. Chunks are still only released
+   on the main thread. */
+
+/* a worker's read buffer starts at this size, and doubles as needed up
+   to the connection's recvq */
+#define IO_BUFSIZE 2048
+
+/* a connection stops being read once this many reads are waiting for the
+   main thread, and is resumed when the backlog is down to half */
+#define IO_MAX_INFLIGHT 16
+
+typedef struct io_msg io_msg;
+typedef struct io_queue io_queue;
+typedef struct io_worker io_worker;
+typedef struct io_flush io_flush;
+
+enum {
+	/* main thread to worker */
+	IO_ATTACH,
+	IO_DETACH,
+	IO_RESUME,
+	IO_FLUSH,
+	IO_STOP,
+
+	/* worker to main thread */
+	IO_LINES,
+	IO_ERROR,
+	IO_FLOOD,
+	IO_DETACHED,
+};
+
+struct io_msg {
+	io_msg *next;
+	int type;
+	u_io_conn *ioc;
+	io_flush *flush;
+	int count; /* lines in data, or errno, or flush entries */
+	int start; /* first flush entry */
+	bool held; /* not freed by the queue, see u_io_stop */
+	size_t len;
+	char data[];
+};
+
+struct io_queue {
+	io_msg *head; /* consumer only */
+	io_msg *tail; /* producer only */
+	io_msg stub;
+};
+
+struct io_worker {
+	int id;
+	pthread_t thread;
+	mowgli_eventloop_t *ev;
+
+	int wake[2];
+	int signaled;
+	mowgli_eventloop_pollable_t *wake_poll;
+
+	io_queue in;  /* main thread to worker */
+	io_queue out; /* worker to main thread */
+
+	mowgli_list_t conns; /* worker only while running */
+	mowgli_list_t detached; /* worker only, see finish_detached */
+	bool stopping; /* worker only */
+	int nconns; /* main thread only */
+};
+
+struct u_io_conn {
+	u_conn *conn;
+	io_worker *w;
+	int fd;
+
+	/* main thread only */
+	bool detaching;
+
+	/* shared */
+	int inflight;
+	int throttled;
+	size_t bufmax;
+
+	/* created by the main thread, selected on by the worker */
+	mowgli_eventloop_pollable_t *poll;
+
+	/* worker only */
+	mowgli_node_t n;
+	size_t len, size;
+	uchar *buf;
+};
+
+struct io_flush {
+	u_conn **conns;
+	ssize_t *results;
+	int pending;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+static int io_threads = 0;
+
+static io_worker *workers = NULL;
+static int num_workers = 0;
+
+static int main_wake[2];
+static int main_signaled;
+static mowgli_eventloop_pollable_t *main_wake_poll = NULL;
+
+/* The lines message currently being delivered on the main thread. A line
+   can stop the workers (UPGRADE does), in which case u_io_stop hands back
+   the rest of this message and leaves freeing it to handle_lines. Only
+   the main thread uses these. */
+static io_msg *delivering = NULL;
+static char *delivering_next;
+static int delivering_left;
+
+/* queues */
+/* ------ */
+
+/* An unbounded, intrusive SPSC queue. The head always points at a node
+   that has already been consumed (initially the stub), so a pop only
+   ever looks at head->next, and the producer only ever looks at tail.
+   A message returned by queue_pop stays valid until the next pop. */
+
+static void queue_init(io_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+static void queue_push(io_queue *q, io_msg *m)
+{
+	io_msg *prev;
+
+	m->next = NULL;
+	prev = q->tail;
+	q->tail = m;
+	__atomic_store_n(&prev->next, m, __ATOMIC_RELEASE);
+}
+
+static io_msg *queue_pop(io_queue *q)
+{
+	io_msg *prev = q->head;
+	io_msg *next = __atomic_load_n(&prev->next, __ATOMIC_ACQUIRE);
+
+	if (next == NULL)
+		return NULL;
+
+	q->head = next;
+	if (prev != &q->stub && !prev->held)
+		free(prev);
+
+	return next;
+}
+
+static void queue_clear(io_queue *q)
+{
+	while (queue_pop(q) != NULL)
+		/* nothing */;
+
+	if (q->head != &q->stub && !q->head->held)
+		free(q->head);
+
+	queue_init(q);
+}
+
+static io_msg *msg_new(int type, u_io_conn *ioc, size_t len)
+{
+	io_msg *m = calloc(1, sizeof(*m) + len);
+
+	m->type = type;
+	m->ioc = ioc;
+	m->len = len;
+
+	return m;
+}
+
+static void wake(int fd, int *signaled)
+{
+	if (__atomic_exchange_n(signaled, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if (write(fd, "", 1) < 0 && errno != EAGAIN)
+		abort(); /* nothing sensible to do here */
+}
+
+static void drain_wake(int fd, int *signaled)
+{
+	char buf[64];
+
+	__atomic_store_n(signaled, 0, __ATOMIC_SEQ_CST);
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		/* nothing */;
+}
+
+static void to_worker(io_worker *w, io_msg *m)
+{
+	queue_push(&w->in, m);
+	wake(w->wake[1], &w->signaled);
+}
+
+static void to_main(io_worker *w, io_msg *m)
+{
+	queue_push(&w->out, m);
+	wake(main_wake[1], &main_signaled);
+}
+
+/* worker side */
+/* ----------- */
+
+static void worker_read(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                        mowgli_eventloop_io_dir_t dir, void *priv);
+
+static void stop_reading(u_io_conn *ioc)
+{
+	mowgli_pollable_setselect(ioc->w->ev, ioc->poll,
+	                          MOWGLI_EVENTLOOP_IO_READ, NULL);
+}
+
+static void start_reading(u_io_conn *ioc)
+{
+	mowgli_pollable_setselect(ioc->w->ev, ioc->poll,
+	                          MOWGLI_EVENTLOOP_IO_READ, worker_read);
+}
+
+/* Splits everything up to the last line ending into a message holding
+   the lines, each terminated with \0. Empty lines are dropped, and an
+   embedded \0 cuts the line short, just like dispatch_lines. */
+static io_msg *frame_lines(u_io_conn *ioc)
+{
+	uchar *p, *e, *end;
+	size_t n;
+	char *out;
+	io_msg *m;
+
+	end = ioc->buf + ioc->len;
+
+	for (e = end; e > ioc->buf; e--) {
+		if (e[-1] == '\r' || e[-1] == '\n')
+			break;
+	}
+
+	if (e == ioc->buf)
+		return NULL;
+
+	m = msg_new(IO_LINES, ioc, e - ioc->buf);
+	out = m->data;
+	end = e;
+
+	for (p = ioc->buf; p < end; p = e + 1) {
+		for (e = p; *e != '\r' && *e != '\n'; e++)
+			/* nothing */;
+
+		if (e == p)
+			continue;
+
+		n = strnlen((char*)p, e - p);
+		memcpy(out, p, n);
+		out[n] = '\0';
+		out += n + 1;
+		m->count++;
+	}
+
+	ioc->len -= end - ioc->buf;
+	memmove(ioc->buf, end, ioc->len);
+
+	if (m->count == 0) {
+		free(m);
+		return NULL;
+	}
+
+	m->len = out - m->data;
+	return m;
+}
+
+/* doubles the buffer, up to bufmax, which the main thread may raise at
+   any time */
+static bool buf_grow(u_io_conn *ioc)
+{
+	size_t max = __atomic_load_n(&ioc->bufmax, __ATOMIC_RELAXED);
+	size_t size;
+	uchar *buf;
+
+	if (ioc->size >= max)
+		return false;
+
+	size = ioc->size * 2;
+	if (size > max)
+		size = max;
+
+	if (!(buf = realloc(ioc->buf, size)))
+		return false;
+
+	ioc->buf = buf;
+	ioc->size = size;
+
+	return true;
+}
+
+static void worker_read(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                        mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	u_io_conn *ioc = priv;
+	io_msg *m;
+	ssize_t sz;
+
+	sz = read(ioc->fd, ioc->buf + ioc->len, ioc->size - ioc->len);
+
+	if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (sz <= 0) {
+		/* count 0 means end of stream */
+		m = msg_new(IO_ERROR, ioc, 0);
+		m->count = sz < 0 ? errno : 0;
+		stop_reading(ioc);
+		to_main(ioc->w, m);
+		return;
+	}
+
+	ioc->len += sz;
+
+	if ((m = frame_lines(ioc)) != NULL) {
+		__atomic_add_fetch(&ioc->inflight, 1, __ATOMIC_SEQ_CST);
+		to_main(ioc->w, m);
+	}
+
+	if (ioc->len == ioc->size && !buf_grow(ioc)) {
+		stop_reading(ioc);
+		to_main(ioc->w, msg_new(IO_FLOOD, ioc, 0));
+		return;
+	}
+
+	if (__atomic_load_n(&ioc->inflight, __ATOMIC_SEQ_CST) >= IO_MAX_INFLIGHT) {
+		stop_reading(ioc);
+		__atomic_store_n(&ioc->throttled, 1, __ATOMIC_SEQ_CST);
+
+		/* the main thread may have caught up in the meantime, in which
+		   case it won't send a resume. whoever clears the flag first
+		   gets to restart reading */
+		if (__atomic_load_n(&ioc->inflight, __ATOMIC_SEQ_CST)
+		    <= IO_MAX_INFLIGHT / 2 &&
+		    __atomic_exchange_n(&ioc->throttled, 0, __ATOMIC_SEQ_CST))
+			start_reading(ioc);
+	}
+}
+
+/* mowgli's pollable allocator isn't thread safe, so pollables are
+   created and destroyed on the main thread, and workers only select on
+   them */
+
+static void worker_attach(io_worker *w, u_io_conn *ioc)
+{
+	mowgli_node_add(ioc, &ioc->n, &w->conns);
+	start_reading(ioc);
+}
+
+/* The events the worker is going through may still include the
+   connection's pollable, so the main thread is only told it can destroy
+   it once the whole batch has been run, by finish_detached */
+static void worker_detach(io_worker *w, u_io_conn *ioc)
+{
+	stop_reading(ioc);
+	mowgli_node_delete(&ioc->n, &w->conns);
+	mowgli_node_add(ioc, &ioc->n, &w->detached);
+}
+
+static void finish_detached(io_worker *w)
+{
+	mowgli_node_t *n, *tn;
+	u_io_conn *ioc;
+
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, w->detached.head) {
+		ioc = n->data;
+		mowgli_node_delete(&ioc->n, &w->detached);
+
+		/* the main thread frees ioc when it sees this, so no
+		   touching it after the push */
+		to_main(w, msg_new(IO_DETACHED, ioc, 0));
+	}
+}
+
+static void worker_flush(io_worker *w, io_msg *m)
+{
+	io_flush *f = m->flush;
+	int i;
+
+	for (i = m->start; i < m->start + m->count; i++) {
+		u_conn *conn = f->conns[i];
+
+		f->results[i] = u_sendq_send(&conn->sendq, conn->io->fd);
+		if (f->results[i] < 0)
+			f->results[i] = -errno;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	if (--f->pending == 0)
+		pthread_cond_signal(&f->done);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void worker_wake(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                        mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	io_worker *w = priv;
+	io_msg *m;
+
+	drain_wake(w->wake[0], &w->signaled);
+
+	while ((m = queue_pop(&w->in)) != NULL) {
+		switch (m->type) {
+		case IO_ATTACH:
+			worker_attach(w, m->ioc);
+			break;
+
+		case IO_DETACH:
+			worker_detach(w, m->ioc);
+			break;
+
+		case IO_RESUME:
+			start_reading(m->ioc);
+			break;
+
+		case IO_FLUSH:
+			worker_flush(w, m);
+			break;
+
+		case IO_STOP:
+			w->stopping = true;
+			return;
+		}
+	}
+}
+
+static void *worker_main(void *priv)
+{
+	io_worker *w = priv;
+
+	while (!w->stopping) {
+		mowgli_eventloop_run_once(w->ev);
+		finish_detached(w);
+	}
+
+	return NULL;
+}
+
+/* main thread side */
+/* ---------------- */
+
+/* joins lines back together with \n, and hands them to the connection */
+static void return_lines(u_conn *conn, char *lines, int count)
+{
+	char *s = lines;
+
+	for (; count > 0; count--) {
+		s += strlen(s);
+		*s++ = '\n';
+	}
+
+	u_conn_io_returned(conn, (uchar*)lines, s - lines);
+}
+
+/* returns false if the workers were stopped in the meantime */
+static bool handle_lines(io_msg *m)
+{
+	u_io_conn *ioc = m->ioc;
+	char *s = m->data;
+	int left;
+
+	delivering = m;
+
+	for (left = m->count; left > 0; left--) {
+		delivering_next = s + strlen(s) + 1;
+		delivering_left = left - 1;
+
+		u_conn_io_line(ioc->conn, s);
+
+		if (delivering == NULL) {
+			free(m);
+			return false;
+		}
+
+		s = delivering_next;
+	}
+
+	delivering = NULL;
+
+	left = __atomic_sub_fetch(&ioc->inflight, 1, __ATOMIC_SEQ_CST);
+
+	if (left <= IO_MAX_INFLIGHT / 2 && !ioc->detaching &&
+	    __atomic_exchange_n(&ioc->throttled, 0, __ATOMIC_SEQ_CST))
+		to_worker(ioc->w, msg_new(IO_RESUME, ioc, 0));
+
+	return true;
+}
+
+static void handle_detached(u_io_conn *ioc, const uchar *pending, size_t len)
+{
+	u_conn *conn = ioc->conn;
+
+	mowgli_pollable_destroy(ioc->w->ev, ioc->poll);
+	ioc->w->nconns--;
+	free(ioc->buf);
+	free(ioc);
+
+	u_conn_io_detached(conn, pending, len);
+}
+
+static bool handle_msg(io_msg *m)
+{
+	switch (m->type) {
+	case IO_LINES:
+		return handle_lines(m);
+
+	case IO_ERROR:
+		u_conn_io_error(m->ioc->conn, m->count);
+		break;
+
+	case IO_FLOOD:
+		u_conn_io_flood(m->ioc->conn);
+		break;
+
+	case IO_DETACHED:
+		handle_detached(m->ioc, NULL, 0);
+		break;
+	}
+
+	return true;
+}
+
+static void main_wake_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
+                            mowgli_eventloop_io_dir_t dir, void *priv)
+{
+	io_msg *m;
+	int i;
+
+	sync_time();
+
+	drain_wake(main_wake[0], &main_signaled);
+
+	for (i=0; i<num_workers; i++) {
+		while ((m = queue_pop(&workers[i].out)) != NULL) {
+			if (!handle_msg(m))
+				return;
+		}
+	}
+}
+
+bool u_io_enabled(void)
+{
+	return num_workers > 0;
+}
+
+void u_io_attach(u_conn *conn)
+{
+	u_io_conn *ioc;
+	io_worker *w;
+	int i;
+
+	if (!u_io_enabled() || conn->io != NULL)
+		return;
+
+	w = &workers[0];
+	for (i=1; i<num_workers; i++) {
+		if (workers[i].nconns < w->nconns)
+			w = &workers[i];
+	}
+
+	ioc = calloc(1, sizeof(*ioc));
+	ioc->conn = conn;
+	ioc->w = w;
+	ioc->fd = conn->poll->fd;
+	ioc->size = IO_BUFSIZE;
+	ioc->buf = malloc(ioc->size);
+	ioc->bufmax = conn->recvq > IO_BUFSIZE ? conn->recvq : IO_BUFSIZE;
+	ioc->poll = mowgli_pollable_create(w->ev, ioc->fd, ioc);
+
+	conn->io = ioc;
+	w->nconns++;
+
+	to_worker(w, msg_new(IO_ATTACH, ioc, 0));
+}
+
+void u_io_set_recvq(u_conn *conn, size_t max)
+{
+	conn->recvq = max;
+
+	if (conn->io != NULL && max > IO_BUFSIZE)
+		__atomic_store_n(&conn->io->bufmax, max, __ATOMIC_RELAXED);
+}
+
+void u_io_detach(u_conn *conn)
+{
+	u_io_conn *ioc = conn->io;
+
+	if (ioc == NULL || ioc->detaching)
+		return;
+
+	ioc->detaching = true;
+	to_worker(ioc->w, msg_new(IO_DETACH, ioc, 0));
+}
+
+void u_io_flush(u_conn **conns, ssize_t *results, int count)
+{
+	io_flush f;
+	io_msg **batch;
+	int i, start;
+
+	batch = calloc(num_workers, sizeof(*batch));
+
+	f.conns = conns;
+	f.results = results;
+	f.pending = 0;
+	pthread_mutex_init(&f.lock, NULL);
+	pthread_cond_init(&f.done, NULL);
+
+	/* group the connections by worker, so each worker gets one
+	   contiguous run of entries */
+	for (i=0, start=0; i<num_workers; i++) {
+		int j, k = start;
+
+		for (j=start; j<count; j++) {
+			io_worker *w = conns[j]->io->w;
+			if (w == &workers[i]) {
+				u_conn *tmp = conns[k];
+				conns[k++] = conns[j];
+				conns[j] = tmp;
+			}
+		}
+
+		if (k == start)
+			continue;
+
+		batch[i] = msg_new(IO_FLUSH, NULL, 0);
+		batch[i]->flush = &f;
+		batch[i]->start = start;
+		batch[i]->count = k - start;
+		f.pending++;
+		start = k;
+	}
+
+	/* f.pending must be final before any worker can decrement it */
+	pthread_mutex_lock(&f.lock);
+	for (i=0; i<num_workers; i++) {
+		if (batch[i] != NULL)
+			to_worker(&workers[i], batch[i]);
+	}
+	while (f.pending > 0)
+		pthread_cond_wait(&f.done, &f.lock);
+	pthread_mutex_unlock(&f.lock);
+
+	pthread_cond_destroy(&f.done);
+	pthread_mutex_destroy(&f.lock);
+	free(batch);
+}
+
+void u_io_stop(void)
+{
+	mowgli_node_t *n, *tn;
+	io_msg *m;
+	int i;
+
+	if (!u_io_enabled())
+		return;
+
+	u_log(LG_INFO, "Stopping %d I/O workers", num_workers);
+
+	for (i=0; i<num_workers; i++) {
+		to_worker(&workers[i], msg_new(IO_STOP, NULL, 0));
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	/* The workers are gone, so everything is ours now. Lines that were
+	   read but not delivered are handed back as raw input, rather than
+	   run from inside whatever called us. */
+	if (delivering != NULL) {
+		delivering->held = true;
+		return_lines(delivering->ioc->conn, delivering_next,
+		             delivering_left);
+		delivering->ioc->inflight--;
+	}
+
+	for (i=0; i<num_workers; i++) {
+		io_worker *w = &workers[i];
+
+		while ((m = queue_pop(&w->out)) != NULL) {
+			if (m->type != IO_LINES) {
+				handle_msg(m);
+				continue;
+			}
+
+			m->ioc->inflight--;
+			return_lines(m->ioc->conn, m->data, m->count);
+		}
+
+		MOWGLI_LIST_FOREACH_SAFE(n, tn, w->conns.head) {
+			u_io_conn *ioc = n->data;
+
+			stop_reading(ioc);
+			mowgli_node_delete(&ioc->n, &w->conns);
+			handle_detached(ioc, ioc->buf, ioc->len);
+		}
+
+		/* connections the worker never got around to attaching */
+		while ((m = queue_pop(&w->in)) != NULL) {
+			if (m->type == IO_ATTACH)
+				handle_detached(m->ioc, NULL, 0);
+		}
+
+		queue_clear(&w->in);
+		queue_clear(&w->out);
+	}
+
+	delivering = NULL;
+
+	for (i=0; i<num_workers; i++) {
+		io_worker *w = &workers[i];
+
+		mowgli_pollable_destroy(w->ev, w->wake_poll);
+		close(w->wake[0]);
+		close(w->wake[1]);
+		mowgli_eventloop_destroy(w->ev);
+	}
+
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+}
+
+static int start_workers(int count)
+{
+	int i;
+
+	workers = calloc(count, sizeof(*workers));
+
+	for (i=0; i<count; i++) {
+		io_worker *w = &workers[i];
+
+		w->id = i;
+		queue_init(&w->in);
+		queue_init(&w->out);
+		mowgli_list_init(&w->conns);
+		mowgli_list_init(&w->detached);
+
+		if (pipe(w->wake) < 0) {
+			u_perror("pipe");
+			return -1;
+		}
+		set_cloexec(w->wake[0]);
+		set_cloexec(w->wake[1]);
+
+		w->ev = mowgli_eventloop_create();
+		w->wake_poll = mowgli_pollable_create(w->ev, w->wake[0], w);
+		mowgli_pollable_set_nonblocking(w->wake_poll, true);
+		fcntl(w->wake[1], F_SETFL, O_NONBLOCK);
+		mowgli_pollable_setselect(w->ev, w->wake_poll,
+		                          MOWGLI_EVENTLOOP_IO_READ, worker_wake);
+
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+			u_log(LG_ERROR, "Could not start I/O worker %d", i);
+			return -1;
+		}
+
+		num_workers++;
+	}
+
+	u_log(LG_INFO, "Started %d I/O workers", num_workers);
+
+	return 0;
+}
+
+/* configuration */
+/* ------------- */
+
+static mowgli_patricia_t *u_conf_io_handlers = NULL;
+
+static void conf_io(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	u_conf_traverse(cf, ce->entries, u_conf_io_handlers);
+}
+
+static void conf_io_threads(mowgli_config_file_t *cf,
+                            mowgli_config_file_entry_t *ce)
+{
+	int n = atoi(ce->vardata);
+
+	if (n < 0 || n > 256) {
+		u_log(LG_ERROR, "%s: invalid number of I/O threads", ce->vardata);
+		return;
+	}
+
+	io_threads = n;
+}
+
+static void *conf_end(void *unused, void *unused2)
+{
+	if (num_workers != 0 || io_threads == 0) {
+		if (num_workers != io_threads) {
+			u_log(LG_WARN, "I/O thread count can only be changed "
+			      "with a restart");
+		}
+		return NULL;
+	}
+
+	if (start_workers(io_threads) < 0) {
+		u_log(LG_ERROR, "Falling back to doing I/O on the main thread");
+		u_io_stop();
+	}
+
+	return NULL;
+}
+
+int init_iothread(void)
+{
+	if (pipe(main_wake) < 0) {
+		u_perror("pipe");
+		return -1;
+	}
+	set_cloexec(main_wake[0]);
+	set_cloexec(main_wake[1]);
+	fcntl(main_wake[1], F_SETFL, O_NONBLOCK);
+
+	main_wake_poll = mowgli_pollable_create(base_ev, main_wake[0], NULL);
+	mowgli_pollable_set_nonblocking(main_wake_poll, true);
+	mowgli_pollable_setselect(base_ev, main_wake_poll,
+	                          MOWGLI_EVENTLOOP_IO_READ, main_wake_ready);
+
+	u_hook_add(HOOK_CONF_END, conf_end, NULL);
+	u_conf_add_handler("io", conf_io, NULL);
+
+	u_conf_io_handlers = mowgli_patricia_create(ascii_canonize);
+	u_conf_add_handler("threads", conf_io_threads, u_conf_io_handlers);
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/* Tethys, linescan.c -- finding line boundaries in input
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* The input is taken 64 bytes at a time. Each block becomes a 64 bit
+   mask of where the \r and \n bytes are, and the line boundaries are
+   then read off the mask with a few bit operations, instead of looking
+   at every byte. On x86, the masks are built with SSE2 or, where the CPU
+   has it, AVX2. Anywhere else, a plain loop builds them. */
+
+#include "ircd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || \
+                          (defined(__i386__) && defined(__SSE2__)))
+#define LINESCAN_X86
+#include <immintrin.h>
+#endif
+
+#define BLOCK 64
+
+#define INLINE static inline __attribute__((always_inline))
+
+typedef uint64_t (mask_fn_t)(const uchar*);
+
+INLINE uint64_t mask_scalar(const uchar *p, size_t n)
+{
+	uint64_t m = 0;
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		if (p[i] == '\r' || p[i] == '\n')
+			m |= 1ULL << i;
+	}
+
+	return m;
+}
+
+static uint64_t mask_block_scalar(const uchar *p)
+{
+	return mask_scalar(p, BLOCK);
+}
+
+/* Finding the spans is the same everywhere; only the masks differ. This
+   is inlined into each variant below, so that the mask function is
+   inlined too, and gets the right instructions. */
+INLINE int scan(const uchar *p, size_t n, u_line_span *spans, int max,
+                mask_fn_t *mask_block)
+{
+	size_t base, start = 0, eol = 0, limit;
+	bool in_eol = false;
+	uint64_t m, bits;
+	int pos, count = 0;
+
+	for (base = 0; base < n; base += BLOCK) {
+		limit = n - base;
+		if (limit >= BLOCK) {
+			limit = BLOCK;
+			m = mask_block(p + base);
+		} else {
+			m = mask_scalar(p + base, limit);
+		}
+
+		pos = 0;
+		for (;;) {
+			/* looking for the end of a line, or for the end of the
+			   run of line endings after it */
+			bits = in_eol ? ~m : m;
+			if (pos > 0)
+				bits >>= pos;
+			if (bits == 0)
+				break;
+
+			pos += __builtin_ctzll(bits);
+			if (pos >= limit)
+				break;
+
+			if (!in_eol) {
+				eol = base + pos;
+				in_eol = true;
+				continue;
+			}
+
+			spans[count].off = start;
+			spans[count].len = eol - start;
+			spans[count].end = start = base + pos;
+			in_eol = false;
+
+			if (++count == max)
+				return count;
+		}
+	}
+
+	if (in_eol) {
+		spans[count].off = start;
+		spans[count].len = eol - start;
+		spans[count].end = n;
+		count++;
+	}
+
+	return count;
+}
+
+static int scan_scalar(const uchar *p, size_t n, u_line_span *spans, int max)
+{
+	return scan(p, n, spans, max, mask_block_scalar);
+}
+
+#ifdef LINESCAN_X86
+
+INLINE uint64_t mask_block_sse2(const uchar *p)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	uint64_t m = 0;
+	__m128i v;
+	int i;
+
+	for (i=0; i<4; i++) {
+		v = _mm_loadu_si128((const __m128i*)(p + i * 16));
+		v = _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf));
+		m |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << (i * 16);
+	}
+
+	return m;
+}
+
+static int scan_sse2(const uchar *p, size_t n, u_line_span *spans, int max)
+{
+	return scan(p, n, spans, max, mask_block_sse2);
+}
+
+__attribute__((target("avx2")))
+INLINE uint64_t mask_block_avx2(const uchar *p)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	__m256i lo, hi;
+
+	lo = _mm256_loadu_si256((const __m256i*)p);
+	hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+	lo = _mm256_or_si256(_mm256_cmpeq_epi8(lo, cr), _mm256_cmpeq_epi8(lo, lf));
+	hi = _mm256_or_si256(_mm256_cmpeq_epi8(hi, cr), _mm256_cmpeq_epi8(hi, lf));
+
+	return (uint64_t)(uint32_t)_mm256_movemask_epi8(lo) |
+	       (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const uchar *p, size_t n, u_line_span *spans, int max)
+{
+	return scan(p, n, spans, max, mask_block_avx2);
+}
+
+#endif
+
+static int scan_pick(const uchar*, size_t, u_line_span*, int);
+
+static int (*scan_impl)(const uchar*, size_t, u_line_span*, int) = scan_pick;
+static const char *impl_name = "scalar";
+
+static void pick(void)
+{
+	scan_impl = scan_scalar;
+	impl_name = "scalar";
+
+#ifdef LINESCAN_X86
+	__builtin_cpu_init();
+
+	scan_impl = scan_sse2;
+	impl_name = "sse2";
+
+	if (__builtin_cpu_supports("avx2")) {
+		scan_impl = scan_avx2;
+		impl_name = "avx2";
+	}
+#endif
+}
+
+static int scan_pick(const uchar *p, size_t n, u_line_span *spans, int max)
+{
+	pick();
+	return scan_impl(p, n, spans, max);
+}
+
+int u_linescan(const uchar *p, size_t n, u_line_span *spans, int max)
+{
+	if (max <= 0)
+		return 0;
+
+	return scan_impl(p, n, spans, max);
+}
+
+const char *u_linescan_impl(void)
+{
+	if (scan_impl == scan_pick)
+		pick();
+
+	return impl_name;
+}
@@ -6,34 +6,257 @@
 
 #include "ircd.h"
 
+static void ibuf_init(u_link *link, size_t size)
+{
+	link->ibuf = malloc(size + 1);
+	link->ibufsize = size;
+	link->ibufmax = size;
+	link->ibufhead = 0;
+	link->ibuflen = 0;
+}
+
+u_link **u_link_slots = NULL;
+uint u_link_nslots = 0;
+static uint slots_size = 0;
+static uint *free_slots = NULL;
+static uint nfree_slots = 0;
+
+static void slot_get(u_link *link)
+{
+	if (nfree_slots > 0) {
+		link->slot = free_slots[--nfree_slots];
+	} else {
+		if (u_link_nslots == slots_size) {
+			slots_size = slots_size ? slots_size * 2 : 1024;
+			u_link_slots = realloc(u_link_slots,
+			                       slots_size * sizeof(*u_link_slots));
+			free_slots = realloc(free_slots,
+			                     slots_size * sizeof(*free_slots));
+			if (!u_link_slots || !free_slots) {
+				u_log(LG_SEVERE, "realloc() failed");
+				abort();
+			}
+		}
+		link->slot = u_link_nslots++;
+	}
+
+	u_link_slots[link->slot] = link;
+}
+
+static void slot_put(u_link *link)
+{
+	u_link_slots[link->slot] = NULL;
+	free_slots[nfree_slots++] = link->slot;
+}
+
+static void link_timeout(u_timer*, void *priv);
+
 static u_link *link_create(void)
 {
 	u_link *link;
 
 	link = calloc(1, sizeof(*link));
+	ibuf_init(link, IBUFSIZE);
+	slot_get(link);
+
+	link->last_input = u_timers.now;
+	u_timer_init(&link->timer, link_timeout, link);
+	u_timer_arm(&u_timers, &link->timer, U_LINK_REG_TIMEOUT);
 
 	return link;
 }
 
+static void runq_del(u_link *link);
+
 static void link_destroy(u_link *link)
 {
+	runq_del(link);
+	u_timer_cancel(&u_timers, &link->timer);
+	slot_put(link);
+
 	if (link->pass != NULL)
 		free(link->pass);
 
+	free(link->ibuf);
 	free(link);
 }
 
+/* input ring buffer */
+/* ----------------- */
+
+/* copies out the contents of the ring, starting skip bytes in */
+static void ibuf_copy(u_link *link, size_t skip, uchar *out)
+{
+	size_t start = (link->ibufhead + skip) % link->ibufsize;
+	size_t len = link->ibuflen - skip;
+	size_t first = link->ibufsize - start;
+
+	if (first > len)
+		first = len;
+
+	memcpy(out, link->ibuf + start, first);
+	memcpy(out + first, link->ibuf, len - first);
+}
+
+/* This is the only time input is moved around, and it is straightened
+   out in the process. */
+static void ibuf_resize(u_link *link, size_t size)
+{
+	uchar *buf;
+
+	buf = malloc(size + 1);
+	ibuf_copy(link, 0, buf);
+	free(link->ibuf);
+
+	link->ibuf = buf;
+	link->ibufsize = size;
+	link->ibufhead = 0;
+}
+
+/* doubles the buffer, up to ibufmax */
+static bool ibuf_grow(u_link *link)
+{
+	size_t size;
+
+	if (link->ibufsize >= link->ibufmax)
+		return false;
+
+	size = link->ibufsize * 2;
+	if (size > link->ibufmax)
+		size = link->ibufmax;
+
+	ibuf_resize(link, size);
+
+	return true;
+}
+
+/* appends without growing, for input handed to us from elsewhere.
+   Returns how much fit. */
+static size_t ibuf_append(u_link *link, const uchar *data, size_t len)
+{
+	size_t tail, first;
+
+	if (len > link->ibufsize - link->ibuflen)
+		len = link->ibufsize - link->ibuflen;
+
+	tail = (link->ibufhead + link->ibuflen) % link->ibufsize;
+	first = link->ibufsize - tail;
+	if (first > len)
+		first = len;
+
+	memcpy(link->ibuf + tail, data, first);
+	memcpy(link->ibuf, data + first, len - first);
+	link->ibuflen += len;
+
+	return len;
+}
+
+void u_link_set_recvq(u_link *link, size_t max)
+{
+	link->ibufmax = max > link->ibufsize ? max : link->ibufsize;
+
+	if (link->conn != NULL)
+		u_io_set_recvq(link->conn, link->ibufmax);
+}
+
 /* conn interaction */
 /* ---------------- */
 
 static void exceptional_quit(u_link *link, char *msg, ...);
-static void dispatch_lines(u_link*);
+static bool dispatch_lines(u_link*, bool force);
+static void dispatch_one(u_link*, char *line);
+
+/* input scheduling */
+/* ---------------- */
+
+/* Input isn't run as soon as it's read. Links with input go in the run
+   queue, and each gets a turn per loop iteration, of a few lines or a
+   couple of milliseconds, whichever runs out first. A link with lines
+   left over goes to the back of the queue. One connection sending a lot
+   of expensive commands then holds the others up by one turn at most. */
+
+static mowgli_list_t runq;
+static uint run_round = 0;
+
+static uint line_budget = U_LINK_LINE_BUDGET;
+static uint server_line_budget = U_LINK_SERVER_LINE_BUDGET;
+static uint time_budget = U_LINK_TIME_BUDGET;
+
+u_histogram input_delay;
+uint64_t input_deferred = 0;
+
+static void runq_add(u_link *link)
+{
+	if (link->runq || link->ibuflen == 0)
+		return;
+
+	if (link->flags & (U_LINK_WAIT | U_LINK_SENT_QUIT))
+		return;
+
+	link->runq = true;
+	link->runq_since = u_mono_usec();
+	mowgli_node_add(link, &link->runq_n, &runq);
+}
+
+static void runq_del(u_link *link)
+{
+	if (!link->runq)
+		return;
+
+	link->runq = false;
+	mowgli_node_delete(&link->runq_n, &runq);
+}
+
+/* whether the link may run another line this round */
+static bool has_budget(u_link *link)
+{
+	uint max;
+
+	if (link->run_round != run_round) {
+		link->run_round = run_round;
+		link->run_lines = 0;
+	}
+
+	max = link->type == LINK_SERVER ? server_line_budget : line_budget;
+
+	return link->run_lines < max;
+}
+
+bool u_link_run_input(void)
+{
+	mowgli_node_t *n;
+	u_link *link;
+	int i, count;
+
+	run_round++;
+
+	/* links that go to the back of the queue wait for the next round */
+	count = runq.count;
+
+	for (i=0; i<count && (n = runq.head); i++) {
+		link = n->data;
+		runq_del(link);
+
+		u_hist_add(&input_delay, u_mono_usec() - link->runq_since);
+
+		if (link->conn->state != U_CONN_ACTIVE)
+			continue;
+
+		if (dispatch_lines(link, false)) {
+			input_deferred++;
+			runq_add(link);
+		}
+	}
+
+	return runq.count > 0;
+}
 
 static void on_attach(u_conn *conn)
 {
 	u_link *link = conn->priv;
 
 	link->conn = conn;
+	u_io_set_recvq(conn, link->ibufmax);
 }
 
 static void on_connect_finish(u_conn *conn, int err)
@@ -77,29 +300,135 @@ static void on_sendq_full(u_conn *conn)
 	u_conn_shut_down(conn);
 }
 
+/* reads until the socket is drained or the budget is used up, so a
+   server bursting at us isn't taken in one small read per loop */
 static void on_data_ready(u_conn *conn)
 {
 	u_link *link = conn->priv;
+	size_t budget = U_LINK_READ_BUDGET;
+	size_t tail, room;
 	ssize_t sz;
 
-	if (link->ibuflen == IBUFSIZE) {
-		on_excess_flood(conn);
+	/* Input waiting for its turn is left in the socket, so a flood
+	   backs up there rather than in our memory. io_uring has already
+	   read it, though, so then it has to be taken. */
+	if ((link->runq || (link->flags & U_LINK_WAIT_FLOOD)) &&
+	    !conn->rpending)
 		return;
+
+	while (budget > 0) {
+		if (link->ibuflen == link->ibufsize && !ibuf_grow(link)) {
+			/* A read io_uring made before the link was held can't
+			   be run now or put back. No more are made while it's
+			   held, so the rest of this one is kept past ibufmax
+			   rather than taken for a flood. */
+			if (link->flags & U_LINK_WAIT_FLOOD) {
+				if (!conn->rpending || conn->rlen <= 0)
+					break;
+				ibuf_resize(link, link->ibufsize + conn->rlen);
+				continue;
+			}
+
+			/* make room by running lines, past the budget if the
+			   input would be lost otherwise. One of them can get
+			   the link held, which is dealt with above */
+			if (dispatch_lines(link, conn->rpending) &&
+			    !(link->flags & U_LINK_WAIT_FLOOD)) {
+				runq_add(link);
+				return;
+			}
+
+			if (link->ibuflen == link->ibufsize &&
+			    !(link->flags & U_LINK_WAIT_FLOOD)) {
+				on_excess_flood(conn);
+				return;
+			}
+		}
+
+		/* the free space right after the input, without wrapping */
+		tail = (link->ibufhead + link->ibuflen) % link->ibufsize;
+		if (tail < link->ibufhead)
+			room = link->ibufhead - tail;
+		else
+			room = link->ibufsize - tail;
+
+		if (room > budget)
+			room = budget;
+
+		sz = u_conn_recv(conn, link->ibuf + tail, room);
+
+		if (sz <= 0)
+			break;
+
+		link->last_input = u_timers.now;
+		link->flags &= ~U_LINK_SENT_PING;
+		link->ibuflen += sz;
+		budget -= sz;
+
+		/* a short read means the socket has nothing more for us */
+		if ((size_t)sz < room)
+			break;
 	}
 
-	sz = u_conn_recv(conn, link->ibuf + link->ibuflen,
-	                 IBUFSIZE - link->ibuflen);
+	runq_add(link);
+}
 
-	if (sz <= 0)
+/* lines from an I/O worker are already split up. If nothing is waiting
+   in ibuf, they can be run directly; otherwise they queue up behind it */
+static void on_line_ready(u_conn *conn, char *line)
+{
+	u_link *link = conn->priv;
+	size_t len;
+
+	link->last_input = u_timers.now;
+	link->flags &= ~U_LINK_SENT_PING;
+
+	if (link->ibuflen == 0 && !(link->flags & U_LINK_WAIT) &&
+	    has_budget(link)) {
+		dispatch_one(link, line);
+		link->run_lines++;
 		return;
+	}
 
-	link->ibuflen += sz;
+	len = strlen(line);
 
-	dispatch_lines(link);
+	/* workers can't be told to wait, so this runs lines past the
+	   budget rather than drop any */
+	while (link->ibuflen + len + 1 > link->ibufsize) {
+		if (ibuf_grow(link))
+			continue;
+
+		dispatch_lines(link, true);
+		if (link->ibuflen + len + 1 > link->ibufsize) {
+			on_excess_flood(conn);
+			return;
+		}
+	}
+
+	ibuf_append(link, (uchar*)line, len);
+	ibuf_append(link, (uchar*)"\n", 1);
+
+	runq_add(link);
+}
+
+static void on_data_returned(u_conn *conn, const uchar *data, size_t len)
+{
+	u_link *link = conn->priv;
+	size_t fit;
+
+	/* no growing here; this can happen in the middle of dispatching
+	   a line that lives in the buffer */
+	if ((fit = ibuf_append(link, data, len)) < len) {
+		u_log(LG_WARN, "[%G] dropping %u bytes of returned input",
+		      link, (uint)(len - fit));
+	}
 }
 
 static void on_end_of_stream(u_conn *conn)
 {
+	/* whatever came before the end, such as a QUIT, runs first */
+	dispatch_lines(conn->priv, true);
+
 	exceptional_quit(conn->priv, "End of stream");
 }
 
@@ -109,6 +438,7 @@ static void on_rdns_start(u_conn *conn)
 
 	u_link_f(link, ":%S NOTICE * :*** Looking up your hostname", &me);
 	link->flags |= U_LINK_WAIT_RDNS;
+	link->reg.rdns_start = u_mono_usec();
 }
 
 static void on_rdns_finish(u_conn *conn, const char *msg)
@@ -124,8 +454,9 @@ static void on_rdns_finish(u_conn *conn, const char *msg)
 	}
 
 	link->flags &= ~U_LINK_WAIT_RDNS;
+	link->reg.rdns_end = u_mono_usec();
 
-	dispatch_lines(link);
+	runq_add(link);
 }
 
 u_conn_ctx u_link_conn_ctx = {
@@ -139,6 +470,10 @@ u_conn_ctx u_link_conn_ctx = {
 	.end_of_stream    = on_end_of_stream,
 	.rdns_start       = on_rdns_start,
 	.rdns_finish      = on_rdns_finish,
+
+	.line_ready       = on_line_ready,
+	.excess_flood     = on_excess_flood,
+	.data_returned    = on_data_returned,
 };
 
 static void exceptional_quit(u_link *link, char *msg, ...)
@@ -173,74 +508,166 @@ static void exceptional_quit(u_link *link, char *msg, ...)
 	}
 }
 
-static void dispatch_lines(u_link *link)
+/* index of the first line ending in p, or n if there is none */
+static size_t find_eol(const uchar *p, size_t n)
 {
-	uchar *buf;
-	size_t buflen;
-	uchar *s, *p;
-	u_msg msg;
+	const uchar *s;
+
+	if ((s = memchr(p, '\n', n)) != NULL)
+		n = s - p;
+	if ((s = memchr(p, '\r', n)) != NULL)
+		n = s - p;
+
+	return n;
+}
 
-	buf = link->ibuf;
-	buflen = link->ibuflen;
+static inline bool ibuf_is_eol(u_link *link, size_t i)
+{
+	uchar c = link->ibuf[(link->ibufhead + i) % link->ibufsize];
+	return c == '\r' || c == '\n';
+}
+
+/* dispatches len bytes at line, then drops skip bytes from the ring */
+static void dispatch_span(u_link *link, uchar *line, size_t len, size_t skip)
+{
+	line[len] = '\0';
+
+	/* If executing this command causes an upgrade, u_cmd_invoke will not
+	 * return. Indicate the length of the current message to the dump function
+	 * so that it won't be serialized and re-execute after upgrade.
+	 */
+	link->ibufskip = skip;
+
+	/* empty lines are just stray line endings */
+	if (len > 0)
+		dispatch_one(link, (char*)line);
+
+	link->ibufhead = (link->ibufhead + skip) % link->ibufsize;
+	link->ibuflen -= skip;
+	link->ibufskip = 0;
+}
 
-	/* i don't really ever comment my code, as it's mostly very straight
-	   forward and relatively self-documenting. but C string processing
-	   is typically very hairy stuff and it can be difficult to decipher
-	   the intent of a chunk of code, so i commented it  --aji */
+#define DISPATCH_SPANS 32
 
-	buf[buflen] = '\0';
+/* whether the link has used up its turn, which started at start */
+static bool out_of_budget(u_link *link, uint64_t start)
+{
+	return !has_budget(link) || u_mono_usec() - start >= time_budget;
+}
+
+/* runs the complete lines in ibuf, up to the link's budget unless force
+   is set. Returns true if it stopped because the budget ran out. */
+static bool dispatch_lines(u_link *link, bool force)
+{
+	static uchar *scratch = NULL;
+	static size_t scratch_size = 0;
+	u_line_span spans[DISPATCH_SPANS];
+	size_t first, eol, end;
+	uint64_t start = u_mono_usec();
+	bool more = false;
+	int i, n;
+
+	while (link->ibuflen > 0) {
+		/* the input is in at most two pieces: from the head to the
+		   end of the buffer, and then from the start of the buffer */
+		first = link->ibufsize - link->ibufhead;
+		if (first > link->ibuflen)
+			first = link->ibuflen;
+
+		/* all of the lines in the first piece are found in one go.
+		   Each line ends on a line ending, so there is always room
+		   for the terminator, even at the end of the buffer */
+		n = u_linescan(link->ibuf + link->ibufhead, first,
+		               spans, DISPATCH_SPANS);
+
+		for (i=0; i<n; i++) {
+			/* check wait flags on every line, as line dispatch
+			   can affect this */
+			if (link->flags & U_LINK_WAIT)
+				goto out;
+
+			if (!force && out_of_budget(link, start)) {
+				more = true;
+				goto out;
+			}
+
+			dispatch_span(link, link->ibuf + link->ibufhead,
+			              spans[i].len, spans[i].end - spans[i].off);
+			link->run_lines++;
+		}
+
+		if (n > 0)
+			continue;
 
-	while (buflen > 0) {
-		/* check wait flags on every iteration, as line dispatch
-		   can affect this */
 		if (link->flags & U_LINK_WAIT)
 			break;
 
-		/* find the next \r and \n */
-		s = memchr(buf, '\r', buflen);
-		p = memchr(buf, '\n', buflen);
+		/* no line ends before the buffer wraps, so the line, if
+		   any, is in two pieces */
+		if (first == link->ibuflen)
+			break;
 
-		/* if no line endings in buffer, we're done */
-		if (!s && !p)
+		eol = first + find_eol(link->ibuf, link->ibuflen - first);
+		if (eol == link->ibuflen)
 			break;
 
-		/* if p is closer than s, then put p in s */
-		if (!s || (p && p < s))
-			s = p;
-		/* s now contains the closest line ending */
-
-		/* delete all contiguous line endings at s */
-		for (p = s; *p == '\r' || *p == '\n'; p++)
-			*p = '\0';
-		/* p now points at the start of the next line */
-
-		s = buf;
-		buf = p;
-		buflen = buflen - (p - s);
-		/* s now points to the current line, and buf and buflen
-		   describe the rest of the buffer */
-
-		/* If executing this command causes an upgrade, u_cmd_invoke will not
-		 * return. Indicate the length of the current message to the dump function
-		 * so that it won't be serialized and re-execute after upgrade.
-		 */
-		link->ibufskip = (p - link->ibuf);
-
-		/* dispatch the line */
-		u_log(LG_DEBUG, "[%G] -> %s", link, s);
-		if (u_msg_parse(&msg, (char*)s) < 0)
-			continue;
-		u_cmd_invoke(link, &msg, (char*)s);
+		if (!force && out_of_budget(link, start)) {
+			more = true;
+			break;
+		}
+
+		/* skip all contiguous line endings */
+		for (end = eol; end < link->ibuflen && ibuf_is_eol(link, end); end++);
+
+		/* only lines that wrap around are copied */
+		if (scratch_size < eol + 1) {
+			scratch_size = link->ibufmax + 1;
+			scratch = realloc(scratch, scratch_size);
+		}
+		memcpy(scratch, link->ibuf + link->ibufhead, first);
+		memcpy(scratch + first, link->ibuf, eol - first);
+
+		dispatch_span(link, scratch, eol, end);
+		link->run_lines++;
 	}
 
-	/* move remaining buffer contents to the start of the in buffer */
-	memmove(link->ibuf, link->ibuf + link->ibuflen - buflen, buflen);
-	link->ibuflen = buflen;
-	link->ibufskip = 0;
+out:
+	/* start over at the front, so reads are as large as possible */
+	if (link->ibuflen == 0)
+		link->ibufhead = 0;
+
+	return more;
+}
+
+static void dispatch_one(u_link *link, char *line)
+{
+	u_msg msg;
+
+	u_log(LG_DEBUG, "[%G] -> %s", link, line);
+	if (u_msg_parse(&msg, line) < 0)
+		return;
+	u_cmd_invoke(link, &msg, line);
 }
 
 void u_link_flush_input(u_link *link) {
-	dispatch_lines(link);
+	runq_add(link);
+}
+
+void u_link_hold_input(u_link *link, bool hold)
+{
+	if (!link)
+		return;
+
+	if (hold) {
+		link->flags |= U_LINK_WAIT_FLOOD;
+		runq_del(link);
+	} else {
+		link->flags &= ~U_LINK_WAIT_FLOOD;
+		runq_add(link);
+	}
+
+	if (link->conn)
+		u_conn_hold_recv(link->conn, hold);
 }
 
 /* user API */
@@ -265,6 +692,48 @@ u_link *u_link_connect(mowgli_eventloop_t *ev, u_link_block *block,
 	return link;
 }
 
+/* Input only notes the time, so a busy link costs nothing here. When
+   the timer goes off, it's put off again by however long the link
+   hasn't actually been quiet. */
+static void link_timeout(u_timer *t, void *priv)
+{
+	u_link *link = priv;
+	uint64_t idle = u_timers.now - link->last_input;
+
+	if (link->flags & U_LINK_SENT_QUIT)
+		return;
+
+	if (!(link->flags & U_LINK_REGISTERED)) {
+		exceptional_quit(link, "Registration timed out");
+		u_link_f(link, "ERROR :Registration timed out");
+		u_conn_shut_down(link->conn);
+		return;
+	}
+
+	if (idle < link->ping_freq) {
+		u_timer_arm(&u_timers, t, link->ping_freq - idle);
+		return;
+	}
+
+	if (!(link->flags & U_LINK_SENT_PING)) {
+		link->flags |= U_LINK_SENT_PING;
+		u_link_f(link, "PING :%s", me.name);
+		u_timer_arm(&u_timers, t, link->ping_freq);
+		return;
+	}
+
+	exceptional_quit(link, "Ping timeout: %lu seconds", (ulong)idle);
+	u_link_f(link, "ERROR :Ping timeout");
+	u_conn_shut_down(link->conn);
+}
+
+void u_link_set_ping(u_link *link, uint freq)
+{
+	link->ping_freq = freq;
+	link->flags &= ~U_LINK_SENT_PING;
+	u_timer_arm(&u_timers, &link->timer, freq);
+}
+
 void u_link_close(u_link *link)
 {
 	u_conn_shut_down(link->conn);
@@ -287,6 +756,10 @@ void u_link_vf(u_link *link, const char *fmt, va_list va)
 	if (!link)
 		return;
 
+	/* anything a broadcast still has for them goes first */
+	if (u_sendto_njobs && link->type == LINK_USER)
+		u_sendto_catch_up(link);
+
 	if (link->sendq > 0 && link->conn->sendq.size + 512 > link->sendq) {
 		on_sendq_full(link->conn);
 		return;
@@ -324,6 +797,100 @@ void u_link_f(u_link *link, const char *fmt, ...)
 	va_end(va);
 }
 
+/* the pieces are concatenated, truncated to 510 bytes, and terminated
+   with \r\n, without going through the formatter. At most 7 pieces are
+   taken; more than that is an error, and nothing is sent. */
+void u_link_sendv(u_link *link, const struct iovec *iov, int iovcnt)
+{
+	static const char crlf[] = "\r\n";
+	struct iovec out[8];
+	char line[512];
+	size_t sz, len;
+	int i, n;
+
+	if (!link)
+		return;
+
+	if (iovcnt > 7) {
+		u_log(LG_ERROR, "u_link_sendv: %d pieces, at most 7 fit", iovcnt);
+		return;
+	}
+
+	/* anything a broadcast still has for them goes first */
+	if (u_sendto_njobs && link->type == LINK_USER)
+		u_sendto_catch_up(link);
+
+	sz = 0;
+	for (i=0, n=0; i<iovcnt && sz<510; i++) {
+		len = iov[i].iov_len;
+		if (sz + len > 510)
+			len = 510 - sz;
+		out[n].iov_base = iov[i].iov_base;
+		out[n].iov_len = len;
+		sz += len;
+		n++;
+	}
+	out[n].iov_base = (void*)crlf;
+	out[n].iov_len = 2;
+	n++;
+
+	if (link->sendq > 0 && link->conn->sendq.size + sz + 2 > link->sendq) {
+		on_sendq_full(link->conn);
+		return;
+	}
+
+	if (u_log_level >= LG_DEBUG) {
+		for (i=0, len=0; i<n-1; i++) {
+			memcpy(line + len, out[i].iov_base, out[i].iov_len);
+			len += out[i].iov_len;
+		}
+		line[len] = '\0';
+		u_log(LG_DEBUG, "[%G] <- %s", link, line);
+	}
+
+	u_conn_sendv(link->conn, out, n);
+}
+
+void u_link_send_line(u_link *link, const char *line)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void*)line;
+	iov.iov_len = strlen(line);
+
+	u_link_sendv(link, &iov, 1);
+}
+
+/* buf must hold a single line, already terminated with \r\n */
+void u_link_put_buf(u_link *link, u_sendq_buf *buf)
+{
+	char line[512];
+	size_t sz;
+
+	if (!link)
+		return;
+
+	/* anything a broadcast still has for them goes first */
+	if (u_sendto_njobs && link->type == LINK_USER)
+		u_sendto_catch_up(link);
+
+	if (link->sendq > 0 && link->conn->sendq.size + buf->len > link->sendq) {
+		on_sendq_full(link->conn);
+		return;
+	}
+
+	if (u_log_level >= LG_DEBUG) {
+		sz = buf->len < 2 ? 0 : buf->len - 2;
+		if (sz >= sizeof(line))
+			sz = sizeof(line) - 1;
+		memcpy(line, buf->data, sz);
+		line[sz] = '\0';
+		u_log(LG_DEBUG, "[%G] <- %s", link, line);
+	}
+
+	u_conn_put_send_buf(link->conn, buf);
+}
+
 void u_link_vnum(u_link *link, const char *tgt, int num, va_list va)
 {
 	char buf[4096];
@@ -371,14 +938,23 @@ int u_link_num(u_link *link, int num, ...)
 /* listeners */
 /* --------- */
 
+#define LISTEN_BACKLOG_DEFAULT 128
+#define ACCEPT_BUDGET_DEFAULT 64
+
 struct u_link_origin {
 	mowgli_eventloop_pollable_t *poll;
+	int budget;
 	mowgli_node_t n;
 };
 
 static mowgli_list_t all_origins;
 static mowgli_patricia_t *u_conf_listen_handlers = NULL;
 
+/* settings for the listen{} block currently being parsed. These only
+   affect port entries that come after them in the same block. */
+static int listen_backlog = LISTEN_BACKLOG_DEFAULT;
+static int accept_budget = ACCEPT_BUDGET_DEFAULT;
+
 static void accept_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
                          mowgli_eventloop_io_dir_t dir, void *priv);
 
@@ -398,6 +974,7 @@ u_link_origin *u_link_origin_create_from_fd(mowgli_eventloop_t *ev, int fd)
 	u_log(LG_DEBUG, "u_link_origin_create_from_fd: %d", fd);
 
 	origin = malloc(sizeof(*origin));
+	origin->budget = accept_budget;
 
 	operation = "create pollable";
 	if (!(origin->poll = mowgli_pollable_create(ev, fd, origin))) {
@@ -405,6 +982,9 @@ u_link_origin *u_link_origin_create_from_fd(mowgli_eventloop_t *ev, int fd)
 		goto error;
 	}
 
+	/* accept_ready drains the listener until accept() would block */
+	mowgli_pollable_set_nonblocking(origin->poll, true);
+
 	mowgli_node_add(origin, &origin->n, &all_origins);
 	mowgli_pollable_setselect(ev, origin->poll, MOWGLI_EVENTLOOP_IO_READ,
 	                          accept_ready);
@@ -451,7 +1031,7 @@ int u_link_origin_create(mowgli_eventloop_t *ev, ushort port)
 			close(fd);
 			continue;
 		}
-		if (listen(fd, 5) < 0) {
+		if (listen(fd, listen_backlog) < 0) {
 			close(fd);
 			continue;
 		}
@@ -475,20 +1055,28 @@ static void accept_ready(mowgli_eventloop_t *ev, mowgli_eventloop_io_t *io,
                          mowgli_eventloop_io_dir_t dir, void *priv)
 {
 	mowgli_eventloop_pollable_t *poll = mowgli_eventloop_io_pollable(io);
+	u_link_origin *origin = priv;
 	u_conn *conn;
 	u_link *link;
+	int n;
 
 	sync_time();
 
-	link = link_create();
+	/* Accept until the listener is drained, but no more than the budget
+	   at once, so a reconnect storm can't starve existing connections.
+	   Anything left over is picked up on the next loop iteration. */
+	for (n=0; n<origin->budget; n++) {
+		link = link_create();
+		link->reg.accept = u_mono_usec();
 
-	if (!(conn = u_conn_accept(ev, &u_link_conn_ctx, link, 0, poll->fd))) {
-		link_destroy(link);
-		/* TODO: close listener, maybe? */
-		return;
-	}
+		if (!(conn = u_conn_accept(ev, &u_link_conn_ctx, link, 0, poll->fd))) {
+			link_destroy(link);
+			/* TODO: close listener on errors other than EAGAIN, maybe? */
+			break;
+		}
 
-	u_log(LG_VERBOSE, "new connection from %s", conn->ip);
+		u_log(LG_VERBOSE, "new connection from %s", conn->ip);
+	}
 }
 
 static void *conf_end(void *unused, void *unused2)
@@ -504,7 +1092,76 @@ static void *conf_end(void *unused, void *unused2)
 
 static void conf_listen(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
 {
+	listen_backlog = LISTEN_BACKLOG_DEFAULT;
+	accept_budget = ACCEPT_BUDGET_DEFAULT;
+
 	u_conf_traverse(cf, ce->entries, u_conf_listen_handlers);
+
+	listen_backlog = LISTEN_BACKLOG_DEFAULT;
+	accept_budget = ACCEPT_BUDGET_DEFAULT;
+}
+
+static void conf_listen_backlog(mowgli_config_file_t *cf,
+                                mowgli_config_file_entry_t *ce)
+{
+	int n = atoi(ce->vardata);
+
+	if (n <= 0) {
+		u_log(LG_ERROR, "%s: invalid listen backlog", ce->vardata);
+		return;
+	}
+
+	listen_backlog = n;
+}
+
+static void conf_listen_accept_budget(mowgli_config_file_t *cf,
+                                      mowgli_config_file_entry_t *ce)
+{
+	int n = atoi(ce->vardata);
+
+	if (n <= 0) {
+		u_log(LG_ERROR, "%s: invalid accept budget", ce->vardata);
+		return;
+	}
+
+	accept_budget = n;
+}
+
+static mowgli_patricia_t *u_conf_input_handlers = NULL;
+
+static void conf_input(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	u_conf_traverse(cf, ce->entries, u_conf_input_handlers);
+}
+
+static void conf_input_budget(mowgli_config_file_entry_t *ce, uint *budget)
+{
+	int n = atoi(ce->vardata);
+
+	if (n <= 0) {
+		u_log(LG_ERROR, "%s: invalid %s", ce->vardata, ce->varname);
+		return;
+	}
+
+	*budget = n;
+}
+
+static void conf_input_line_budget(mowgli_config_file_t *cf,
+                                   mowgli_config_file_entry_t *ce)
+{
+	conf_input_budget(ce, &line_budget);
+}
+
+static void conf_input_server_line_budget(mowgli_config_file_t *cf,
+                                          mowgli_config_file_entry_t *ce)
+{
+	conf_input_budget(ce, &server_line_budget);
+}
+
+static void conf_input_time_budget(mowgli_config_file_t *cf,
+                                   mowgli_config_file_entry_t *ce)
+{
+	conf_input_budget(ce, &time_budget);
 }
 
 static void conf_listen_port(mowgli_config_file_t *cf,
@@ -553,15 +1210,37 @@ static void conf_listen_port(mowgli_config_file_t *cf,
 /* main() API */
 /* ---------- */
 
+static bool after_events(void)
+{
+	bool busy = u_link_run_input();
+	return u_sendto_run_jobs() || busy;
+}
+
 int init_link(void)
 {
 	mowgli_list_init(&all_origins);
+	mowgli_list_init(&runq);
+
+	u_conn_after_events = after_events;
 
 	u_hook_add(HOOK_CONF_END, conf_end, NULL);
 	u_conf_add_handler("listen", conf_listen, NULL);
 
 	u_conf_listen_handlers = mowgli_patricia_create(ascii_canonize);
 	u_conf_add_handler("port", conf_listen_port, u_conf_listen_handlers);
+	u_conf_add_handler("backlog", conf_listen_backlog, u_conf_listen_handlers);
+	u_conf_add_handler("accept_budget", conf_listen_accept_budget,
+	                   u_conf_listen_handlers);
+
+	u_conf_add_handler("input", conf_input, NULL);
+
+	u_conf_input_handlers = mowgli_patricia_create(ascii_canonize);
+	u_conf_add_handler("line_budget", conf_input_line_budget,
+	                   u_conf_input_handlers);
+	u_conf_add_handler("server_line_budget", conf_input_server_line_budget,
+	                   u_conf_input_handlers);
+	u_conf_add_handler("time_budget", conf_input_time_budget,
+	                   u_conf_input_handlers);
 
 	return 0;
 }
@@ -572,6 +1251,7 @@ int init_link(void)
 mowgli_json_t *u_link_to_json(u_link *link)
 {
 	mowgli_json_t *jl;
+	uchar *ibuf;
 
 	if (!link)
 		return NULL;
@@ -583,7 +1263,13 @@ mowgli_json_t *u_link_to_json(u_link *link)
 	json_oseti  (jl, "sendq", link->sendq);
 	json_oseto  (jl, "ck_sendto", u_cookie_to_json(&link->ck_sendto));
 	json_oseto  (jl, "conn",  u_conn_to_json(link->conn));
-	json_osetb64(jl, "ibuf",  link->ibuf + link->ibufskip, link->ibuflen - link->ibufskip);
+	json_oseti  (jl, "ibufmax", link->ibufmax);
+	json_osetb64(jl, "regtime", &link->reg, sizeof(link->reg));
+
+	ibuf = malloc(link->ibuflen - link->ibufskip);
+	ibuf_copy(link, link->ibufskip, ibuf);
+	json_osetb64(jl, "ibuf",  ibuf, link->ibuflen - link->ibufskip);
+	free(ibuf);
 
 	switch (link->type) {
 		case LINK_USER:
@@ -606,23 +1292,48 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 {
 	u_link *link;
 	mowgli_json_t *jcookie, *jconn;
-	mowgli_string_t *jpass, *jslinkname;
+	mowgli_string_t *jpass, *jslinkname, *jibuf;
 	ssize_t sz;
+	size_t size;
+	int ibufmax;
+	uchar regtime[sizeof(u_link_regtime) + 8];
 
 	link = link_create();
 
 	if (json_ogetu(jl, "flags", &link->flags) < 0)
 		goto error;
+	/* users that were held are held again by their next command */
+	link->flags &= ~U_LINK_WAIT_FLOOD;
 	if (json_ogetu(jl, "type", &link->type) < 0)
 		goto error;
 	if (json_ogeti(jl, "sendq", &link->sendq) < 0)
 		goto error;
 
-	if ((sz = json_ogetb64(jl, "ibuf", link->ibuf, IBUFSIZE)) < 0)
+	if (!(jibuf = json_ogets(jl, "ibuf")))
+		goto error;
+
+	/* the buffer has to be big enough for what the old process had
+	   read. Older dumps don't have ibufmax. */
+	size = base64_deflate_size(jibuf->pos);
+	if (size < IBUFSIZE)
+		size = IBUFSIZE;
+
+	free(link->ibuf);
+	ibuf_init(link, size);
+
+	if ((sz = json_ogetb64(jl, "ibuf", link->ibuf, link->ibufsize)) < 0)
 		goto error;
 
 	link->ibuflen = sz;
-	link->ibuf[link->ibuflen] = '\0';
+
+	if (json_ogeti(jl, "ibufmax", &ibufmax))
+		u_link_set_recvq(link, ibufmax);
+
+	/* the monotonic clock carries on across exec. Older dumps don't
+	   have this, and those links just aren't timed. */
+	if (json_ogetb64(jl, "regtime", regtime, sizeof(regtime))
+	    == sizeof(link->reg))
+		memcpy(&link->reg, regtime, sizeof(link->reg));
 
 	jpass = json_ogets(jl, "pass");
 	if (jpass) {
@@ -647,6 +1358,7 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 		goto error;
 
 	link->conn->priv = link;
+	u_sendq_set_acct(&link->conn->sendq, link->type);
 
 	/* This must run after the config has been loaded. */
 	switch (link->type) {
@@ -657,6 +1369,7 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 				link->conf.auth = u_find_auth(link);
 				if (!link->conf.auth)
 					goto error;
+				u_link_set_ping(link, link->conf.auth->cls->timeout);
 			}
 
 			break;
@@ -670,6 +1383,8 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 			link->conf.link = u_find_link(jslinkname->str);
 			if (!link->conf.link)
 				goto error;
+			if (link->flags & U_LINK_REGISTERED)
+				u_link_set_ping(link, link->conf.link->cls->timeout);
 
 			break;
 
@@ -682,7 +1397,10 @@ u_link *u_link_from_json(mowgli_json_t *jl)
 
 error:
 	if (link) {
+		u_timer_cancel(&u_timers, &link->timer);
+		slot_put(link);
 		free(link->pass);
+		free(link->ibuf);
 		free(link);
 	}
 	return NULL;
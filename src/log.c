@@ -6,6 +6,38 @@
 
 #include "ircd.h"
 
+#include <pthread.h>
+#include <semaphore.h>
+
+/* Once init_log has run, u_log only formats the line and copies it into
+   a ring, and a thread of its own passes it to u_log_handler. A slow
+   terminal or disk then holds up that thread rather than the event loop.
+   If the ring fills, lines are dropped and counted, and the writer says
+   how many when it next gets to write.
+
+   There's one producer, the main thread, and one consumer, the writer,
+   so the ring needs no locks. Records are variable-length and 8-byte
+   aligned. A record that won't fit before the end of the ring goes at
+   the start instead, after a record of size 0 that means "wrap". */
+
+#define LOG_RING_SIZE (1 << 20)
+
+struct log_rec {
+	uint size; /* including the header and padding, or 0 to wrap */
+	int level;
+	char tm[20];
+	char line[];
+};
+
+static uchar ring[LOG_RING_SIZE] __attribute__((aligned(8)));
+static uint64_t ring_head = 0; /* written by u_log */
+static uint64_t ring_tail = 0; /* written by the writer */
+static sem_t ring_sem;
+static bool ring_running = false;
+static pthread_t writer;
+
+uint64_t u_log_dropped = 0;
+
 static u_hook *log_hook = NULL;
 
 int default_handler(int level, char *tm, char *line)
@@ -26,11 +58,113 @@ int default_handler(int level, char *tm, char *line)
 int (*u_log_handler)(int, char*, char*) = default_handler;
 int u_log_level = LG_INFO;
 
+/* localtime() and the formatting only happen when the second changes */
+static char *log_time(void)
+{
+	static time_t last = -1;
+	static char tmbuf[20];
+	struct tm tm;
+
+	if (NOW.tv_sec == last)
+		return tmbuf;
+
+	last = NOW.tv_sec;
+	localtime_r(&last, &tm);
+	snprintf(tmbuf, 20, "%04d/%02d/%02d %02d:%02d:%02d",
+	         tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+	         tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+	return tmbuf;
+}
+
+static bool ring_put(int level, char *tm, char *line)
+{
+	struct log_rec *rec;
+	uint64_t tail;
+	size_t len = strlen(line);
+	uint need, pos, contig;
+
+	need = (sizeof(*rec) + len + 1 + 7) & ~7;
+	pos = ring_head % LOG_RING_SIZE;
+	contig = LOG_RING_SIZE - pos;
+	tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+
+	if (contig < need) {
+		if (LOG_RING_SIZE - (ring_head - tail) < contig + need)
+			return false;
+		((struct log_rec*)(ring + pos))->size = 0;
+		ring_head += contig;
+		pos = 0;
+	} else if (LOG_RING_SIZE - (ring_head - tail) < need) {
+		return false;
+	}
+
+	rec = (struct log_rec*)(ring + pos);
+	rec->size = need;
+	rec->level = level;
+	memcpy(rec->tm, tm, sizeof(rec->tm));
+	memcpy(rec->line, line, len + 1);
+
+	__atomic_store_n(&ring_head, ring_head + need, __ATOMIC_RELEASE);
+	sem_post(&ring_sem);
+
+	return true;
+}
+
+static void *writer_main(void *unused)
+{
+	struct log_rec *rec;
+	uint64_t head, tail = 0, dropped, reported = 0;
+	char buf[64];
+	uint pos;
+
+	for (;;) {
+		while (sem_wait(&ring_sem) < 0 && errno == EINTR);
+
+		head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+
+		while (tail != head) {
+			pos = tail % LOG_RING_SIZE;
+			rec = (struct log_rec*)(ring + pos);
+
+			if (rec->size == 0) {
+				tail += LOG_RING_SIZE - pos;
+				continue;
+			}
+
+			dropped = __atomic_load_n(&u_log_dropped,
+			                          __ATOMIC_RELAXED);
+			if (dropped != reported) {
+				snprintf(buf, 64, "%lu log lines dropped",
+				         (ulong)(dropped - reported));
+				u_log_handler(LG_WARN, rec->tm, buf);
+				reported = dropped;
+			}
+
+			u_log_handler(rec->level, rec->tm, rec->line);
+
+			tail += rec->size;
+			__atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+
+	return NULL;
+}
+
+void u_log_flush(void)
+{
+	while (ring_running &&
+	       __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) != ring_head)
+		usleep(1000);
+
+	/* the default handler's printf may still be holding them */
+	fflush(stdout);
+}
+
 int u_log(int level, char* fmt, ...)
 {
 	static bool logging = false;
-	struct tm *tm;
-	char tmbuf[512];
+	char *tm;
 	char buf[BUFSIZE];
 	va_list va;
 
@@ -45,14 +179,11 @@ int u_log(int level, char* fmt, ...)
 	vsnf(FMT_LOG, buf, BUFSIZE, fmt, va);
 	va_end(va);
 
-	tm = localtime(&NOW.tv_sec);
-	snf(FMT_LOG, tmbuf, 512, "%04d/%02d/%02d %02d:%02d:%02d",
-	    tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-	    tm->tm_hour, tm->tm_min, tm->tm_sec);
+	tm = log_time();
 
 	struct hook_log hook;
 	hook.level = level;
-	hook.time = tmbuf;
+	hook.time = tm;
 	hook.line = buf;
 	if (log_hook == NULL)
 		log_hook = u_hook_get(HOOK_LOG);
@@ -60,7 +191,16 @@ int u_log(int level, char* fmt, ...)
 
 	logging = false;
 
-	return u_log_handler(level, tmbuf, buf);
+	/* severe errors are usually followed by abort(), so they, and
+	   everything before them, are written out before we go on */
+	if (ring_running && level != LG_SEVERE) {
+		if (!ring_put(level, tm, buf))
+			__atomic_add_fetch(&u_log_dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	u_log_flush();
+	return u_log_handler(level, tm, buf);
 }
 
 void u_perror_real(const char *func, const char *s)
@@ -70,3 +210,30 @@ void u_perror_real(const char *func, const char *s)
 
 	u_log(LG_ERROR, "%s: %s: %s", func, s, error);
 }
+
+int init_log(void)
+{
+	sigset_t all, old;
+	int err;
+
+	if (sem_init(&ring_sem, 0, 0) < 0) {
+		u_perror("sem_init");
+		return 0;
+	}
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&writer, NULL, writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0) {
+		u_log(LG_WARN, "Could not start log writer, logging directly");
+		return 0;
+	}
+
+	ring_running = true;
+	atexit(u_log_flush);
+
+	return 0;
+}
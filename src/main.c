@@ -46,12 +46,17 @@ int init(void)
 	base_ev = mowgli_eventloop_create();
 	base_dns = mowgli_dns_create(base_ev, MOWGLI_DNS_TYPE_ASYNC);
 
+	INIT(init_log);
 	INIT(init_upgrade);
 	INIT(init_util);
 	INIT(init_module);
 	INIT(init_hook);
 	INIT(init_conf);
+	INIT(init_sendq);
 	INIT(init_conn);
+	INIT(init_iothread);
+	INIT(init_uring);
+	INIT(init_rdns);
 	INIT(init_auth);
 	INIT(init_server);
 	INIT(init_user);
@@ -62,8 +67,6 @@ int init(void)
 
 	u_module_load_directory("modules/core");
 
-	/* LINK TODO: add ping timer */
-
 	if (opt_port != 0 && u_link_origin_create(base_ev, opt_port) < 0)
 		return -1;
 
@@ -1,4 +1,4 @@
-/* Tethys, map.c -- AA tree
+/* Tethys, map.c -- AA tree and hash table
    Copyright (C) 2013 Alex Iadicicco
 
    This file is protected under the terms contained
@@ -36,6 +36,136 @@ static void n_key(u_map *map, u_map_n *n, void *k)
 	n->key = k;
 }
 
+/* Hash table
+   ----------
+   Robin Hood hashing with linear probing. Each slot remembers how far it
+   is from the slot its key hashes to, plus one, or 0 if it's empty. An
+   insert takes the slot of any entry closer to home than itself and
+   carries on with that entry instead, so probe lengths stay short and
+   even, and a lookup can stop as soon as it meets an entry closer to
+   home than it would be. A delete shifts the entries after it back one
+   slot, so there are no tombstones.
+
+   Entries don't move while the map is being iterated over, as sets
+   abort and deletes are put off until the end, like the tree's. */
+
+struct u_map_h {
+	void *key, *data;
+	uint dist;
+};
+
+#define H_MIN_SLOTS 8
+
+static uint h_home(u_map *map, void *key)
+{
+	/* Fibonacci hashing. Pointers' low bits are all alike, but every
+	   bit of the key goes into the upper half of the product */
+	return (((uint64_t)(uintptr_t)key * 0x9e3779b97f4a7c15ull) >> 32)
+	       & map->mask;
+}
+
+static u_map_h *h_find(u_map *map, void *key)
+{
+	u_map_h *h;
+	uint i, dist;
+
+	if (map->slots == NULL)
+		return NULL;
+
+	i = h_home(map, key);
+	for (dist=1; ; dist++) {
+		h = &map->slots[i];
+		if (h->dist < dist)
+			return NULL;
+		if (h->key == key)
+			return h;
+		i = (i + 1) & map->mask;
+	}
+}
+
+static void h_place(u_map *map, void *key, void *data)
+{
+	u_map_h cur, tmp;
+	uint i;
+
+	cur.key = key;
+	cur.data = data;
+	cur.dist = 1;
+
+	for (i = h_home(map, key); ; i = (i + 1) & map->mask) {
+		if (map->slots[i].dist == 0) {
+			map->slots[i] = cur;
+			return;
+		}
+		if (map->slots[i].dist < cur.dist) {
+			tmp = map->slots[i];
+			map->slots[i] = cur;
+			cur = tmp;
+		}
+		cur.dist++;
+	}
+}
+
+static void h_resize(u_map *map, uint nslots)
+{
+	u_map_h *old = map->slots;
+	uint i, oldslots = old ? map->mask + 1 : 0;
+
+	if (!(map->slots = calloc(nslots, sizeof(*map->slots)))) {
+		u_log(LG_SEVERE, "calloc() failed");
+		abort();
+	}
+	map->mask = nslots - 1;
+
+	for (i=0; i<oldslots; i++) {
+		if (old[i].dist != 0)
+			h_place(map, old[i].key, old[i].data);
+	}
+
+	free(old);
+}
+
+static void h_insert(u_map *map, void *key, void *data)
+{
+	uint nslots = map->slots ? map->mask + 1 : 0;
+
+	/* kept at most 7/8 full */
+	if ((map->used + 1) * 8 > nslots * 7)
+		h_resize(map, nslots ? nslots * 2 : H_MIN_SLOTS);
+
+	h_place(map, key, data);
+	map->used++;
+}
+
+static void h_delete(u_map *map, void *key)
+{
+	u_map_h *h = h_find(map, key);
+	uint i, j, nslots;
+
+	if (h == NULL)
+		return;
+
+	for (i = h - map->slots; ; i = j) {
+		j = (i + 1) & map->mask;
+		if (map->slots[j].dist <= 1)
+			break;
+		map->slots[i] = map->slots[j];
+		map->slots[i].dist--;
+	}
+	map->slots[i].dist = 0;
+	map->used--;
+
+	/* a channel that was once huge shouldn't keep its table */
+	nslots = map->mask + 1;
+	if (map->used == 0) {
+		free(map->slots);
+		map->slots = NULL;
+		map->mask = 0;
+	} else if (nslots > H_MIN_SLOTS && map->used * 8 < nslots) {
+		h_resize(map, nslots / 2);
+	}
+}
+
 static int n_cmp(u_map *map, void *k1, void *k2)
 {
 	if (map->flags & MAP_STRING_KEYS)
@@ -80,7 +210,7 @@ static void u_map_n_del(u_map *map, u_map_n *n)
 	free(n);
 }
 
-u_map *u_map_new(int string_keys)
+u_map *u_map_new(uint flags)
 {
 	u_map *map;
 
@@ -88,9 +218,16 @@ u_map *u_map_new(int string_keys)
 	if (map == NULL)
 		return NULL;
 
+	/* string keys are compared, not hashed */
+	if (flags & MAP_STRING_KEYS)
+		flags &= ~MAP_HASH;
+
 	map->iterdepth = 0;
-	map->flags = string_keys ? MAP_STRING_KEYS : 0;
+	map->flags = flags;
 	map->root = NULL;
+	map->slots = NULL;
+	map->mask = 0;
+	map->used = 0;
 	map->size = 0;
 
 	return map;
@@ -110,6 +247,7 @@ void u_map_free_n(u_map *map, u_map_n *n)
 void u_map_free(u_map *map)
 {
 	u_map_free_n(map, map->root);
+	free(map->slots);
 
 	free(map);
 }
@@ -128,7 +266,10 @@ static void delete_pending(u_map *map)
 
 	MOWGLI_LIST_FOREACH_SAFE(cur, tn, map->pending.head) {
 		u_log(LG_FINE, "DEL PENDING %p", cur->data);
-		map->root = aa_delete(map, map->root, cur->data);
+		if (map->flags & MAP_HASH)
+			h_delete(map, cur->data);
+		else
+			map->root = aa_delete(map, map->root, cur->data);
 		n_free(map, cur->data);
 		mowgli_list_delete(cur, &map->pending);
 	}
@@ -149,13 +290,29 @@ static void u_map_each_n(u_map *map, u_map_n *n, u_map_cb_t *cb, void *priv)
 	u_map_each_n(map, n->child[RIGHT], cb, priv);
 }
 
+static void u_map_each_h(u_map *map, u_map_cb_t *cb, void *priv)
+{
+	uint i;
+
+	if (map->slots == NULL)
+		return;
+
+	for (i=0; i<=map->mask; i++) {
+		if (map->slots[i].dist != 0)
+			cb(map, map->slots[i].key, map->slots[i].data, priv);
+	}
+}
+
 void u_map_each(u_map *map, u_map_cb_t *cb, void *priv)
 {
 	if (!map->iterdepth)
 		clear_pending(map);
 	map->iterdepth++;
 
-	u_map_each_n(map, map->root, cb, priv);
+	if (map->flags & MAP_HASH)
+		u_map_each_h(map, cb, priv);
+	else
+		u_map_each_n(map, map->root, cb, priv);
 
 	map->iterdepth--;
 	if (!map->iterdepth)
@@ -306,17 +463,45 @@ static u_map_n *aa_delete(u_map *map, u_map_n *tree, void *k)
 
 void *u_map_get(u_map *map, void *key)
 {
-	u_map_n *n = dumb_fetch(map, key);
+	u_map_n *n;
+	u_map_h *h;
+
+	if (map->flags & MAP_HASH) {
+		h = h_find(map, key);
+		return h == NULL ? NULL : h->data;
+	}
+
+	n = dumb_fetch(map, key);
 	return n == NULL ? NULL : n->data;
 }
 
+static void h_set(u_map *map, void *key, void *data)
+{
+	u_map_h *h = h_find(map, key);
+
+	if (h != NULL) {
+		h->data = data;
+		return;
+	}
+
+	map->size++;
+	h_insert(map, key, data);
+}
+
 void u_map_set(u_map *map, void *key, void *data)
 {
-	u_map_n *n = dumb_fetch(map, key);
+	u_map_n *n;
 
 	if (map->iterdepth)
 		abort();
 
+	if (map->flags & MAP_HASH) {
+		h_set(map, key, data);
+		return;
+	}
+
+	n = dumb_fetch(map, key);
+
 	if (n != NULL) {
 		n->data = data;
 		return;
@@ -328,11 +513,40 @@ void u_map_set(u_map *map, void *key, void *data)
 	map->root = aa_insert(map, map->root, n);
 }
 
+static void *h_del(u_map *map, void *key)
+{
+	u_map_h *h = h_find(map, key);
+	void *data;
+
+	if (h == NULL)
+		return NULL;
+
+	u_log(LG_FINE, "MAP: %p DEL %p", map, key);
+
+	/* as below */
+	map->size--;
+
+	data = h->data;
+	h->data = NULL;
+
+	if (map->iterdepth)
+		add_pending(map, key);
+	else
+		h_delete(map, key);
+
+	return data;
+}
+
 void *u_map_del(u_map *map, void *key)
 {
-	u_map_n *n = dumb_fetch(map, key);
+	u_map_n *n;
 	void *data;
 
+	if (map->flags & MAP_HASH)
+		return h_del(map, key);
+
+	n = dumb_fetch(map, key);
+
 	if (n == NULL)
 		return NULL;
 
@@ -391,9 +605,31 @@ static void map_dump_real(u_map *map, u_map_n *n, int depth)
 	fprintf(stderr, "]");
 }
 
+static void map_dump_h(u_map *map)
+{
+	uint i;
+
+	if (map->slots == NULL) {
+		fprintf(stderr, "*");
+		return;
+	}
+
+	for (i=0; i<=map->mask; i++) {
+		if (map->slots[i].dist == 0) {
+			fprintf(stderr, "%u: *\n", i);
+			continue;
+		}
+		fprintf(stderr, "%u: %p=%p (%u)\n", i, map->slots[i].key,
+		        map->slots[i].data, map->slots[i].dist);
+	}
+}
+
 void u_map_dump(u_map *map)
 {
-	map_dump_real(map, map->root, 1);
+	if (map->flags & MAP_HASH)
+		map_dump_h(map);
+	else
+		map_dump_real(map, map->root, 1);
 	fprintf(stderr, "\n");
 }
 
@@ -427,19 +663,45 @@ void u_map_each_start(u_map_each_state *state, u_map *map)
 		clear_pending(map);
 	map->iterdepth++;
 
-	try_queue(state, map->root);
+	state->i = 0;
+	if (!(map->flags & MAP_HASH))
+		try_queue(state, map->root);
+}
+
+static bool each_end(u_map_each_state *state)
+{
+	state->map->iterdepth--;
+	if (!state->map->iterdepth)
+		delete_pending(state->map);
+	return false;
+}
+
+static bool each_next_h(u_map_each_state *state, void **k, void **v)
+{
+	u_map *map = state->map;
+	u_map_h *h;
+
+	while (map->slots != NULL && state->i <= map->mask) {
+		h = &map->slots[state->i++];
+		if (h->dist == 0)
+			continue;
+		if (k) *k = h->key;
+		if (v) *v = h->data;
+		return true;
+	}
+
+	return each_end(state);
 }
 
 bool u_map_each_next(u_map_each_state *state, void **k, void **v)
 {
 	u_map_n *n;
 
-	if ((n = try_dequeue(state)) == NULL) {
-		state->map->iterdepth--;
-		if (!state->map->iterdepth)
-			delete_pending(state->map);
-		return false;
-	}
+	if (state->map->flags & MAP_HASH)
+		return each_next_h(state, k, v);
+
+	if ((n = try_dequeue(state)) == NULL)
+		return each_end(state);
 
 	if (k) *k = n->key;
 	if (v) *v = n->data;
@@ -6,58 +6,6 @@
 
 #include "ircd.h"
 
-char *ws_skip(char *s)
-{
-	while (*s && isspace(*s))
-		s++;
-	return s;
-}
-
-char *ws_cut(char *s)
-{
-	while (*s && !isspace(*s))
-		s++;
-	if (!*s) return s;
-	*s++ = '\0';
-	return ws_skip(s);
-}
-
-int u_msg_parse(u_msg *msg, char *s)
-{
-	int i;
-	s = ws_skip(s);
-	if (!*s) return -1;
-
-	if (*s == ':') {
-		msg->srcstr = ++s;
-		s = ws_cut(s);
-		if (!*s) return -1;
-	} else {
-		msg->srcstr = NULL;
-	}
-
-	msg->command = s;
-	s = ws_cut(s);
-
-	for (i=0; i<U_MSG_MAXARGS; i++)
-		msg->argv[i] = NULL;
-
-	for (msg->argc=0; msg->argc<U_MSG_MAXARGS && *s;) {
-		if (*s == ':') {
-			msg->argv[msg->argc++] = ++s;
-			break;
-		}
-
-		msg->argv[msg->argc++] = s;
-		s = ws_cut(s);
-	}
-
-	ascii_canonize(msg->command);
-
-	return 0;
-}
-
-
 int u_src_num(u_sourceinfo *si, int num, ...)
 {
 	va_list va;
@@ -97,9 +45,242 @@ void u_src_f(u_sourceinfo *si, const char *fmt, ...)
 
 mowgli_patricia_t *all_commands;
 
+/* command IDs */
+/* ----------- */
+
+/* Every command name gets a small integer ID the first time something
+   registers it, and keeps it. Each ID has a slot with the commands of
+   that name, and for each source bit, the command that bit selects.
+
+   Lines are matched to IDs with a perfect hash of all the names, made
+   by hash-and-displace: the name's hash picks a bucket, the bucket's
+   displacement is XORed into the hash to pick a table entry, and the
+   displacements are chosen so that no two names share an entry. A
+   lookup is one hash, two loads and one strcmp. The table is rebuilt
+   when a new name is registered. */
+
+#define NO_ID 0xffff
+
+struct cmd_slot {
+	char name[MAXCOMMANDLEN+1];
+	u_cmd *head;
+	ulong bits; /* all of the masks */
+	u_cmd *winner[32];
+
+	/* by the lowest bit of the command's mask, which is never shared
+	   by two commands of the same name */
+	u_cmd_stats *stats[32];
+};
+
+static struct cmd_slot *slots = NULL;
+static int nslots = 0;
+
+static mowgli_patricia_t *cmd_ids; /* name -> ID + 1 */
+
+static ushort *id_table = NULL;
+static ushort *id_disp = NULL;
+static uint id_seed;
+static uint id_bucket_bits, id_table_mask;
+static bool id_table_dirty = true;
+
+static int numeric_id = -1;
+static int encap_id = -1;
+
+static uint name_hash(uint seed, const char *s)
+{
+	uint h = 2166136261u ^ seed;
+
+	for (; *s; s++)
+		h = (h ^ (uchar)*s) * 16777619u;
+
+	return h ^ (h >> 15);
+}
+
+static uint id_bucket(uint h)
+{
+	return id_bucket_bits ? (h * 0x9e3779b1u) >> (32 - id_bucket_bits) : 0;
+}
+
+static int by_bucket_size(const void *a, const void *b)
+{
+	return ((const int*)b)[1] - ((const int*)a)[1];
+}
+
+/* tries to place every name using this seed */
+static bool id_table_try(uint seed, uint *hash, int (*order)[2], int *next)
+{
+	uint nbuckets = 1 << id_bucket_bits;
+	uint b, d, i, pos;
+	int k, j, n;
+
+	memset(id_table, 0xff, (id_table_mask + 1) * sizeof(*id_table));
+
+	for (i=0; i<nslots; i++)
+		hash[i] = name_hash(seed, slots[i].name);
+
+	/* chain the names in each bucket, and count them */
+	for (b=0; b<nbuckets; b++) {
+		order[b][0] = b;
+		order[b][1] = 0;
+		next[nslots + b] = -1;
+	}
+	for (i=0; i<nslots; i++) {
+		b = id_bucket(hash[i]);
+		next[i] = next[nslots + b];
+		next[nslots + b] = i;
+		order[b][1]++;
+	}
+
+	/* the fullest buckets are the hardest to place, so go first */
+	qsort(order, nbuckets, sizeof(*order), by_bucket_size);
+
+	for (k=0; k<nbuckets && order[k][1] > 0; k++) {
+		b = order[k][0];
+
+		for (d=0; d<=id_table_mask; d++) {
+			for (j=next[nslots + b]; j >= 0; j = next[j]) {
+				pos = (hash[j] ^ d) & id_table_mask;
+				if (id_table[pos] != NO_ID)
+					break;
+				id_table[pos] = j;
+			}
+
+			if (j < 0)
+				break;
+
+			/* undo the partial placement */
+			for (n=next[nslots + b]; n != j; n = next[n])
+				id_table[(hash[n] ^ d) & id_table_mask] = NO_ID;
+		}
+
+		if (d > id_table_mask)
+			return false;
+
+		id_disp[b] = d;
+	}
+
+	return true;
+}
+
+static void id_table_build(void)
+{
+	uint *hash, seed, size = 16;
+	int (*order)[2], *next;
+
+	id_table_dirty = false;
+
+	while (size < nslots * 2)
+		size <<= 1;
+
+	id_bucket_bits = 0;
+	while ((1 << (id_bucket_bits + 2)) < nslots)
+		id_bucket_bits++;
+
+	hash = malloc(nslots * sizeof(*hash));
+	next = malloc((nslots + (1 << id_bucket_bits)) * sizeof(*next));
+	order = malloc((1 << id_bucket_bits) * sizeof(*order));
+
+	/* with half of the table free, the first seed nearly always works */
+	for (seed=1;; seed++) {
+		if (seed % 64 == 0)
+			size <<= 1;
+
+		id_table_mask = size - 1;
+		id_table = realloc(id_table, size * sizeof(*id_table));
+		id_disp = realloc(id_disp, (1 << id_bucket_bits) * sizeof(*id_disp));
+
+		if (id_table_try(seed, hash, order, next))
+			break;
+	}
+
+	id_seed = seed;
+
+	free(hash);
+	free(next);
+	free(order);
+
+	u_log(LG_DEBUG, "Command table: %d names, %u entries, %u buckets, "
+	      "seed %u", nslots, size, 1 << id_bucket_bits, seed);
+}
+
+static int id_lookup(const char *name)
+{
+	uint h;
+	int id;
+
+	if (id_table_dirty)
+		id_table_build();
+
+	h = name_hash(id_seed, name);
+	id = id_table[(h ^ id_disp[id_bucket(h)]) & id_table_mask];
+
+	if (id == NO_ID || strcmp(slots[id].name, name))
+		return -1;
+
+	return id;
+}
+
+static int id_intern(const char *name)
+{
+	void *p;
+
+	if ((p = mowgli_patricia_retrieve(cmd_ids, name)) != NULL)
+		return (long)p - 1;
+
+	slots = realloc(slots, (nslots + 1) * sizeof(*slots));
+	memset(&slots[nslots], 0, sizeof(*slots));
+	u_strlcpy(slots[nslots].name, name, MAXCOMMANDLEN+1);
+
+	mowgli_patricia_add(cmd_ids, name, (void*)(long)(nslots + 1));
+	id_table_dirty = true;
+
+	if (streq(name, "###"))
+		numeric_id = nslots;
+
+	return nslots++;
+}
+
+/* works out which command each source bit selects, after the commands
+   with this name have changed */
+static void slot_update(struct cmd_slot *slot)
+{
+	u_cmd *cmd;
+	int i;
+
+	slot->bits = 0;
+	for (cmd = slot->head; cmd; cmd = cmd->next)
+		slot->bits |= cmd->mask;
+
+	for (i=0; i<32; i++) {
+		for (cmd = slot->head; cmd; cmd = cmd->next) {
+			if (cmd->mask & (1ul << i))
+				break;
+		}
+		slot->winner[i] = cmd;
+	}
+}
+
+int u_cmd_id(const char *name)
+{
+	/* map numerics to ### */
+	if (isdigit(name[0]) && isdigit(name[1]) && isdigit(name[2])
+	    && !name[3])
+		return numeric_id;
+
+	if (name[0] == '#' && streq(name, "###"))
+		return -1;
+
+	return id_lookup(name);
+}
+
+/* registration */
+/* ------------ */
+
 static int reg_one(u_cmd *cmd)
 {
+	struct cmd_slot *slot;
 	u_cmd *at, *cur;
+	int i;
 
 	u_log(LG_DEBUG, "Registering command %s", cmd->name);
 
@@ -120,9 +301,15 @@ static int reg_one(u_cmd *cmd)
 	cmd->loaded = true;
 
 	cmd->owner = u_module_loading();
+	cmd->id = id_intern(cmd->name);
 
-	cmd->runs = 0;
-	cmd->usecs = 0;
+	slot = &slots[cmd->id];
+	if (cmd->mask != 0) {
+		i = __builtin_ctzl(cmd->mask);
+		if (slot->stats[i] == NULL)
+			slot->stats[i] = calloc(1, sizeof(u_cmd_stats));
+		cmd->stats = slot->stats[i];
+	}
 
 	cmd->next = at;
 	cmd->prev = NULL;
@@ -132,6 +319,9 @@ static int reg_one(u_cmd *cmd)
 	}
 	mowgli_patricia_add(all_commands, cmd->name, cmd);
 
+	slot->head = cmd;
+	slot_update(slot);
+
 	return 0;
 }
 
@@ -150,6 +340,8 @@ int u_cmd_reg(u_cmd *cmd)
 
 void u_cmd_unreg(u_cmd *cmd)
 {
+	struct cmd_slot *slot = &slots[cmd->id];
+
 	if (cmd->next)
 		cmd->next->prev = cmd->prev;
 	if (cmd->prev)
@@ -161,7 +353,10 @@ void u_cmd_unreg(u_cmd *cmd)
 		mowgli_patricia_delete(all_commands, cmd->name);
 		if (cmd->next != NULL)
 			mowgli_patricia_add(all_commands, cmd->name, cmd->next);
+		slot->head = cmd->next;
 	}
+
+	slot_update(slot);
 }
 
 static void *on_module_unload(void *unused, void *m)
@@ -213,7 +408,7 @@ static bool fill_source_by_id(u_sourceinfo *si, u_link *link, char *src)
 	if (!isdigit(*src))
 		return false;
 
-	n = strlen(src);
+	n = strnlen(src, 10);
 
 	switch (n) {
 	case 3:
@@ -373,23 +568,26 @@ static void fill_source(u_sourceinfo *si, u_link *link, u_msg *msg)
 	}
 }
 
-static u_cmd *find_command(const char *command, ulong mask, ulong *bits_tested)
+static u_cmd *find_command(int id, ulong mask, ulong *bits_tested)
 {
+	struct cmd_slot *slot;
 	u_cmd *cmd;
 
 	*bits_tested = 0;
 
-	/* map numerics to ### */
-	if (!strcmp(command, "###"))
+	if (id < 0)
 		return NULL;
-	if (isdigit(command[0]) && isdigit(command[1])
-	    && isdigit(command[2]) && !command[3])
-		command = "###";
 
-	cmd = mowgli_patricia_retrieve(all_commands, command);
+	slot = &slots[id];
 
-	for (; cmd; cmd = cmd->next) {
-		*bits_tested |= cmd->mask;
+	/* when nothing matches, every mask was tried */
+	*bits_tested = slot->bits;
+
+	/* sources are nearly always down to one bit by now */
+	if (mask != 0 && (mask & (mask - 1)) == 0)
+		return slot->winner[__builtin_ctzl(mask)];
+
+	for (cmd = slot->head; cmd; cmd = cmd->next) {
 		if ((cmd->mask & mask) != 0)
 			break;
 	}
@@ -438,8 +636,32 @@ static void report_failure(u_sourceinfo *si, u_msg *msg, ulong bits_tested)
 	u_link_num(si->source, ERR_UNKNOWNCOMMAND, msg->command);
 }
 
+/* The link towards a UID, SID, or server name. Every user and server
+   keeps the local link its messages arrive on, and since the network is
+   a tree, that's also the way to send to it. */
+static u_link *route_to(u_link *source, char *ref)
+{
+	u_server *sv;
+	u_user *u;
+
+	if (isdigit(*ref) && strnlen(ref, 4) == 3) {
+		sv = u_server_by_sid(ref);
+		return sv ? sv->link : NULL;
+	}
+
+	if ((u = u_user_by_ref(source, ref)) != NULL)
+		return u->link;
+
+	if ((sv = u_server_by_name(ref)) != NULL)
+		return sv->link;
+
+	return NULL;
+}
+
 static void propagate_message(u_sourceinfo *si, u_msg *msg, u_cmd *cmd, char *line)
 {
+	u_link *link;
+
 	switch (cmd->flags & CMD_PROP_MASK) {
 	case CMD_PROP_NONE:
 		break;
@@ -449,14 +671,23 @@ static void propagate_message(u_sourceinfo *si, u_msg *msg, u_cmd *cmd, char *li
 		break;
 
 	case CMD_PROP_ONE_TO_ONE:
-		/* TODO: fix this when we decide what to do with u_entity
-		if (u_entity_from_ref(&e, msg->propagate) && e.link)
-			u_link_f(e.link, "%s", line); */
-		break;
-
 	case CMD_PROP_HUNTED:
-		u_log(LG_WARN, "%s uses unimplemented propagation "
-		      "type CMD_PROP_HUNTED");
+		if (msg->propagate == CMD_DO_BROADCAST) {
+			u_log(LG_WARN, "%s asked to broadcast a message that "
+			      "only has one target", cmd->name);
+			break;
+		}
+
+		link = route_to(si->source, msg->propagate);
+		if (link == NULL) {
+			u_log(LG_VERBOSE, "%s: no route to %s", cmd->name,
+			      msg->propagate);
+			break;
+		}
+
+		/* a local target was dealt with by the handler */
+		if (link->type == LINK_SERVER && link != si->source)
+			u_link_f(link, "%s", line);
 		break;
 
 	default:
@@ -466,16 +697,28 @@ static void propagate_message(u_sourceinfo *si, u_msg *msg, u_cmd *cmd, char *li
 	}
 }
 
+int u_cmd_sample = 1;
+
+void u_cmd_stats_reset(void)
+{
+	int id, i;
+
+	for (id=0; id<nslots; id++) {
+		for (i=0; i<32; i++) {
+			if (slots[id].stats[i] != NULL)
+				memset(slots[id].stats[i], 0, sizeof(u_cmd_stats));
+		}
+	}
+}
+
 static bool run_command(u_cmd *cmd, u_sourceinfo *si, u_msg *msg)
 {
-	struct timeval start, end, diff;
+	u_cmd_stats *stats = cmd->stats;
+	uint64_t start;
 
 	/* Rate limiting */
-	if (cmd->rate.deduction > 0 && si->u != NULL &&
-	    !u_ratelimit_allow(si->u, &cmd->rate, cmd->name))
-	{
-		return false;
-	}
+	if (cmd->rate.deduction > 0 && si->u != NULL)
+		u_ratelimit_penalize(si->u, &cmd->rate, cmd->name);
 
 	if (cmd->nargs && msg->argc < cmd->nargs) {
 		u_link_num(si->source, ERR_NEEDMOREPARAMS, cmd->name);
@@ -485,24 +728,98 @@ static bool run_command(u_cmd *cmd, u_sourceinfo *si, u_msg *msg)
 	msg->flags = 0;
 	msg->propagate = NULL;
 
-	gettimeofday(&start, NULL);
-	cmd->cb(si, msg);
-	gettimeofday(&end, NULL);
-	timersub(&end, &start, &diff);
+	/* the handler may unload the command, but not its stats */
+	if (stats == NULL) {
+		cmd->cb(si, msg);
+		return true;
+	}
+
+	stats->runs++;
+
+	if (stats->sample_left > 1) {
+		stats->sample_left--;
+		cmd->cb(si, msg);
+		return true;
+	}
 
-	cmd->runs++;
-	cmd->usecs += diff.tv_sec * 1000000 + diff.tv_usec;
+	stats->sample_left = u_cmd_sample;
+
+	start = u_mono_nsec();
+	cmd->cb(si, msg);
+	u_hist_add(&stats->hist, u_mono_nsec() - start);
 
 	return true;
 }
 
-static bool invoke_encap(u_sourceinfo *si, u_msg *msg, char *line)
+/* Where ENCAPs with a given mask go: the links towards servers whose
+   names match it, and whether we match it ourselves. Working this out
+   means matching the mask against every server, so it's done once per
+   mask and kept until a server comes or goes. */
+struct encap_route {
+	bool local;
+	uint nlinks;
+	u_link *links[];
+};
+
+#define ENCAP_ROUTES_MAX 256
+
+static mowgli_patricia_t *encap_routes = NULL;
+static uint encap_routes_count = 0;
+static uint encap_routes_topology = 0;
+
+static void encap_route_free(const char *key, void *data, void *priv)
+{
+	free(data);
+}
+
+static struct encap_route *encap_route(char *mask)
 {
 	mowgli_patricia_iteration_state_t state;
+	struct encap_route *r;
 	u_server *sv;
+	uint i, max;
+
+	if (encap_routes_topology != u_server_topology ||
+	    encap_routes_count >= ENCAP_ROUTES_MAX) {
+		mowgli_patricia_destroy(encap_routes, encap_route_free, NULL);
+		encap_routes = mowgli_patricia_create(NULL);
+		encap_routes_count = 0;
+		encap_routes_topology = u_server_topology;
+	}
+
+	if ((r = mowgli_patricia_retrieve(encap_routes, mask)) != NULL)
+		return r;
+
+	max = me.nlinks;
+	if (!(r = malloc(sizeof(*r) + max * sizeof(*r->links)))) {
+		u_log(LG_SEVERE, "malloc() failed");
+		abort();
+	}
+
+	r->local = matchcase(mask, me.name);
+	r->nlinks = 0;
+
+	MOWGLI_PATRICIA_FOREACH(sv, &state, servers_by_sid) {
+		if (!sv->link || !matchcase(mask, sv->name))
+			continue;
+		for (i=0; i<r->nlinks && r->links[i] != sv->link; i++);
+		if (i == r->nlinks && r->nlinks < max)
+			r->links[r->nlinks++] = sv->link;
+	}
+
+	mowgli_patricia_add(encap_routes, mask, r);
+	encap_routes_count++;
+
+	return r;
+}
+
+static bool invoke_encap(u_sourceinfo *si, u_msg *msg, char *line)
+{
+	struct encap_route *route;
 	char *mask, *subcmd;
 	ulong bits, bits_tested;
 	u_cmd *cmd;
+	uint i;
 
 	if (msg->argc < 2) {
 		u_link_num(si->source, ERR_NEEDMOREPARAMS, "ENCAP");
@@ -511,15 +828,14 @@ static bool invoke_encap(u_sourceinfo *si, u_msg *msg, char *line)
 
 	mask = msg->argv[0];
 	subcmd = msg->argv[1];
+	route = encap_route(mask);
 
-	if (!streq(mask, "*") && !streq(mask, me.name)
-	    && !matchcase(mask, me.name)) {
+	if (!route->local)
 		goto propagate;
-	}
 
 	bits = si->u ? SRC_ENCAP_USER : SRC_ENCAP_SERVER;
 
-	if ((cmd = find_command(subcmd, bits, &bits_tested))) {
+	if ((cmd = find_command(u_cmd_id(subcmd), bits, &bits_tested))) {
 		u_log(LG_FINE, "%I INVOKE ENCAP %s [%p]", si, subcmd);
 		run_command(cmd, si, msg);
 	} else {
@@ -529,11 +845,8 @@ static bool invoke_encap(u_sourceinfo *si, u_msg *msg, char *line)
 propagate:
 	u_sendto_start();
 	u_sendto_skip(si->source);
-	MOWGLI_PATRICIA_FOREACH(sv, &state, servers_by_sid) {
-		if (!matchcase(mask, sv->name) || !sv->link)
-			continue;
-		u_sendto(sv->link, line);
-	}
+	for (i=0; i<route->nlinks; i++)
+		u_sendto(route->links[i], "%s", line);
 
 	return true;
 }
@@ -543,19 +856,21 @@ void u_cmd_invoke(u_link *link, u_msg *msg, char *line)
 	u_cmd *cmd, *last_cmd;
 	u_sourceinfo si;
 	ulong bits_tested;
+	int id;
 
 	last_cmd = NULL;
+	id = u_cmd_id(msg->command);
 
 again:
 	fill_source(&si, link, msg);
 	u_log(LG_FINE, "source mask = 0x%x", si.mask);
 
-	if (link->type == LINK_SERVER && streq(msg->command, "ENCAP")) {
+	if (link->type == LINK_SERVER && id == encap_id) {
 		invoke_encap(&si, msg, line);
 		return;
 	}
 
-	if (!(cmd = find_command(msg->command, si.mask, &bits_tested))) {
+	if (!(cmd = find_command(id, si.mask, &bits_tested))) {
 		report_failure(&si, msg, bits_tested);
 		return;
 	}
@@ -605,12 +920,46 @@ int u_repeat_as_server(u_sourceinfo *si, u_msg *msg, char *sid)
 	return 0;
 }
 
+static mowgli_patricia_t *u_conf_commands_handlers = NULL;
+
+static void conf_commands(mowgli_config_file_t *cf,
+                          mowgli_config_file_entry_t *ce)
+{
+	u_conf_traverse(cf, ce->entries, u_conf_commands_handlers);
+}
+
+static void conf_commands_sample(mowgli_config_file_t *cf,
+                                 mowgli_config_file_entry_t *ce)
+{
+	int n = atoi(ce->vardata);
+
+	if (n <= 0) {
+		u_log(LG_ERROR, "%s: invalid command sample rate", ce->vardata);
+		return;
+	}
+
+	u_cmd_sample = n;
+}
+
 int init_cmd(void)
 {
 	u_hook_add(HOOK_MODULE_UNLOAD, on_module_unload, NULL);
 
+	u_conf_add_handler("commands", conf_commands, NULL);
+
+	u_conf_commands_handlers = mowgli_patricia_create(ascii_canonize);
+	u_conf_add_handler("sample", conf_commands_sample,
+	                   u_conf_commands_handlers);
+
 	if ((all_commands = mowgli_patricia_create(NULL)) == NULL)
 		return -1;
+	if ((cmd_ids = mowgli_patricia_create(NULL)) == NULL)
+		return -1;
+	if ((encap_routes = mowgli_patricia_create(NULL)) == NULL)
+		return -1;
+
+	/* ENCAP is handled here, rather than being a command */
+	encap_id = id_intern("ENCAP");
 
 	return 0;
 }
@@ -0,0 +1,160 @@
+/* Tethys, parse.c -- IRC message parsing
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+#define CC_SPACE  0x01
+#define CC_END    0x02
+
+/* the same whitespace as isspace() in the C locale, without asking the
+   locale */
+static const uchar cclass[256] = {
+	['\0'] = CC_END,
+	[' ']  = CC_SPACE,
+	['\t'] = CC_SPACE,
+	['\n'] = CC_SPACE,
+	['\v'] = CC_SPACE,
+	['\f'] = CC_SPACE,
+	['\r'] = CC_SPACE,
+};
+
+#define IS_SPACE(c) (cclass[(uchar)(c)] & CC_SPACE)
+#define IS_DELIM(c) (cclass[(uchar)(c)] & (CC_SPACE | CC_END))
+
+static const char *skip_space(const char *s)
+{
+	while (IS_SPACE(*s))
+		s++;
+	return s;
+}
+
+/* fills in the span for the word at s, and returns where the next one
+   starts */
+static const char *word(u_span *sp, const char *s)
+{
+	const char *p = s;
+
+	while (!IS_DELIM(*p))
+		p++;
+
+	sp->p = s;
+	sp->len = p - s;
+
+	return skip_space(p);
+}
+
+int u_msg_scan(u_msg_spans *ms, const char *s)
+{
+	static const u_span missing = { NULL, 0 };
+	size_t i;
+
+	s = skip_space(s);
+
+	ms->tags = missing;
+	if (*s == '@') {
+		s = word(&ms->tags, s + 1);
+	}
+
+	ms->src = missing;
+	if (*s == ':') {
+		s = word(&ms->src, s + 1);
+	}
+
+	if (!*s)
+		return -1;
+
+	s = word(&ms->command, s);
+
+	if (ms->command.len <= MAXCOMMANDLEN) {
+		for (i=0; i<ms->command.len; i++) {
+			char c = ms->command.p[i];
+			ms->cmd[i] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+		}
+		ms->cmd[i] = '\0';
+	} else {
+		ms->cmd[0] = '\0';
+	}
+
+	for (ms->argc=0; ms->argc<U_MSG_MAXARGS && *s;) {
+		if (*s == ':') {
+			/* the rest of the line, spaces and all */
+			ms->argv[ms->argc].p = ++s;
+			ms->argv[ms->argc++].len = strlen(s);
+			break;
+		}
+
+		s = word(&ms->argv[ms->argc++], s);
+	}
+
+	return 0;
+}
+
+bool u_msg_tag(u_msg_spans *ms, const char *key, u_span *value)
+{
+	const char *p = ms->tags.p, *end = p + ms->tags.len;
+	const char *k, *v, *next;
+	size_t klen = strlen(key);
+
+	if (p == NULL)
+		return false;
+
+	while (p < end) {
+		if (!(next = memchr(p, ';', end - p)))
+			next = end;
+
+		k = p;
+		if (!(v = memchr(k, '=', next - k)))
+			v = next;
+
+		if ((size_t)(v - k) == klen && !memcmp(k, key, klen)) {
+			if (v < next)
+				v++;
+			value->p = v;
+			value->len = next - v;
+			return true;
+		}
+
+		p = next + 1;
+	}
+
+	return false;
+}
+
+static char *term(u_span *sp)
+{
+	char *s = (char*)sp->p;
+	s[sp->len] = '\0';
+	return s;
+}
+
+int u_msg_parse(u_msg *msg, char *s)
+{
+	u_msg_spans *ms = &msg->spans;
+	char *p;
+	int i;
+
+	if (u_msg_scan(ms, s) < 0)
+		return -1;
+
+	msg->srcstr = ms->src.p ? term(&ms->src) : NULL;
+
+	if (ms->cmd[0]) {
+		msg->command = ms->cmd;
+	} else {
+		/* too long to be a command, but it's in error messages */
+		msg->command = term(&ms->command);
+		for (p = msg->command; *p; p++)
+			*p = (*p >= 'a' && *p <= 'z') ? *p - 'a' + 'A' : *p;
+	}
+
+	for (i=0; i<ms->argc; i++)
+		msg->argv[i] = term(&ms->argv[i]);
+	for (; i<U_MSG_MAXARGS; i++)
+		msg->argv[i] = NULL;
+	msg->argc = ms->argc;
+
+	return 0;
+}
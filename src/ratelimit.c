@@ -7,46 +7,103 @@
 
 #include "ircd.h"
 
-void u_ratelimit_init(u_user *user)
+/* users whose input is held, checked every second by release_held. The
+ * timer is added by the first hold and kept from then on; destroying a
+ * repeating timer from its own callback would leave mowgli rescheduling
+ * freed memory. */
+static mowgli_list_t held_users;
+static mowgli_eventloop_timer_t *held_timer = NULL;
+
+static void get_limits(u_user *user, uint64_t *burst, uint64_t *rate)
 {
-	user->limit.tokens = FLOODTOKENS;
-	user->limit.last = NOW.tv_sec;
+	u_class_block *cls = NULL;
+
+	if (user->link && user->link->conf.auth)
+		cls = user->link->conf.auth->cls;
+
+	*burst = (cls ? cls->flood_burst : U_FLOOD_BURST) * 1000;
+	*rate = cls ? cls->flood_rate : U_FLOOD_RATE;
 }
 
-/* Should we allow a given command? */
-bool u_ratelimit_allow(u_user *user, u_ratelimit_cmd_t *deduct, const char *cmd)
+static void release_held(void *unused)
 {
-	time_t lastrate, numtokens;
+	mowgli_node_t *n, *tn;
+	uint64_t now = u_mono_usec() / 1000;
+	uint64_t burst, rate;
+	u_user *user;
 
-	if ((strcasecmp(cmd, "WHO") == 0) && (user->limit.whotokens > 0)) {
-		/* Compensate for WHO */
-		u_ratelimit_who_deduct(user);
-		return true;
+	if (held_users.count == 0)
+		return;
+
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, held_users.head) {
+		user = n->data;
+		get_limits(user, &burst, &rate);
+
+		if (user->limit.lag > now + burst)
+			continue;
+
+		user->limit.held = false;
+		mowgli_node_delete(&user->limit.n, &held_users);
+		u_link_hold_input(user->link, false);
 	}
+}
 
-	lastrate = NOW.tv_sec - user->limit.last;
-	numtokens = lastrate / REFILLPERIOD;
+static void hold(u_user *user)
+{
+	if (user->limit.held)
+		return;
 
-	/* Update the last executed time */
-	user->limit.last = NOW.tv_sec;
+	u_log(LG_VERBOSE, "User %U flooding, holding input", user);
 
-	/* Grant tokens if needed */
-	user->limit.tokens += numtokens;
-	if (user->limit.tokens > FLOODTOKENS)
-		user->limit.tokens = FLOODTOKENS;
+	user->limit.held = true;
+	mowgli_node_add(user, &user->limit.n, &held_users);
+	u_link_hold_input(user->link, true);
 
-	/* Subtract tokens */
-	if ((user->limit.tokens <= deduct->deduction) ||
-	    (user->limit.tokens - deduct->deduction) == 0) {
-		user->limit.tokens = 0;
+	if (held_timer == NULL) {
+		held_timer = mowgli_timer_add(base_ev, "release_held",
+		                              release_held, NULL, 1);
+	}
+}
 
-		u_log(LG_WARN, "User %U flooding!", user);
+void u_ratelimit_init(u_user *user)
+{
+	user->limit.lag = 0;
+	user->limit.held = false;
+}
 
-		/* XXX do a kill */
-		return false;
+void u_ratelimit_fini(u_user *user)
+{
+	if (!user->limit.held)
+		return;
+
+	user->limit.held = false;
+	mowgli_node_delete(&user->limit.n, &held_users);
+}
+
+/* Charge a local user for a command. The command still runs; it's the
+ * ones after it that wait. */
+void u_ratelimit_penalize(u_user *user, u_ratelimit_cmd_t *deduct, const char *cmd)
+{
+	uint64_t now, burst, rate;
+
+	if ((strcasecmp(cmd, "WHO") == 0) && (user->limit.whotokens > 0)) {
+		/* Compensate for WHO */
+		u_ratelimit_who_deduct(user);
+		return;
 	}
 
-	return true;
+	if (!IS_LOCAL_USER(user) || (user->mode & UMODE_OPER))
+		return;
+
+	get_limits(user, &burst, &rate);
+	now = u_mono_usec() / 1000;
+
+	if (user->limit.lag < now)
+		user->limit.lag = now;
+	user->limit.lag += deduct->deduction * 1000 / rate;
+
+	if (user->limit.lag > now + burst)
+		hold(user);
 }
 
 /* Credit a user for join */
@@ -62,30 +119,33 @@ void u_ratelimit_who_deduct(u_user *user)
 		user->limit.whotokens--;
 }
 
+/* Whether input is held isn't kept; the next command will hold it again
+ * if the penalty is still too high. */
 mowgli_json_t *u_ratelimit_to_json(u_ratelimit_t *limit)
 {
 	mowgli_json_t *o = mowgli_json_create_object();
-	json_osetu(o, "tokens", limit->tokens);
-	json_osetu(o, "whotokens", limit->tokens);
-	json_osettime(o, "last", limit->last);
+	uint64_t now = u_mono_usec() / 1000;
+
+	json_osetu(o, "whotokens", limit->whotokens);
+	json_osetu(o, "lagms", limit->lag > now ? limit->lag - now : 0);
 
 	return o;
 }
 
 int u_ratelimit_from_json(mowgli_json_t *jrl, u_ratelimit_t *limit)
 {
-	int err;
+	unsigned lagms;
+
 	if (MOWGLI_JSON_TAG(jrl) != MOWGLI_JSON_TAG_OBJECT)
 		return -1;
 
-	if ((err = json_ogetu(jrl, "tokens", &limit->tokens)) < 0)
-		return err;
-
-	if ((err = json_ogetu(jrl, "whotokens", &limit->tokens)) < 0)
-		return err;
+	if (!json_ogetu(jrl, "whotokens", &limit->whotokens))
+		limit->whotokens = 0;
 
-	if ((err = json_ogettime(jrl, "last", &limit->last)) < 0)
-		return err;
+	/* older dumps used tokens, and start out with no penalty */
+	limit->lag = 0;
+	if (json_ogetu(jrl, "lagms", &lagms))
+		limit->lag = u_mono_usec() / 1000 + lagms;
 
 	return 0;
 }
@@ -0,0 +1,385 @@
+/* Tethys, rdns.c -- cached reverse DNS lookups
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* A lookup is a PTR query for the address, followed by an A or AAAA
+   query for the name that comes back, which has to lead back to the
+   same address. The outcome, good or bad, is remembered per address for
+   a while. After a netsplit, most reconnecting clients come from a
+   handful of addresses, and they all get their answer at once from the
+   cache or from the one lookup already in progress. */
+
+#include "ircd.h"
+
+#define RDNS_HASH_SIZE 4096
+
+#define RDNS_PTR      1
+#define RDNS_FORWARD  2
+#define RDNS_DONE     3
+
+typedef struct rdns_entry rdns_entry;
+
+struct rdns_entry {
+	int family;
+	uchar addr[16];
+
+	int state;
+	char host[U_CONN_HOSTSIZE];
+	const char *err;
+	time_t expires;
+
+	mowgli_dns_query_t q_ptr;
+	mowgli_dns_query_t q_fwd;
+	mowgli_list_t waiters;
+
+	rdns_entry *hnext;
+	mowgli_node_t lru;      /* only finished entries are in the LRU */
+};
+
+struct u_rdns_query {
+	rdns_entry *e;
+	u_rdns_cb_t *cb;
+	void *priv;
+	mowgli_node_t n;
+};
+
+u_rdns_stats rdns_stats;
+
+static rdns_entry *hash[RDNS_HASH_SIZE];
+static mowgli_list_t lru;
+
+static int cache_size = 4096;
+static int cache_ttl = 3600;
+static int negative_ttl = 300;
+
+/* addresses */
+/* --------- */
+
+static int addr_len(int family)
+{
+	return family == AF_INET6 ? 16 : 4;
+}
+
+/* IPv4-mapped IPv6 addresses are treated as the IPv4 addresses they are */
+static bool addr_key(const struct sockaddr *sa, int *family, uchar *addr)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		*family = AF_INET;
+		memcpy(addr, &sin->sin_addr, 4);
+		return true;
+
+	case AF_INET6:
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			*family = AF_INET;
+			memcpy(addr, sin6->sin6_addr.s6_addr + 12, 4);
+		} else {
+			*family = AF_INET6;
+			memcpy(addr, &sin6->sin6_addr, 16);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+static void key_to_sockaddr(rdns_entry *e, struct sockaddr_storage *ss)
+{
+	memset(ss, 0, sizeof(*ss));
+	ss->ss_family = e->family;
+
+	if (e->family == AF_INET6)
+		memcpy(&((struct sockaddr_in6*)ss)->sin6_addr, e->addr, 16);
+	else
+		memcpy(&((struct sockaddr_in*)ss)->sin_addr, e->addr, 4);
+}
+
+static uint addr_hash(int family, const uchar *addr)
+{
+	uint h = 2166136261u ^ family;
+	int i;
+
+	for (i=0; i<addr_len(family); i++)
+		h = (h ^ addr[i]) * 16777619u;
+
+	return h & (RDNS_HASH_SIZE - 1);
+}
+
+/* cache */
+/* ----- */
+
+static rdns_entry *entry_find(int family, const uchar *addr)
+{
+	rdns_entry *e;
+
+	e = hash[addr_hash(family, addr)];
+	for (; e; e = e->hnext) {
+		if (e->family == family &&
+		    !memcmp(e->addr, addr, addr_len(family)))
+			return e;
+	}
+
+	return NULL;
+}
+
+/* only finished entries may be freed; anything else still has a query
+   pointing at it */
+static void entry_free(rdns_entry *e)
+{
+	rdns_entry **p;
+
+	for (p = &hash[addr_hash(e->family, e->addr)]; *p; p = &(*p)->hnext) {
+		if (*p == e) {
+			*p = e->hnext;
+			break;
+		}
+	}
+
+	mowgli_node_delete(&e->lru, &lru);
+	rdns_stats.entries--;
+	free(e);
+}
+
+static rdns_entry *entry_new(int family, const uchar *addr)
+{
+	rdns_entry *e;
+	uint h;
+
+	while (lru.count > 0 && lru.count >= (size_t)cache_size)
+		entry_free(lru.tail->data);
+
+	e = calloc(1, sizeof(*e));
+	e->family = family;
+	memcpy(e->addr, addr, addr_len(family));
+	e->state = RDNS_PTR;
+
+	h = addr_hash(family, addr);
+	e->hnext = hash[h];
+	hash[h] = e;
+
+	rdns_stats.entries++;
+
+	return e;
+}
+
+static void finish(rdns_entry *e, bool found, const char *err)
+{
+	mowgli_node_t *n;
+	u_rdns_query *q;
+
+	e->state = RDNS_DONE;
+	e->err = err;
+	e->expires = NOW.tv_sec + (found ? cache_ttl : negative_ttl);
+
+	if (!found)
+		e->host[0] = '\0';
+
+	mowgli_node_add_head(e, &e->lru, &lru);
+
+	/* a callback could cancel another waiter, so start from the head
+	   every time */
+	while ((n = e->waiters.head) != NULL) {
+		q = n->data;
+		mowgli_node_delete(&q->n, &e->waiters);
+		q->cb(q->priv, found ? e->host : NULL, err);
+		free(q);
+	}
+}
+
+/* lookups */
+/* ------- */
+
+static const char *reason_str(int reason)
+{
+	switch (reason) {
+	case MOWGLI_DNS_RES_NXDOMAIN:
+		return "No such domain";
+	case MOWGLI_DNS_RES_INVALID:
+		return "Invalid domain";
+	case MOWGLI_DNS_RES_TIMEOUT:
+		return "Request timeout";
+	}
+
+	return "Unknown error";
+}
+
+static void fwd_callback(mowgli_dns_reply_t *reply, int reason, void *vptr)
+{
+	rdns_entry *e = vptr;
+	uchar addr[16];
+	int family;
+
+	sync_time();
+
+	if (reply == NULL) {
+		finish(e, false, reason_str(reason));
+		return;
+	}
+
+	if (!addr_key((struct sockaddr*)&reply->addr.addr, &family, addr) ||
+	    family != e->family ||
+	    memcmp(addr, e->addr, addr_len(family))) {
+		finish(e, false, "Forward lookup mismatch");
+		return;
+	}
+
+	finish(e, true, NULL);
+}
+
+static void ptr_callback(mowgli_dns_reply_t *reply, int reason, void *vptr)
+{
+	rdns_entry *e = vptr;
+
+	sync_time();
+
+	if (reply == NULL) {
+		finish(e, false, reason_str(reason));
+		return;
+	}
+
+	if (strlen(reply->h_name) > MAXHOST) {
+		finish(e, false, "Hostname too long");
+		return;
+	}
+
+	u_strlcpy(e->host, reply->h_name, U_CONN_HOSTSIZE);
+
+	e->state = RDNS_FORWARD;
+	e->q_fwd.ptr = e;
+	e->q_fwd.callback = fwd_callback;
+
+	rdns_stats.queries++;
+	mowgli_dns_gethost_byname(base_dns, e->host, &e->q_fwd,
+	                          e->family == AF_INET6 ? MOWGLI_DNS_T_AAAA
+	                                                : MOWGLI_DNS_T_A);
+}
+
+u_rdns_query *u_rdns_lookup(const struct sockaddr *sa, u_rdns_cb_t *cb,
+                            void *priv)
+{
+	struct sockaddr_storage ss;
+	u_rdns_query *q;
+	rdns_entry *e;
+	uchar addr[16];
+	int family;
+
+	if (!addr_key(sa, &family, addr)) {
+		cb(priv, NULL, "Unsupported address family");
+		return NULL;
+	}
+
+	e = entry_find(family, addr);
+
+	if (e && e->state == RDNS_DONE &&
+	    (e->expires <= NOW.tv_sec || cache_size == 0)) {
+		entry_free(e);
+		e = NULL;
+	}
+
+	if (e && e->state == RDNS_DONE) {
+		rdns_stats.hits++;
+
+		mowgli_node_delete(&e->lru, &lru);
+		mowgli_node_add_head(e, &e->lru, &lru);
+
+		cb(priv, e->host[0] ? e->host : NULL, e->err);
+		return NULL;
+	}
+
+	q = malloc(sizeof(*q));
+	q->cb = cb;
+	q->priv = priv;
+
+	if (e != NULL) {
+		rdns_stats.joined++;
+		q->e = e;
+		mowgli_node_add(q, &q->n, &e->waiters);
+		return q;
+	}
+
+	rdns_stats.misses++;
+
+	e = entry_new(family, addr);
+	q->e = e;
+	mowgli_node_add(q, &q->n, &e->waiters);
+
+	e->q_ptr.ptr = e;
+	e->q_ptr.callback = ptr_callback;
+
+	rdns_stats.queries++;
+	key_to_sockaddr(e, &ss);
+	mowgli_dns_gethost_byaddr(base_dns, &ss, &e->q_ptr);
+
+	/* the resolver can fail on the spot, in which case q is gone */
+	return e->state == RDNS_DONE ? NULL : q;
+}
+
+void u_rdns_cancel(u_rdns_query *q)
+{
+	if (q == NULL)
+		return;
+
+	mowgli_node_delete(&q->n, &q->e->waiters);
+	free(q);
+}
+
+/* configuration */
+/* ------------- */
+
+static mowgli_patricia_t *u_conf_rdns_handlers = NULL;
+
+static void conf_rdns(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	u_conf_traverse(cf, ce->entries, u_conf_rdns_handlers);
+}
+
+static int conf_nonnegative(mowgli_config_file_entry_t *ce, int def)
+{
+	int n = atoi(ce->vardata);
+
+	if (n < 0) {
+		u_log(LG_ERROR, "%s: invalid %s", ce->vardata, ce->varname);
+		return def;
+	}
+
+	return n;
+}
+
+static void conf_rdns_cache_size(mowgli_config_file_t *cf,
+                                 mowgli_config_file_entry_t *ce)
+{
+	cache_size = conf_nonnegative(ce, cache_size);
+}
+
+static void conf_rdns_ttl(mowgli_config_file_t *cf,
+                          mowgli_config_file_entry_t *ce)
+{
+	cache_ttl = conf_nonnegative(ce, cache_ttl);
+}
+
+static void conf_rdns_negative_ttl(mowgli_config_file_t *cf,
+                                   mowgli_config_file_entry_t *ce)
+{
+	negative_ttl = conf_nonnegative(ce, negative_ttl);
+}
+
+int init_rdns(void)
+{
+	mowgli_list_init(&lru);
+
+	u_conf_add_handler("rdns", conf_rdns, NULL);
+
+	u_conf_rdns_handlers = mowgli_patricia_create(ascii_canonize);
+	u_conf_add_handler("cache_size", conf_rdns_cache_size,
+	                   u_conf_rdns_handlers);
+	u_conf_add_handler("ttl", conf_rdns_ttl, u_conf_rdns_handlers);
+	u_conf_add_handler("negative_ttl", conf_rdns_negative_ttl,
+	                   u_conf_rdns_handlers);
+
+	return 0;
+}
@@ -13,35 +13,240 @@
 #define SENDQ_B64_CHUNK_SIZE 5328 /* corresponds to just under 4000 bytes */
 
 #define CHUNK_IN_USE 0x0001
+#define CHUNK_EXTERN 0x0002
+#define CHUNK_LARGE  0x0004
+
+/* Chunks come in two flavors. Ordinary chunks own their storage, which
+   formatters write into directly. Its size depends on how much is
+   already queued, so a user with a line or two waiting holds on to a
+   small chunk, and a server being burst to gets big ones. Anything
+   bigger than the largest size class is marked CHUNK_LARGE and is
+   malloc()ed on its own. External chunks own no storage at all; they
+   point at memory owned by somebody else, and call the release callback
+   when the queue is done with it. Both kinds can sit in the same queue. */
+
+typedef struct sendq_slab sendq_slab;
+typedef struct sendq_class sendq_class;
 
 struct u_sendq_chunk {
-	uchar data[SENDQ_CHUNK_SIZE];
+	uchar *data;
 	ulong flags;
-	int start, end;
+	int start, end, size;
+	u_sendq_release_fn *release;
+	void *priv;
 	u_sendq_chunk *next;
+	sendq_slab *slab;
+	uchar own[];
+};
+
+/* Chunks of each size class are carved out of slabs, which are mapped
+   directly with mmap(). Slots are only touched once they are first
+   handed out, and a slab that empties out is unmapped again unless it is
+   the last one with room, so memory taken during a burst goes back to
+   the system afterwards. */
+
+#define SLAB_SIZE (2<<20)
+
+struct sendq_slab {
+	uchar *base;
+	sendq_class *cls;
+	int carved;             /* slots handed out at least once */
+	int nfree;              /* of those, how many are on the free list */
+	u_sendq_chunk *free;
+	mowgli_node_t n;        /* in cls->avail while it has room */
+};
+
+struct sendq_class {
+	size_t slot;
+	int per_slab;
+	mowgli_list_t avail;
+	u_sendq_class_stats *stats;
 };
 
-#define SENDQ_CHUNK_BACKLOG_MAX 400
+/* The first class holds just the chunk header, for external chunks. The
+   rest are listed by payload size. */
+static size_t class_sizes[U_SENDQ_NUM_CLASSES] = {
+	0, 512, 2048, 8192, 32768
+};
+
+static sendq_class classes[U_SENDQ_NUM_CLASSES];
+
+static bool use_hugepages = false;
+
+u_sendq_stats sendq_stats;
+
+static void *slab_map(void)
+{
+	void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (use_hugepages) {
+		p = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+
+	if (p != MAP_FAILED)
+		return p;
+
+	/* no hugepages reserved; transparent ones are the next best thing */
+	p = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (use_hugepages)
+		madvise(p, SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+
+	return p;
+}
+
+static sendq_slab *slab_new(sendq_class *cls)
+{
+	sendq_slab *slab;
+	uchar *base;
+
+	if ((base = slab_map()) == NULL) {
+		u_perror("mmap");
+		abort();
+	}
+
+	slab = malloc(sizeof(*slab));
+	slab->base = base;
+	slab->cls = cls;
+	slab->carved = 0;
+	slab->nfree = 0;
+	slab->free = NULL;
+	mowgli_node_add(slab, &slab->n, &cls->avail);
+
+	cls->stats->slabs++;
+	cls->stats->slots += cls->per_slab;
+
+	return slab;
+}
+
+static void slab_destroy(sendq_slab *slab)
+{
+	sendq_class *cls = slab->cls;
+
+	mowgli_node_delete(&slab->n, &cls->avail);
+
+	cls->stats->slabs--;
+	cls->stats->slots -= cls->per_slab;
+
+	munmap(slab->base, SLAB_SIZE);
+	free(slab);
+}
+
+static u_sendq_chunk *slot_alloc(sendq_class *cls)
+{
+	sendq_slab *slab;
+	u_sendq_chunk *chunk;
+
+	if (cls->avail.head != NULL)
+		slab = cls->avail.head->data;
+	else
+		slab = slab_new(cls);
+
+	if (slab->free != NULL) {
+		chunk = slab->free;
+		slab->free = chunk->next;
+		slab->nfree--;
+	} else {
+		chunk = (u_sendq_chunk*)(slab->base + slab->carved * cls->slot);
+		slab->carved++;
+	}
+
+	if (slab->nfree == 0 && slab->carved == cls->per_slab)
+		mowgli_node_delete(&slab->n, &cls->avail);
+
+	chunk->slab = slab;
+	cls->stats->live++;
+
+	return chunk;
+}
+
+static void slot_free(u_sendq_chunk *chunk)
+{
+	sendq_slab *slab = chunk->slab;
+	sendq_class *cls = slab->cls;
+
+	if (slab->nfree == 0 && slab->carved == cls->per_slab)
+		mowgli_node_add(slab, &slab->n, &cls->avail);
+
+	chunk->next = slab->free;
+	slab->free = chunk;
+	slab->nfree++;
+	cls->stats->live--;
+
+	if (slab->nfree == slab->carved && cls->avail.count > 1)
+		slab_destroy(slab);
+}
+
+/* picks a chunk size for a queue that needs sz more bytes */
+static sendq_class *class_for(u_sendq *q, size_t sz)
+{
+	int i;
+
+	if (sz > class_sizes[U_SENDQ_NUM_CLASSES - 1])
+		return NULL;
+
+	/* grow along with the queue */
+	if (sz < q->size)
+		sz = q->size;
+
+	for (i=1; i<U_SENDQ_NUM_CLASSES - 1; i++) {
+		if (sz <= class_sizes[i])
+			break;
+	}
 
-static u_sendq_chunk *free_chunks = NULL;
-static int num_free_chunks = 0;
+	return &classes[i];
+}
 
-static u_sendq_chunk *chunk_new(void)
+static u_sendq_chunk *chunk_new(u_sendq *q, size_t sz)
 {
 	u_sendq_chunk *chunk;
+	sendq_class *cls;
+	ulong flags = CHUNK_IN_USE;
 
-	if (num_free_chunks) {
-		num_free_chunks--;
-		chunk = free_chunks;
-		free_chunks = chunk->next;
+	if ((cls = class_for(q, sz)) != NULL) {
+		chunk = slot_alloc(cls);
+		sz = cls->slot - sizeof(*chunk);
 	} else {
-		u_log(LG_DEBUG, "sendq chunk: malloc()");
-		chunk = malloc(sizeof(*chunk));
+		chunk = malloc(sizeof(*chunk) + sz);
+		chunk->slab = NULL;
+		flags |= CHUNK_LARGE;
+		sendq_stats.large_live++;
 	}
 
-	chunk->flags = CHUNK_IN_USE;
+	chunk->data = chunk->own;
+	chunk->flags = flags;
+	chunk->release = NULL;
+	chunk->priv = NULL;
 	chunk->next = NULL;
 	chunk->start = chunk->end = 0;
+	chunk->size = sz;
+	return chunk;
+}
+
+static u_sendq_chunk *chunk_new_extern(const uchar *data, size_t sz,
+                                       u_sendq_release_fn *release, void *priv)
+{
+	u_sendq_chunk *chunk;
+
+	chunk = slot_alloc(&classes[0]);
+
+	/* the data is never written through this pointer */
+	chunk->data = (uchar*)data;
+	chunk->flags = CHUNK_IN_USE | CHUNK_EXTERN;
+	chunk->release = release;
+	chunk->priv = priv;
+	chunk->next = NULL;
+	chunk->start = 0;
+	chunk->end = chunk->size = sz;
 	return chunk;
 }
 
@@ -50,16 +255,57 @@ static void chunk_free(u_sendq_chunk *chunk)
 	if (!(chunk->flags & CHUNK_IN_USE)) /* prevent multiple free */
 		return;
 
-	if (num_free_chunks >= SENDQ_CHUNK_BACKLOG_MAX) {
-		u_log(LG_DEBUG, "sendq chunk: free()");
+	chunk->flags &= ~CHUNK_IN_USE;
+
+	if (chunk->flags & CHUNK_EXTERN) {
+		if (chunk->release)
+			chunk->release(chunk->priv);
+		chunk->release = NULL;
+	}
+
+	if (chunk->flags & CHUNK_LARGE) {
+		sendq_stats.large_live--;
 		free(chunk);
 		return;
 	}
 
-	chunk->flags &= ~CHUNK_IN_USE;
-	chunk->next = free_chunks;
-	free_chunks = chunk;
-	num_free_chunks ++;
+	slot_free(chunk);
+}
+
+/* shared buffers */
+/* -------------- */
+
+u_sendq_buf *u_sendq_buf_new(size_t sz)
+{
+	u_sendq_buf *buf;
+
+	buf = malloc(sizeof(*buf) + sz);
+	buf->refs = 1;
+	buf->len = 0;
+
+	return buf;
+}
+
+u_sendq_buf *u_sendq_buf_ref(u_sendq_buf *buf)
+{
+	buf->refs++;
+	return buf;
+}
+
+void u_sendq_buf_unref(u_sendq_buf *buf)
+{
+	if (buf == NULL)
+		return;
+
+	if (--buf->refs > 0)
+		return;
+
+	free(buf);
+}
+
+static void buf_release(void *priv)
+{
+	u_sendq_buf_unref(priv);
 }
 
 /* create, destroy */
@@ -79,18 +325,28 @@ void u_sendq_clear(u_sendq *q)
 		chunk_free(ch);
 	}
 
-	memset(q, 0, sizeof(*q));
+	sendq_stats.queued[q->acct] -= q->size;
+
+	q->size = 0;
+	q->head = q->tail = NULL;
+}
+
+void u_sendq_set_acct(u_sendq *q, int acct)
+{
+	if (acct < 0 || acct >= U_SENDQ_NUM_ACCT)
+		acct = 0;
+
+	sendq_stats.queued[q->acct] -= q->size;
+	sendq_stats.queued[acct] += q->size;
+
+	q->acct = acct;
 }
 
 /* buffer interaction */
 /* ------------------ */
 
-static u_sendq_chunk *sendq_append_chunk(u_sendq *q)
+static u_sendq_chunk *sendq_append_chunk(u_sendq *q, u_sendq_chunk *chunk)
 {
-	u_sendq_chunk *chunk;
-
-	chunk = chunk_new();
-
 	if (q->tail != NULL)
 		q->tail->next = chunk;
 
@@ -115,19 +371,23 @@ static void sendq_delete_chunk(u_sendq *q, u_sendq_chunk *chunk)
 	chunk_free(chunk);
 }
 
-uchar *u_sendq_get_buffer(u_sendq *q, size_t sz)
+/* how many bytes can still be copied into the tail chunk */
+static inline int tail_space(u_sendq *q)
 {
-	u_sendq_chunk *chunk;
+	u_sendq_chunk *chunk = q->tail;
 
-	if (sz > SENDQ_CHUNK_SIZE) {
-		/* TODO: this is not exactly robust */
-		return NULL;
-	}
+	if (!chunk || (chunk->flags & CHUNK_EXTERN))
+		return 0;
 
-	chunk = q->tail;
+	return chunk->size - chunk->end;
+}
+
+uchar *u_sendq_get_buffer(u_sendq *q, size_t sz)
+{
+	u_sendq_chunk *chunk = q->tail;
 
-	if (!chunk || sz > (SENDQ_CHUNK_SIZE - chunk->end))
-		chunk = sendq_append_chunk(q);
+	if (sz > (size_t)tail_space(q))
+		chunk = sendq_append_chunk(q, chunk_new(q, sz));
 
 	return chunk->data + chunk->end;
 }
@@ -136,50 +396,131 @@ size_t u_sendq_end_buffer(u_sendq *q, size_t sz)
 {
 	u_sendq_chunk *chunk = q->tail;
 
-	if (!chunk) {
+	if (!chunk || (chunk->flags & CHUNK_EXTERN)) {
 		u_log(LG_WARN, "sendq: potential heap corruption!");
 		return 0;
 	}
 
-	if (chunk->end + sz > SENDQ_CHUNK_SIZE) {
+	if (chunk->end + sz > chunk->size) {
 		u_log(LG_WARN, "sendq: potential heap corruption!");
-		sz = SENDQ_CHUNK_SIZE - chunk->end;
+		sz = chunk->size - chunk->end;
 	}
 
 	chunk->end += sz;
 	q->size += sz;
+	sendq_stats.queued[q->acct] += sz;
+
+	sendq_stats.bytes_copied += sz;
 
 	return sz;
 }
 
-#define NUM_IOVECS 32
+size_t u_sendq_put(u_sendq *q, const uchar *data, size_t sz)
+{
+	u_sendq_chunk *chunk;
+	size_t n, left = sz;
 
-int u_sendq_write(u_sendq *q, int fd)
+	while (left > 0) {
+		if (tail_space(q) == 0)
+			sendq_append_chunk(q, chunk_new(q, left));
+
+		chunk = q->tail;
+		n = chunk->size - chunk->end;
+		if (n > left)
+			n = left;
+
+		memcpy(chunk->data + chunk->end, data, n);
+		chunk->end += n;
+		data += n;
+		left -= n;
+	}
+
+	q->size += sz;
+	sendq_stats.queued[q->acct] += sz;
+
+	sendq_stats.bytes_copied += sz;
+
+	return sz;
+}
+
+size_t u_sendq_putv(u_sendq *q, const struct iovec *iov, int iovcnt)
+{
+	size_t sz = 0;
+	int i;
+
+	for (i=0; i<iovcnt; i++)
+		sz += u_sendq_put(q, iov[i].iov_base, iov[i].iov_len);
+
+	return sz;
+}
+
+size_t u_sendq_put_ref(u_sendq *q, const uchar *data, size_t sz,
+                       u_sendq_release_fn *release, void *priv)
+{
+	if (sz == 0) {
+		if (release)
+			release(priv);
+		return 0;
+	}
+
+	sendq_append_chunk(q, chunk_new_extern(data, sz, release, priv));
+	q->size += sz;
+	sendq_stats.queued[q->acct] += sz;
+
+	sendq_stats.bytes_shared += sz;
+
+	return sz;
+}
+
+size_t u_sendq_put_buf(u_sendq *q, u_sendq_buf *buf)
+{
+	if (buf->len == 0)
+		return 0;
+
+	u_sendq_buf_ref(buf);
+	sendq_stats.bufs_shared ++;
+
+	return u_sendq_put_ref(q, buf->data, buf->len, buf_release, buf);
+}
+
+/* shared chunks usually hold a single line, so allow plenty of them in
+   a single writev() */
+#define NUM_IOVECS 128
+
+int u_sendq_iov(u_sendq *q, struct iovec *iov, int max)
 {
 	u_sendq_chunk *ch = q->head;
-	struct iovec iov[NUM_IOVECS];
 	int iovcnt = 0;
-	ssize_t sz;
 
-	for (; iovcnt < NUM_IOVECS && ch; iovcnt++, ch = ch->next) {
+	for (; iovcnt < max && ch; iovcnt++, ch = ch->next) {
 		iov[iovcnt].iov_base = ch->data + ch->start;
 		iov[iovcnt].iov_len = ch->end - ch->start;
-		u_log(LG_FINE, "  sendq: ch %p %04d-%04d -> iov %p +%04u",
-		      ch->data, ch->start, ch->end,
-		      iov[iovcnt].iov_base, iov[iovcnt].iov_len);
 	}
 
-	sz = writev(fd, iov, iovcnt);
+	return iovcnt;
+}
+
+ssize_t u_sendq_send(u_sendq *q, int fd)
+{
+	struct iovec iov[NUM_IOVECS];
+	int iovcnt;
+
+	iovcnt = u_sendq_iov(q, iov, NUM_IOVECS);
 
-	if (sz < 0)
-		return sz;
+	return writev(fd, iov, iovcnt);
+}
+
+void u_sendq_consume(u_sendq *q, size_t sz)
+{
+	u_sendq_chunk *ch;
 
 	q->size -= sz;
+	sendq_stats.queued[q->acct] -= sz;
 
 	while ((ch = q->head) != NULL) {
 		int chsz = ch->end - ch->start;
 
-		if (chsz > sz) {
+		if ((size_t)chsz > sz) {
 			/* didn't send all data in this chunk */
 			ch->start += sz;
 			break;
@@ -189,6 +530,20 @@ int u_sendq_write(u_sendq *q, int fd)
 
 		sendq_delete_chunk(q, ch);
 	}
+}
+
+int u_sendq_write(u_sendq *q, int fd)
+{
+	ssize_t sz;
+
+	u_log(LG_FINE, "  sendq: writing %u bytes", (uint)q->size);
+
+	sz = u_sendq_send(q, fd);
+
+	if (sz < 0)
+		return sz;
+
+	u_sendq_consume(q, sz);
 
 	return 0;
 }
@@ -263,4 +618,47 @@ int u_sendq_from_json(mowgli_json_t *jsq, u_sendq *sq)
 	return 0;
 }
 
+/* configuration */
+/* ------------- */
+
+static mowgli_patricia_t *u_conf_sendq_handlers = NULL;
+
+static void conf_sendq(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	use_hugepages = false;
+	u_conf_traverse(cf, ce->entries, u_conf_sendq_handlers);
+}
+
+static void conf_sendq_hugepages(mowgli_config_file_t *cf,
+                                 mowgli_config_file_entry_t *ce)
+{
+	if (streq(ce->vardata, "yes"))
+		use_hugepages = true;
+	else if (streq(ce->vardata, "no"))
+		use_hugepages = false;
+	else
+		u_log(LG_ERROR, "%s: hugepages must be yes or no", ce->vardata);
+}
+
+int init_sendq(void)
+{
+	int i;
+
+	for (i=0; i<U_SENDQ_NUM_CLASSES; i++) {
+		classes[i].slot = sizeof(u_sendq_chunk) + class_sizes[i];
+		classes[i].per_slab = SLAB_SIZE / classes[i].slot;
+		classes[i].stats = &sendq_stats.classes[i];
+		classes[i].stats->size = class_sizes[i];
+		mowgli_list_init(&classes[i].avail);
+	}
+
+	u_conf_add_handler("sendq", conf_sendq, NULL);
+
+	u_conf_sendq_handlers = mowgli_patricia_create(ascii_canonize);
+	u_conf_add_handler("hugepages", conf_sendq_hugepages,
+	                   u_conf_sendq_handlers);
+
+	return 0;
+}
+
 /* vim: set noet: */
@@ -6,18 +6,29 @@
 
 #include "ircd.h"
 
+#include <limits.h>
+
 static u_cookie ck_sendto;
 
-static char *ln_user, buf_user[1024];
-static char *ln_serv, buf_serv[1024];
+/* the line for each link type is rendered at most once per sendto and
+   shared by reference between all recipients of that type */
+static u_sendq_buf *ln_user;
+static u_sendq_buf *ln_serv;
 
-void u_sendto_start(void)
+static void ln_reset(void)
 {
-	u_cookie_inc(&ck_sendto);
+	u_sendq_buf_unref(ln_user);
+	u_sendq_buf_unref(ln_serv);
 	ln_user = NULL;
 	ln_serv = NULL;
 }
 
+void u_sendto_start(void)
+{
+	u_cookie_inc(&ck_sendto);
+	ln_reset();
+}
+
 void u_sendto_skip(u_link *link)
 {
 	if (!link)
@@ -27,50 +38,38 @@ void u_sendto_skip(u_link *link)
 		u_cookie_cpy(&link->ck_sendto, &ck_sendto);
 }
 
-static int want_send(uint type, u_link *link)
+static u_sendq_buf *ln_render(int type, char *fmt, va_list va_orig)
 {
-	switch (type) {
-	case ST_ALL:
-		return 1;
+	u_sendq_buf *buf;
+	va_list va;
+	size_t sz;
 
-	case ST_USERS:
-	case ST_SERVERS:
-		switch (link->type) {
-		case LINK_NONE:
-		case LINK_USER:
-			return type == ST_USERS;
+	buf = u_sendq_buf_new(512);
 
-		case LINK_SERVER:
-			return type == ST_SERVERS;
-		}
-		return 0;
-	}
+	/* same limits as u_link_vf */
+	va_copy(va, va_orig);
+	sz = vsnf(type, (char*)buf->data, 510, fmt, va);
+	va_end(va);
 
-	return 0;
+	buf->data[sz++] = '\r';
+	buf->data[sz++] = '\n';
+	buf->len = sz;
+
+	return buf;
 }
 
-static char *ln(u_link *link, char *fmt, va_list va_orig)
+static u_sendq_buf *ln(u_link *link, char *fmt, va_list va)
 {
-	va_list va;
-
 	switch (link->type) {
 	case LINK_NONE:
 	case LINK_USER:
-		if (ln_user != NULL)
-			return ln_user;
-		ln_user = buf_user;
-		va_copy(va, va_orig);
-		vsnf(FMT_USER, buf_user, 1024, fmt, va);
-		va_end(va);
+		if (ln_user == NULL)
+			ln_user = ln_render(FMT_USER, fmt, va);
 		return ln_user;
 
 	case LINK_SERVER:
-		if (ln_serv != NULL)
-			return ln_serv;
-		ln_serv = buf_serv;
-		va_copy(va, va_orig);
-		vsnf(FMT_SERVER, buf_serv, 1024, fmt, va);
-		va_end(va);
+		if (ln_serv == NULL)
+			ln_serv = ln_render(FMT_SERVER, fmt, va);
 		return ln_serv;
 	}
 
@@ -88,6 +87,18 @@ void u_sendto(u_link *link, char *fmt, ...)
 	va_end(va);
 }
 
+static void sendto_buf(u_link *link, u_sendq_buf *buf)
+{
+	if (buf == NULL)
+		return;
+	if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+		return;
+	u_cookie_cpy(&link->ck_sendto, &ck_sendto);
+	u_link_put_buf(link, buf);
+}
+
+static void start_job(u_chan*, u_link *exclude, u_sendq_buf*);
+
 void u_sendto_chan(u_chan *c, u_link *exclude, uint type, char *fmt, ...)
 {
 	u_sendto_state st;
@@ -95,9 +106,18 @@ void u_sendto_chan(u_chan *c, u_link *exclude, uint type, char *fmt, ...)
 	va_list va;
 
 	va_start(va, fmt);
+
+	/* the servers get it now, and the local members bit by bit */
+	if (c != NULL && type != ST_SERVERS && u_sendto_slice > 0 &&
+	    c->nlocal - c->nlocal_dead > u_sendto_slice) {
+		start_job(c, exclude, ln_render(FMT_USER, fmt, va));
+		type = type == ST_ALL ? ST_SERVERS : ST_STOP;
+	}
+
 	U_SENDTO_CHAN(&st, c, exclude, type, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		sendto_buf(link, ln(link, fmt, va));
 	va_end(va);
+	ln_reset();
 }
 
 void u_sendto_visible(u_user *u, uint type, char *fmt, ...)
@@ -108,8 +128,9 @@ void u_sendto_visible(u_user *u, uint type, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_SENDTO_VISIBLE(&st, u, u->link, type, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		sendto_buf(link, ln(link, fmt, va));
 	va_end(va);
+	ln_reset();
 }
 
 void u_sendto_servers(u_link *exclude, char *fmt, ...)
@@ -120,8 +141,9 @@ void u_sendto_servers(u_link *exclude, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_SENDTO_SERVERS(&st, exclude, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		sendto_buf(link, ln(link, fmt, va));
 	va_end(va);
+	ln_reset();
 }
 
 void u_sendto_list(mowgli_list_t *list, u_link *exclude, char *fmt, ...)
@@ -136,9 +158,10 @@ void u_sendto_list(mowgli_list_t *list, u_link *exclude, char *fmt, ...)
 	va_start(va, fmt);
 	MOWGLI_LIST_FOREACH(n, list->head) {
 		u_link *link = n->data;
-		u_sendto(link, "%s", ln(link, fmt, va));
+		sendto_buf(link, ln(link, fmt, va));
 	}
 	va_end(va);
+	ln_reset();
 }
 
 void u_sendto_map(u_map *map, u_link *exclude, char *fmt, ...)
@@ -153,8 +176,116 @@ void u_sendto_map(u_map *map, u_link *exclude, char *fmt, ...)
 
 	va_start(va, fmt);
 	U_MAP_EACH(&state, map, NULL, &link)
-		u_sendto(link, "%s", ln(link, fmt, va));
+		sendto_buf(link, ln(link, fmt, va));
 	va_end(va);
+	ln_reset();
+}
+
+/* Cap-gated sends
+   ---------------
+   These go only to local users, through the channels' caplists, so they
+   cost about as much as there are users with the caps. With caps outside
+   CAP_MASK_FANOUT only, every local member has to be looked at. */
+
+/* the shortest list of local members that has everyone in c with caps */
+static u_chanuser **cap_members(u_chan *c, ulong caps, uint *n)
+{
+	u_chan_caplist *l;
+	u_chanuser **cus = c->local;
+	ulong m;
+
+	*n = c->nlocal;
+
+	for (m = caps & CAP_MASK_FANOUT; m; m &= m - 1) {
+		l = &c->caplist[CAP_LIST(m & -m)];
+		if (l->n <= *n) {
+			cus = l->cu;
+			*n = l->n;
+		}
+	}
+
+	return cus;
+}
+
+static void send_cap(u_chan *c, ulong caps, u_sendq_buf *buf)
+{
+	u_chanuser **cus;
+	u_user *u;
+	uint i, n;
+
+	/* from the end, for the same reason as u_sendto_chan_next */
+	cap_members(c, caps, &i);
+	while (i > 0) {
+		cus = cap_members(c, caps, &n);
+		if (--i >= n || cus[i] == NULL)
+			continue;
+		u = cus[i]->u;
+		if ((u->flags & caps) == caps)
+			sendto_buf(u->link, buf);
+	}
+}
+
+void u_sendto_chan_cap(u_chan *c, u_link *exclude, ulong caps, char *fmt, ...)
+{
+	u_sendq_buf *buf;
+	va_list va;
+
+	u_sendto_start();
+	if (exclude != NULL)
+		u_sendto_skip(exclude);
+
+	va_start(va, fmt);
+	buf = ln_render(FMT_USER, fmt, va);
+	va_end(va);
+
+	send_cap(c, caps, buf);
+	u_sendq_buf_unref(buf);
+}
+
+void u_sendto_visible_cap(u_user *u, u_link *exclude, ulong caps,
+                          char *fmt, ...)
+{
+	u_map_each_state st;
+	u_sendq_buf *buf;
+	u_chan *c;
+	va_list va;
+
+	u_sendto_start();
+	if (exclude != NULL)
+		u_sendto_skip(exclude);
+
+	va_start(va, fmt);
+	buf = ln_render(FMT_USER, fmt, va);
+	va_end(va);
+
+	U_MAP_EACH(&st, u->channels, &c, NULL)
+		send_cap(c, caps, buf);
+	u_sendq_buf_unref(buf);
+}
+
+void u_sendto_chan_split(u_chan *c, u_link *exclude, uint type, ulong caps,
+                         char *fmt_cap, char *fmt, ...)
+{
+	u_sendto_state st;
+	u_sendq_buf *buf;
+	u_link *link;
+	va_list va;
+
+	va_start(va, fmt);
+	u_sendto_chan_start(&st, c, exclude, type);
+
+	/* the users with caps are marked sent, so the walk below, which
+	   is how u_sendto_chan goes, passes them by */
+	if (c != NULL && type != ST_SERVERS) {
+		buf = ln_render(FMT_USER, fmt_cap, va);
+		send_cap(c, caps, buf);
+		u_sendq_buf_unref(buf);
+	}
+
+	while (u_sendto_chan_next(&st, &link))
+		sendto_buf(link, ln(link, fmt, va));
+	va_end(va);
+	ln_reset();
 }
 
 void u_sendto_chan_start(u_sendto_state *state, u_chan *c,
@@ -172,28 +303,87 @@ void u_sendto_chan_start(u_sendto_state *state, u_chan *c,
 
 	state->type = type;
 
-	u_map_each_start(&state->members, c->members);
+	state->c = c;
+	state->local_i = c->nlocal;
+	state->links_i = c->nlinks;
 }
 
+/* Local members, then server links, both from the end. Members may
+   leave while we're sending (see local_del in chan.c), so the indexes
+   are checked against the counts each time. */
 bool u_sendto_chan_next(u_sendto_state *state, u_link **link_ret)
 {
-	u_user *u;
-	u_chanuser *cu;
+	u_chan *c = state->c;
+	u_link *link;
 
 	if (state->type == ST_STOP)
 		return false;
 
-next_link:
-	if (!u_map_each_next(&state->members, (void**)&u, (void**)&cu))
-		return false;
+	if (state->type != ST_SERVERS) {
+		while (state->local_i > 0) {
+			if (--state->local_i >= c->nlocal ||
+			    c->local[state->local_i] == NULL)
+				continue;
+			link = c->local[state->local_i]->u->link;
+			if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+				continue;
+			*link_ret = link;
+			return true;
+		}
+	}
 
-	if (!want_send(state->type, u->link))
-		goto next_link;
-	if (!u_cookie_cmp(&u->link->ck_sendto, &ck_sendto))
-		goto next_link;
+	if (state->type != ST_USERS) {
+		while (state->links_i > 0) {
+			if (--state->links_i >= c->nlinks)
+				continue;
+			link = c->links[state->links_i].link;
+			if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+				continue;
+			*link_ret = link;
+			return true;
+		}
+	}
 
-	*link_ret = u->link;
-	return true;
+	return false;
+}
+
+/* The local members of the user's channels that keep bitsets are merged
+   into this, and then it's read back a word at a time, so each of those
+   links is looked at once however many of the channels it shares with
+   the user. Only one sendto can use it at a time. */
+static uint64_t *merged = NULL;
+static uint merged_size = 0;
+static bool merged_busy = false;
+
+static bool merge_bits(u_user *u, uint *nwords_ret)
+{
+	u_map_each_state st;
+	u_chan *c;
+	uint i, nwords = 0;
+
+	U_MAP_EACH(&st, u->channels, &c, NULL) {
+		if (!c->bits)
+			continue;
+
+		if (c->nwords > merged_size) {
+			merged = realloc(merged, c->nwords * sizeof(*merged));
+			if (merged == NULL) {
+				u_log(LG_SEVERE, "realloc() failed");
+				abort();
+			}
+			memset(merged + merged_size, 0,
+			       (c->nwords - merged_size) * sizeof(*merged));
+			merged_size = c->nwords;
+		}
+
+		for (i=0; i<c->nwords; i++)
+			merged[i] |= c->bits[i];
+		if (c->nwords > nwords)
+			nwords = c->nwords;
+	}
+
+	*nwords_ret = nwords;
+	return nwords > 0;
 }
 
 void u_sendto_visible_start(u_sendto_state *state, u_user *u,
@@ -211,39 +401,98 @@ void u_sendto_visible_start(u_sendto_state *state, u_user *u,
 
 	state->type = type;
 
+	state->merged = false;
+	state->nwords = 0;
+	if (type != ST_SERVERS && !merged_busy &&
+	    merge_bits(u, &state->nwords)) {
+		merged_busy = state->merged = true;
+		state->word = 0;
+		state->bits = 0;
+	}
+
 	u_map_each_start(&state->chans, u->channels);
 	state->c = NULL;
 }
 
+/* links from the merged bitsets, clearing it as it goes */
+static u_link *next_merged(u_sendto_state *state)
+{
+	u_link *link;
+	uint slot;
+
+	for (;;) {
+		while (state->bits == 0) {
+			if (state->word == state->nwords) {
+				merged_busy = state->merged = false;
+				return NULL;
+			}
+			state->bits = merged[state->word];
+			merged[state->word++] = 0;
+		}
+
+		slot = (state->word - 1) * 64 + __builtin_ctzll(state->bits);
+		state->bits &= state->bits - 1;
+
+		/* the link may have gone while we were sending */
+		if (slot >= u_link_nslots || !(link = u_link_slots[slot]))
+			continue;
+		if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+			continue;
+
+		return link;
+	}
+}
+
+/* First the merged bitsets, if any. Then, for each channel, the local
+   members of those without a bitset, and the server links. */
 bool u_sendto_visible_next(u_sendto_state *state, u_link **link_ret)
 {
-	u_user *u;
-	u_chanuser *cu;
+	u_chan *c;
+	u_link *link;
 
 	if (state->type == ST_STOP)
 		return false;
 
-next_link:
-	if (!state->c) {
+	if (state->merged && (*link_ret = next_merged(state)))
+		return true;
+
+next_chan:
+	if (!(c = state->c)) {
 		if (!u_map_each_next(&state->chans, (void**)&state->c, NULL))
 			return false;
-		if (!state->c)
+		if (!(c = state->c))
 			return false;
-		u_map_each_start(&state->members, state->c->members);
+		state->local_i = c->nlocal;
+		state->links_i = c->nlinks;
+		if (state->type == ST_SERVERS || (c->bits && state->nwords))
+			state->local_i = 0;
+		if (state->type == ST_USERS)
+			state->links_i = 0;
 	}
 
-	if (!u_map_each_next(&state->members, (void**)&u, (void**)&cu)) {
-		state->c = NULL;
-		goto next_link;
+	while (state->local_i > 0) {
+		if (--state->local_i >= c->nlocal ||
+		    c->local[state->local_i] == NULL)
+			continue;
+		link = c->local[state->local_i]->u->link;
+		if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+			continue;
+		*link_ret = link;
+		return true;
 	}
 
-	if (!u_cookie_cmp(&u->link->ck_sendto, &ck_sendto))
-		goto next_link;
-	if (!want_send(state->type, u->link))
-		goto next_link;
+	while (state->links_i > 0) {
+		if (--state->links_i >= c->nlinks)
+			continue;
+		link = c->links[state->links_i].link;
+		if (!u_cookie_cmp(&link->ck_sendto, &ck_sendto))
+			continue;
+		*link_ret = link;
+		return true;
+	}
 
-	*link_ret = u->link;
-	return true;
+	state->c = NULL;
+	goto next_chan;
 }
 
 void u_sendto_servers_start(u_sendto_state *state, u_link *exclude)
@@ -275,9 +524,176 @@ next_link:
 	return true;
 }
 
+/* Jobs
+   ----
+   A message to a channel with a lot of local members would keep every
+   other connection waiting while it's queued to all of them. Instead,
+   the line is rendered once and kept in a job, and u_sendto_run_jobs
+   gives it to u_sendto_slice members per turn of the event loop.
+
+   Each link must still see its messages in the order they were sent.
+   Jobs are run one after another, oldest first, and anything else sent
+   to a member first gives them what jobs they're still waiting for, see
+   u_sendto_catch_up. A member who's been given a job that way has its
+   seq in job_seq, and the job passes them by when it gets to them. */
+
+struct sendto_job {
+	mowgli_node_t n;
+	uint64_t seq;
+	uint64_t start;
+	u_chan *c; /* NULL once the channel's gone */
+	u_link *exclude;
+	u_sendq_buf *buf;
+	uint cursor; /* c->local below this haven't had it yet */
+};
+
+uint u_sendto_slice = U_SENDTO_SLICE;
+uint u_sendto_njobs = 0;
+u_histogram sendto_job_time;
+uint64_t sendto_catch_ups = 0;
+
+static mowgli_list_t jobs;
+static uint64_t job_seq = 0;
+/* the link a job is giving its line to */
+static u_link *job_link = NULL;
+
+static void start_job(u_chan *c, u_link *exclude, u_sendq_buf *buf)
+{
+	struct sendto_job *job = malloc(sizeof(*job));
+
+	job->seq = ++job_seq;
+	job->start = u_mono_usec();
+	job->c = c;
+	job->exclude = exclude;
+	job->buf = buf;
+	job->cursor = c->nlocal;
+
+	u_chan_hold_local(c);
+	mowgli_node_add(job, &job->n, &jobs);
+	u_sendto_njobs++;
+}
+
+static void end_job(struct sendto_job *job)
+{
+	mowgli_node_delete(&job->n, &jobs);
+	u_sendto_njobs--;
+
+	if (job->c)
+		u_chan_release_local(job->c);
+	u_hist_add(&sendto_job_time, u_mono_usec() - job->start);
+	u_sendq_buf_unref(job->buf);
+	free(job);
+}
+
+static void job_give(struct sendto_job *job, u_chanuser *cu)
+{
+	u_link *link = cu->u->link, *last = job_link;
+
+	cu->job_seq = job->seq;
+	if (link == job->exclude)
+		return;
+
+	job_link = link;
+	u_link_put_buf(link, job->buf);
+	job_link = last;
+}
+
+void u_sendto_catch_up(u_link *link)
+{
+	struct sendto_job *job;
+	mowgli_node_t *n;
+	u_chanuser *cu;
+	u_user *u = link->priv;
+
+	if (link == job_link || u == NULL)
+		return;
+
+	MOWGLI_LIST_FOREACH(n, jobs.head) {
+		job = n->data;
+		if (!job->c || !(cu = u_chan_user_find(job->c, u)))
+			continue;
+		if (cu->local_idx >= job->cursor || cu->job_seq >= job->seq)
+			continue;
+		sendto_catch_ups++;
+		job_give(job, cu);
+	}
+}
+
+void u_sendto_chan_dropped(u_chan *c)
+{
+	mowgli_node_t *n;
+	struct sendto_job *job;
+
+	MOWGLI_LIST_FOREACH(n, jobs.head) {
+		job = n->data;
+		if (job->c == c)
+			job->c = NULL;
+	}
+}
+
+static void run_jobs(uint budget)
+{
+	struct sendto_job *job;
+	u_chanuser *cu;
+
+	while (budget > 0 && jobs.head) {
+		job = jobs.head->data;
+
+		while (budget > 0 && job->c && job->cursor > 0) {
+			budget--;
+			cu = job->c->local[--job->cursor];
+			if (cu != NULL && cu->job_seq < job->seq)
+				job_give(job, cu);
+		}
+
+		if (job->c && job->cursor > 0)
+			break;
+
+		end_job(job);
+	}
+}
+
+bool u_sendto_run_jobs(void)
+{
+	run_jobs(u_sendto_slice ? u_sendto_slice : UINT_MAX);
+	return jobs.count > 0;
+}
+
+void u_sendto_finish_jobs(void)
+{
+	while (jobs.count > 0)
+		run_jobs(UINT_MAX);
+}
+
+static mowgli_patricia_t *u_conf_broadcast_handlers = NULL;
+
+static void conf_broadcast(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
+{
+	u_conf_traverse(cf, ce->entries, u_conf_broadcast_handlers);
+}
+
+static void conf_broadcast_slice(mowgli_config_file_t *cf,
+                                 mowgli_config_file_entry_t *ce)
+{
+	int n = atoi(ce->vardata);
+
+	if (n < 0) {
+		u_log(LG_ERROR, "%s: invalid slice", ce->vardata);
+		return;
+	}
+
+	u_sendto_slice = n;
+}
+
 int init_sendto(void)
 {
 	u_cookie_reset(&ck_sendto);
+	mowgli_list_init(&jobs);
+
+	u_conf_broadcast_handlers = mowgli_patricia_create(ascii_canonize);
+
+	u_conf_add_handler("broadcast", conf_broadcast, NULL);
+	u_conf_add_handler("slice", conf_broadcast_slice, u_conf_broadcast_handlers);
 
 	return 0;
 }
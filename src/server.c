@@ -9,11 +9,38 @@
 mowgli_patricia_t *servers_by_sid;
 mowgli_patricia_t *servers_by_name;
 
+uint u_server_topology = 0;
+
+/* servers_by_sid, indexed by u_sid_index(). A SID that doesn't decode
+   can still be found in the patricia. */
+static u_server *servers_by_sidx[U_SID_INDEX_MAX];
+
 u_server me;
 mowgli_list_t my_motd;
 mowgli_list_t my_admininfo;
 char my_net_name[MAXNETNAME+1];
 
+static void add_sid(u_server *sv)
+{
+	int sidx;
+
+	mowgli_patricia_add(servers_by_sid, sv->sid, sv);
+	u_server_topology++;
+	if ((sidx = u_sid_index(sv->sid)) >= 0 && !sv->sid[3])
+		servers_by_sidx[sidx] = sv;
+}
+
+static void del_sid(u_server *sv)
+{
+	int sidx;
+
+	mowgli_patricia_delete(servers_by_sid, sv->sid);
+	u_server_topology++;
+	if ((sidx = u_sid_index(sv->sid)) >= 0 && !sv->sid[3] &&
+	    servers_by_sidx[sidx] == sv)
+		servers_by_sidx[sidx] = NULL;
+}
+
 static void load_motd(char *val)
 {
 	char *s, *p, buf[BUFSIZE];
@@ -49,14 +76,15 @@ static void server_conf(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce
 			mowgli_patricia_delete(servers_by_name, me.name);
 			u_strlcpy(me.name, cce->vardata, MAXSERVNAME+1);
 			mowgli_patricia_add(servers_by_name, me.name, &me);
+			u_server_topology++;
 			u_log(LG_DEBUG, "server_conf: me.name=%s", me.name);
 		} else if (streq(cce->varname, "net")) {
 			u_strlcpy(my_net_name, cce->vardata, MAXNETNAME+1);
 			u_log(LG_DEBUG, "server_conf: me.net=%s", my_net_name);
 		} else if (streq(cce->varname, "sid")) {
-			mowgli_patricia_delete(servers_by_sid, me.sid);
+			del_sid(&me);
 			u_strlcpy(me.sid, cce->vardata, 4);
-			mowgli_patricia_add(servers_by_sid, me.sid, &me);
+			add_sid(&me);
 			u_log(LG_DEBUG, "server_conf: me.sid=%s", me.sid);
 		} else if (streq(cce->varname, "desc")) {
 			u_strlcpy(me.desc, cce->vardata, MAXSERVDESC+1);
@@ -80,7 +108,17 @@ static void admin_conf(mowgli_config_file_t *cf, mowgli_config_file_entry_t *ce)
 
 u_server *u_server_by_sid(const char *sid)
 {
-	return mowgli_patricia_retrieve(servers_by_sid, sid);
+	int sidx = u_sid_index(sid);
+
+	if (sidx < 0)
+		return mowgli_patricia_retrieve(servers_by_sid, sid);
+
+	return sid[3] ? NULL : servers_by_sidx[sidx];
+}
+
+u_server *u_server_by_sid_index(int sidx)
+{
+	return servers_by_sidx[sidx];
 }
 
 u_server *u_server_by_name(const char *name)
@@ -159,6 +197,7 @@ void u_server_make_sreg(u_link *link, char *sid)
 		return;
 
 	link->type = LINK_SERVER;
+	u_sendq_set_acct(&link->conn->sendq, LINK_SERVER);
 
 	if (link->priv != NULL)
 		return;
@@ -168,7 +207,7 @@ void u_server_make_sreg(u_link *link, char *sid)
 	sv->flags = SERVER_IS_BURSTING;
 
 	u_strlcpy(sv->sid, sid, 4);
-	mowgli_patricia_add(servers_by_sid, sv->sid, sv);
+	add_sid(sv);
 
 	sv->name[0] = '\0';
 	sv->desc[0] = '\0';
@@ -180,6 +219,7 @@ void u_server_make_sreg(u_link *link, char *sid)
 
 	sv->nusers = 0;
 	sv->nlinks = 0;
+	memset(&sv->uids, 0, sizeof(sv->uids));
 
 	u_log(LG_INFO, "New local server sid=%s", sv->sid);
 
@@ -206,10 +246,12 @@ u_server *u_server_new_remote(u_server *parent, char *sid,
 
 	sv->nusers = 0;
 	sv->nlinks = 0;
+	memset(&sv->uids, 0, sizeof(sv->uids));
 
 	if (sv->sid[0])
-		mowgli_patricia_add(servers_by_sid, sv->sid, sv);
+		add_sid(sv);
 	mowgli_patricia_add(servers_by_name, sv->name, sv);
+	u_server_topology++;
 
 	u_log(LG_INFO, "New remote server name=%s, sid=%s", sv->name, sv->sid);
 
@@ -246,8 +288,10 @@ void u_server_destroy(u_server *sv)
 
 	if (sv->name[0])
 		mowgli_patricia_delete(servers_by_name, sv->name);
+	u_server_topology++;
 	if (sv->sid[0])
-		mowgli_patricia_delete(servers_by_sid, sv->sid);
+		del_sid(sv);
+	u_uid_table_free(&sv->uids);
 
 	/* delete any servers linked to this one */
 	MOWGLI_PATRICIA_FOREACH(tsv, &state, servers_by_sid) {
@@ -265,7 +309,7 @@ static int burst_euid(const char *key, void *value, void *priv)
 	char buf[512];
 
 	u_user_make_euid(u, buf);
-	u_link_f(link, "%s", buf);
+	u_link_send_line(link, buf);
 
 	if (IS_AWAY(u))
 		u_link_f(link, ":%U AWAY :%s", u, u->away);
@@ -309,6 +353,7 @@ static int burst_chan(const char *key, void *_c, void *_link)
 	u_map_each_state st;
 	u_strop_wrap wrap;
 	mowgli_node_t *n;
+	struct iovec iov[2];
 	char *s, buf[512];
 	int sz;
 
@@ -318,6 +363,9 @@ static int burst_chan(const char *key, void *_c, void *_link)
 	sz = snf(FMT_SERVER, buf, 512, ":%S SJOIN %u %s %s :",
 	         &me, c->ts, c->name, u_chan_modes(c, 1));
 
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sz;
+
 	u_strop_wrap_start(&wrap, 510 - sz);
 	U_MAP_EACH(&st, c->members, &u, &cu) {
 		char *p, nbuf[12];
@@ -330,11 +378,17 @@ static int burst_chan(const char *key, void *_c, void *_link)
 		}
 		strcpy(p, u->uid);
 
-		while ((s = u_strop_wrap_word(&wrap, nbuf)) != NULL)
-			u_link_f(link, "%s%s", buf, s);
+		while ((s = u_strop_wrap_word(&wrap, nbuf)) != NULL) {
+			iov[1].iov_base = s;
+			iov[1].iov_len = strlen(s);
+			u_link_sendv(link, iov, 2);
+		}
+	}
+	if ((s = u_strop_wrap_word(&wrap, NULL)) != NULL) {
+		iov[1].iov_base = s;
+		iov[1].iov_len = strlen(s);
+		u_link_sendv(link, iov, 2);
 	}
-	if ((s = u_strop_wrap_word(&wrap, NULL)) != NULL)
-		u_link_f(link, "%s%s", buf, s);
 
 	if (c->topic[0]) {
 		u_link_f(link, ":%S TB %C %u %s :%s", &me, c,
@@ -410,6 +464,7 @@ void u_server_burst_2(u_server *sv, u_link_block *block)
 
 	u_log(LG_DEBUG, "Adding %s to servers_by_name", sv->name);
 	mowgli_patricia_add(servers_by_name, sv->name, sv);
+	u_server_topology++;
 }
 
 void u_server_eob(u_server *sv)
@@ -561,8 +616,9 @@ static int restore_specific_server(const char *sid, mowgli_json_t *js)
 			return -1;
 		memcpy(s->desc, jsdesc->str, jsdesc->pos);
 
-		mowgli_patricia_add(servers_by_sid,  s->sid,  s);
+		add_sid(s);
 		mowgli_patricia_add(servers_by_name, s->name, s);
+		u_server_topology++;
 	}
 
 	return 1;
@@ -630,7 +686,7 @@ int init_server(void)
 	me.nlinks = 0;
 
 	mowgli_patricia_add(servers_by_name, me.name, &me);
-	mowgli_patricia_add(servers_by_sid, me.sid, &me);
+	add_sid(&me);
 
 	return 1;
 }
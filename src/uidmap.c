@@ -0,0 +1,162 @@
+/* Tethys, uidmap.c -- direct lookup of TS6 SIDs and UIDs
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+#define MIN_SLOTS 16
+
+struct u_uid_slot {
+	uint id;
+	void *u; /* NULL if the slot is empty */
+};
+
+/* same order as id_map in user.c */
+static int digit36(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a';
+	if (c >= '0' && c <= '9')
+		return c - '0' + 26;
+	return -1;
+}
+
+int u_sid_index(const char *s)
+{
+	int a, b;
+
+	if (s[0] < '0' || s[0] > '9')
+		return -1;
+	if ((a = digit36(s[1])) < 0 || (b = digit36(s[2])) < 0)
+		return -1;
+
+	return ((s[0] - '0') * 36 + a) * 36 + b;
+}
+
+long u_uid_index(const char *s)
+{
+	long id = 0;
+	int i, d;
+
+	for (i=0; i<6; i++) {
+		if ((d = digit36(s[i])) < 0)
+			return -1;
+		id = id * 36 + d;
+	}
+
+	return id;
+}
+
+/* Local UIDs are handed out in sequence, which would make runs in the
+   low bits. Multiplying spreads them over the whole table. */
+static uint home(u_uid_table *t, uint id)
+{
+	return (id * 0x9e3779b1u) & t->mask;
+}
+
+void *u_uid_table_get(u_uid_table *t, uint id)
+{
+	struct u_uid_slot *s;
+	uint i;
+
+	if (t->slots == NULL)
+		return NULL;
+
+	for (i = home(t, id); ; i = (i + 1) & t->mask) {
+		s = &t->slots[i];
+		if (s->u == NULL)
+			return NULL;
+		if (s->id == id)
+			return s->u;
+	}
+}
+
+static void put(u_uid_table *t, uint id, void *u)
+{
+	uint i;
+
+	for (i = home(t, id); t->slots[i].u; i = (i + 1) & t->mask) {
+		if (t->slots[i].id == id)
+			break;
+	}
+
+	if (t->slots[i].u == NULL)
+		t->count++;
+	t->slots[i].id = id;
+	t->slots[i].u = u;
+}
+
+static void resize(u_uid_table *t, uint size)
+{
+	struct u_uid_slot *old = t->slots;
+	uint i, old_size = old ? t->mask + 1 : 0;
+
+	if (!(t->slots = calloc(size, sizeof(*t->slots)))) {
+		u_log(LG_SEVERE, "calloc() failed");
+		abort();
+	}
+
+	t->mask = size - 1;
+	t->count = 0;
+
+	for (i=0; i<old_size; i++) {
+		if (old[i].u != NULL)
+			put(t, old[i].id, old[i].u);
+	}
+
+	free(old);
+}
+
+void u_uid_table_add(u_uid_table *t, uint id, void *u)
+{
+	if (t->slots == NULL)
+		resize(t, MIN_SLOTS);
+	else if ((t->count + 1) * 4 > (t->mask + 1) * 3)
+		resize(t, (t->mask + 1) * 2);
+
+	put(t, id, u);
+}
+
+bool u_uid_table_del(u_uid_table *t, uint id, void *u)
+{
+	uint i, j, h;
+
+	if (t->slots == NULL)
+		return false;
+
+	for (i = home(t, id); ; i = (i + 1) & t->mask) {
+		if (t->slots[i].u == NULL)
+			return false;
+		if (t->slots[i].id == id)
+			break;
+	}
+	if (t->slots[i].u != u)
+		return false;
+
+	/* Shift later entries of the same run back into the hole, so that
+	   lookups never need to step over deleted slots. */
+	for (j = (i + 1) & t->mask; t->slots[j].u; j = (j + 1) & t->mask) {
+		h = home(t, t->slots[j].id);
+		/* leave it if its home lies cyclically in (i, j] */
+		if (i <= j ? (i < h && h <= j) : (i < h || h <= j))
+			continue;
+		t->slots[i] = t->slots[j];
+		i = j;
+	}
+
+	t->slots[i].u = NULL;
+	t->count--;
+	return true;
+}
+
+void u_uid_table_free(u_uid_table *t)
+{
+	free(t->slots);
+	t->slots = NULL;
+	t->mask = 0;
+	t->count = 0;
+}
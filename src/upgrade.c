@@ -84,6 +84,13 @@ begin_upgrade(void)
 	if (!f)
 		return -1;
 
+	/* Take all connections back from the I/O workers, so that their
+	   pending input is in the link buffers before they're dumped. */
+	u_io_stop();
+
+	/* Broadcasts in progress aren't dumped, so they're finished now */
+	u_sendto_finish_jobs();
+
 	/* Open database */
 	upgrade_json = mowgli_json_create_object();
 
@@ -114,6 +121,7 @@ begin_upgrade(void)
 	if ((err = _form_phoenix_args(UPGRADE_FILENAME, &argv)) < 0)
 		goto error;
 
+	u_log_flush();
 	return execvp(argv[0], (char**)argv);
 
 error:
@@ -196,6 +204,7 @@ abort_upgrade(void)
 	if ((err = _form_phoenix_args(NULL, &argv)) < 0)
 		abort();
 
+	u_log_flush();
 	execvp(argv[0], (char**)argv);
 	abort();
 }
@@ -0,0 +1,184 @@
+/* Tethys, uring.c -- batched socket I/O with io_uring
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* The event loop is still mowgli's, and still tells us which sockets are
+   ready. What changes is that conn.c no longer makes one read() or
+   writev() per ready socket, but collects them over a loop iteration and
+   hands the whole lot to the kernel here in one io_uring_enter(). */
+
+#include "ircd.h"
+
+#ifdef HAVE_LIBURING
+
+#include <limits.h>
+#include <liburing.h>
+
+#define RING_ENTRIES 1024
+
+/* res of an operation the kernel hasn't completed yet */
+#define PENDING SSIZE_MAX
+
+static struct io_uring ring;
+static bool ring_ok = false;
+
+/* registered buffers, if the kernel let us pin them */
+static uchar *bufs = NULL;
+static bool bufs_fixed = false;
+
+bool u_uring_enabled(void)
+{
+	return ring_ok;
+}
+
+uchar *u_uring_buf(int buf)
+{
+	return bufs + buf * U_URING_BUFSIZE;
+}
+
+static void prep(struct io_uring_sqe *sqe, u_uring_op *op)
+{
+	if (op->buf < 0) {
+		io_uring_prep_writev(sqe, op->fd, op->iov, op->iovcnt, 0);
+	} else if (bufs_fixed) {
+		io_uring_prep_read_fixed(sqe, op->fd, u_uring_buf(op->buf),
+		                         U_URING_BUFSIZE, 0, op->buf);
+	} else {
+		io_uring_prep_read(sqe, op->fd, u_uring_buf(op->buf),
+		                   U_URING_BUFSIZE, 0);
+	}
+
+	io_uring_sqe_set_data(sqe, op);
+}
+
+/* only used if the ring fails underneath us */
+static void run_sync(u_uring_op *op)
+{
+	if (op->buf < 0)
+		op->res = writev(op->fd, op->iov, op->iovcnt);
+	else
+		op->res = read(op->fd, u_uring_buf(op->buf), U_URING_BUFSIZE);
+
+	if (op->res < 0)
+		op->res = -errno;
+}
+
+void u_uring_run(u_uring_op *ops, int count)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned head, seen;
+	int i, next = 0, done = 0, inflight = 0, err;
+
+	while (done < count) {
+		/* anything that doesn't fit in the ring waits for a later
+		   round. RING_ENTRIES is large enough that this is rare. */
+		while (next < count && (sqe = io_uring_get_sqe(&ring))) {
+			ops[next].res = PENDING;
+			prep(sqe, &ops[next++]);
+			inflight++;
+		}
+
+		err = io_uring_submit_and_wait(&ring, inflight);
+
+		if (err < 0 && err != -EINTR && err != -EAGAIN &&
+		    err != -EBUSY) {
+			errno = -err;
+			u_perror("io_uring_submit_and_wait");
+			break;
+		}
+
+		seen = 0;
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			u_uring_op *op = io_uring_cqe_get_data(cqe);
+			op->res = cqe->res;
+			seen++;
+		}
+		io_uring_cq_advance(&ring, seen);
+
+		done += seen;
+		inflight -= seen;
+	}
+
+	if (done == count)
+		return;
+
+	/* The ring is broken. Give up on it, and do the rest ourselves.
+	   Whatever was submitted but never completed may or may not have
+	   happened, and repeating it could duplicate or lose data, so
+	   those connections get an error instead. */
+	u_log(LG_ERROR, "io_uring failed, falling back to plain syscalls");
+
+	io_uring_queue_exit(&ring);
+	ring_ok = false;
+
+	for (i=0; i<next; i++) {
+		if (ops[i].res == PENDING)
+			ops[i].res = -EIO;
+	}
+
+	for (i=next; i<count; i++)
+		run_sync(&ops[i]);
+}
+
+int init_uring(void)
+{
+	struct iovec iov[U_URING_BUFS];
+	int i, err;
+
+	if ((err = io_uring_queue_init(RING_ENTRIES, &ring, 0)) < 0) {
+		u_log(LG_INFO, "io_uring unavailable (%s), using plain syscalls",
+		      strerror(-err));
+		return 0;
+	}
+
+	bufs = malloc(U_URING_BUFS * U_URING_BUFSIZE);
+	if (bufs == NULL) {
+		io_uring_queue_exit(&ring);
+		return 0;
+	}
+
+	for (i=0; i<U_URING_BUFS; i++) {
+		iov[i].iov_base = u_uring_buf(i);
+		iov[i].iov_len = U_URING_BUFSIZE;
+	}
+
+	/* Pinning the buffers counts against RLIMIT_MEMLOCK on older
+	   kernels. Plain reads into the same buffers are fine too. */
+	if ((err = io_uring_register_buffers(&ring, iov, U_URING_BUFS)) < 0) {
+		u_log(LG_INFO, "io_uring: not registering buffers (%s)",
+		      strerror(-err));
+	} else {
+		bufs_fixed = true;
+	}
+
+	ring_ok = true;
+	u_log(LG_INFO, "Using io_uring for socket I/O");
+
+	return 0;
+}
+
+#else
+
+bool u_uring_enabled(void)
+{
+	return false;
+}
+
+uchar *u_uring_buf(int buf)
+{
+	return NULL;
+}
+
+void u_uring_run(u_uring_op *ops, int count)
+{
+}
+
+int init_uring(void)
+{
+	return 0;
+}
+
+#endif
@@ -9,6 +9,15 @@
 mowgli_patricia_t *users_by_nick;
 mowgli_patricia_t *users_by_uid;
 
+u_histogram reg_hist[U_REG_NUM_PHASES];
+
+const char *reg_phase_names[U_REG_NUM_PHASES] = {
+	[U_REG_RDNS]  = "rdns",
+	[U_REG_CAPS]  = "caps",
+	[U_REG_AUTH]  = "auth",
+	[U_REG_TOTAL] = "total",
+};
+
 char *id_map = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
 int id_modulus = 36; /* just strlen(uid_map) */
 char id_digits[6] = {0, 0, 0, 0, 0, 0};
@@ -46,6 +55,27 @@ static int set_id_next_from_str(const char *id)
 	return 0;
 }
 
+/* users with a TS6-shaped UID that aren't in any server's uids table,
+   because no server had their SID. Lookups only fall back to the patricia
+   if there are any. */
+static uint uid_strays = 0;
+
+/* returns the last 6 digits of a UID, and sets *sv to the server its SID
+   belongs to, or NULL. Returns -1 if uid is not a TS6 UID. */
+static long uid_split(const char *uid, u_server **sv)
+{
+	int sidx;
+	long id;
+
+	if ((sidx = u_sid_index(uid)) < 0)
+		return -1;
+	if ((id = u_uid_index(uid + 3)) < 0 || uid[9])
+		return -1;
+
+	*sv = u_server_by_sid_index(sidx);
+	return id;
+}
+
 static ulong umode_get_flag_bits(u_modes *m)
 {
 	return ((u_user*) m->target)->mode;
@@ -81,7 +111,9 @@ uint umode_default = 0;
 
 static u_user *create_user(const char *uid, u_link *link, u_server *sv)
 {
+	u_server *home;
 	u_user *u;
+	long id;
 
 	if (!(u = calloc(1, sizeof(*u)))) {
 		u_log(LG_SEVERE, "calloc() failed");
@@ -91,8 +123,17 @@ static u_user *create_user(const char *uid, u_link *link, u_server *sv)
 	u_strlcpy(u->uid, uid, 10);
 	mowgli_patricia_add(users_by_uid, u->uid, u);
 
-	u->channels = u_map_new(0);
-	u->invites = u_map_new(0);
+	if ((id = uid_split(u->uid, &home)) >= 0) {
+		if (home != NULL) {
+			u_uid_table_add(&home->uids, id, u);
+		} else {
+			u->uid_stray = true;
+			uid_strays++;
+		}
+	}
+
+	u->channels = u_map_new(MAP_HASH);
+	u->invites = u_map_new(MAP_HASH);
 
 	u_ratelimit_init(u);
 
@@ -121,6 +162,7 @@ u_user *u_user_create_local(u_link *link)
 
 	link->type = LINK_USER;
 	link->priv = u;
+	u_sendq_set_acct(&link->conn->sendq, LINK_USER);
 
 	u_log(LG_VERBOSE, "New local user, uid=%s", u->uid);
 
@@ -149,9 +191,13 @@ void user_destroy_cb(u_map *map, u_chan *c, u_chanuser *cu, void *priv)
 
 void u_user_destroy(u_user *u)
 {
+	u_server *home;
+	long id;
+
 	u_log(LG_VERBOSE, "Destroying user uid=%s (%U)", u->uid, u);
 
 	u_clr_invites_user(u);
+	u_ratelimit_fini(u);
 
 	/* part from all channels */
 	u_map_each(u->channels, (u_map_cb_t*)user_destroy_cb, NULL);
@@ -161,13 +207,27 @@ void u_user_destroy(u_user *u)
 		mowgli_patricia_delete(users_by_nick, u->nick);
 	mowgli_patricia_delete(users_by_uid, u->uid);
 
+	if (u->uid_stray)
+		uid_strays--;
+	else if ((id = uid_split(u->uid, &home)) >= 0 && home != NULL)
+		u_uid_table_del(&home->uids, id, u);
+
 	u->sv->nusers--;
 
 	free(u);
 }
 
+static void reg_phase(int phase, uint64_t start, uint64_t end)
+{
+	if (start != 0 && end >= start)
+		u_hist_add(&reg_hist[phase], end - start);
+}
+
 void u_user_try_register(u_user *u)
 {
+	u_link_regtime *reg;
+	uint64_t start;
+
 	if (!IS_LOCAL_USER(u))
 		return;
 
@@ -183,17 +243,27 @@ void u_user_try_register(u_user *u)
 	if (u->flags & USER_MASK_WAIT)
 		return;
 
-	if (!(u->link->conf.auth = u_find_auth(u->link))) {
+	start = u_mono_usec();
+	u->link->conf.auth = u_find_auth(u->link);
+	reg_phase(U_REG_AUTH, start, u_mono_usec());
+
+	if (!u->link->conf.auth) {
 		u_link_fatal(u->link, "No auth blocks for your host");
 		return;
 	}
 	u->link->sendq = u->link->conf.auth->cls->sendq;
 
 	u->link->flags |= U_LINK_REGISTERED;
+	u_link_set_ping(u->link, u->link->conf.auth->cls->timeout);
 	u_strlcpy(u->ip, u->link->conn->ip, INET6_ADDRSTRLEN);
 	u_strlcpy(u->realhost, u->link->conn->host, MAXHOST+1);
 	u_strlcpy(u->host, u->link->conn->host, MAXHOST+1);
 	u_user_welcome(u);
+
+	reg = &u->link->reg;
+	reg_phase(U_REG_RDNS, reg->rdns_start, reg->rdns_end);
+	reg_phase(U_REG_CAPS, reg->caps_start, reg->caps_end);
+	reg_phase(U_REG_TOTAL, reg->accept, u_mono_usec());
 }
 
 u_user *u_user_by_nick_raw(const char *nick)
@@ -209,7 +279,19 @@ u_user *u_user_by_nick(const char *nick)
 
 u_user *u_user_by_uid_raw(const char *uid)
 {
-	return mowgli_patricia_retrieve(users_by_uid, uid);
+	u_server *sv;
+	u_user *u = NULL;
+	long id;
+
+	if ((id = uid_split(uid, &sv)) < 0)
+		return mowgli_patricia_retrieve(users_by_uid, uid);
+
+	if (sv != NULL)
+		u = u_uid_table_get(&sv->uids, id);
+	if (u == NULL && uid_strays > 0)
+		u = mowgli_patricia_retrieve(users_by_uid, uid);
+
+	return u;
 }
 
 u_user *u_user_by_uid(const char *nick)
@@ -481,7 +563,7 @@ static int dump_specific_user(u_user *u, mowgli_json_t *j_users)
 
 int dump_user(void)
 {
-	int err;
+	int i, err;
 	u_user *u;
 	mowgli_patricia_iteration_state_t state;
 
@@ -498,6 +580,13 @@ int dump_user(void)
 	    return err;
 	}
 
+	/* Dump registration timing */
+	mowgli_json_t *j_reg = mowgli_json_create_object();
+	json_oseto(upgrade_json, "reg_hist", j_reg);
+
+	for (i=0; i<U_REG_NUM_PHASES; i++)
+		json_oseto(j_reg, reg_phase_names[i], u_hist_to_json(&reg_hist[i]));
+
 	return 0;
 }
 
@@ -617,8 +706,8 @@ static int restore_specific_user(const char *uid, mowgli_json_t *ju)
 
 int restore_user(void)
 {
-	int err;
-	mowgli_json_t *ju, *jusers;
+	int i, err;
+	mowgli_json_t *ju, *jusers, *jreg, *jh;
 	mowgli_patricia_iteration_state_t state;
 	mowgli_string_t *jsnextuid;
 	const char *k;
@@ -646,6 +735,15 @@ int restore_user(void)
 			return err;
 	}
 
+	/* Restore registration timing, if the old process had any */
+	if ((jreg = json_ogeto_c(upgrade_json, "reg_hist"))) {
+		for (i=0; i<U_REG_NUM_PHASES; i++) {
+			jh = json_ogeto_c(jreg, reg_phase_names[i]);
+			if (jh && u_hist_from_json(jh, &reg_hist[i]) < 0)
+				return -1;
+		}
+	}
+
 	/* Done */
 	u_log(LG_DEBUG, "Done restoring users");
 	return 0;
@@ -0,0 +1,119 @@
+/* Tethys, wheel.c -- hierarchical timing wheel
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+#include "ircd.h"
+
+#define MASK (U_WHEEL_SLOTS - 1)
+
+u_wheel u_timers;
+
+void u_wheel_init(u_wheel *w, uint64_t now)
+{
+	memset(w, 0, sizeof(*w));
+	w->now = now;
+}
+
+/* puts t in the slot it belongs in, given how far off it is. During a
+   cascade, that can be the slot about to be run. */
+static void place(u_wheel *w, u_timer *t)
+{
+	uint64_t d = t->when - w->now;
+	int level = 0;
+
+	if (d > U_WHEEL_MAX_DELAY) {
+		d = U_WHEEL_MAX_DELAY;
+		t->when = w->now + d;
+	}
+
+	while (d >> (U_WHEEL_BITS * (level + 1)))
+		level++;
+
+	t->slot = &w->slots[level][(t->when >> (U_WHEEL_BITS * level)) & MASK];
+	mowgli_node_add(t, &t->n, t->slot);
+}
+
+void u_timer_init(u_timer *t, u_timer_cb_t *cb, void *priv)
+{
+	memset(t, 0, sizeof(*t));
+	t->cb = cb;
+	t->priv = priv;
+}
+
+void u_timer_arm(u_wheel *w, u_timer *t, uint64_t delay)
+{
+	if (t->slot)
+		mowgli_node_delete(&t->n, t->slot);
+	else
+		w->count++;
+
+	if (delay == 0)
+		delay = 1;
+
+	t->when = w->now + delay;
+	place(w, t);
+}
+
+void u_timer_cancel(u_wheel *w, u_timer *t)
+{
+	if (!t->slot)
+		return;
+
+	mowgli_node_delete(&t->n, t->slot);
+	t->slot = NULL;
+	w->count--;
+}
+
+/* moves the timers in one slot down to the wheels below */
+static void cascade(u_wheel *w, mowgli_list_t *slot)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_LIST_FOREACH_SAFE(n, tn, slot->head) {
+		mowgli_node_delete(n, slot);
+		place(w, n->data);
+	}
+}
+
+uint u_wheel_run(u_wheel *w, uint64_t now)
+{
+	mowgli_list_t *slot;
+	u_timer *t;
+	uint ran = 0;
+	int level;
+
+	while (w->now < now) {
+		/* nothing can be missed by skipping ahead */
+		if (w->count == 0) {
+			w->now = now;
+			break;
+		}
+
+		w->now++;
+
+		/* the higher wheels turn one slot each time the one below
+		   has gone all the way round */
+		for (level = 1; level < U_WHEEL_LEVELS; level++) {
+			if (w->now & ((1ull << (U_WHEEL_BITS * level)) - 1))
+				break;
+		}
+		while (--level > 0) {
+			cascade(w, &w->slots[level]
+			        [(w->now >> (U_WHEEL_BITS * level)) & MASK]);
+		}
+
+		slot = &w->slots[0][w->now & MASK];
+		while (slot->head != NULL) {
+			t = slot->head->data;
+			mowgli_node_delete(&t->n, slot);
+			t->slot = NULL;
+			w->count--;
+			ran++;
+			t->cb(t, t->priv);
+		}
+	}
+
+	return ran;
+}
@@ -0,0 +1,129 @@
+/* Tethys, storm.c -- reconnect storm benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Simulates the flood of clients that follows a netsplit. Keeps a fixed
+   number of connection attempts in flight against a running server and
+   counts a connection as accepted once the server sends its first bytes
+   (the hostname lookup notice), which only happens after the ircd has
+   accept()ed it. Reports accepts per second.
+
+   usage: ./storm [host [port [total [inflight]]]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+static struct addrinfo *target;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int start_connect(void)
+{
+	int fd;
+
+	if ((fd = socket(target->ai_family, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	if (connect(fd, target->ai_addr, target->ai_addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+		perror("connect");
+		exit(1);
+	}
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	struct pollfd *fds;
+	char *host = "127.0.0.1", *port = "6667", buf[512];
+	int total = 10000, inflight = 500;
+	int started = 0, accepted = 0, failed = 0;
+	double start, elapsed;
+	int i, n;
+
+	if (argc > 1) host = argv[1];
+	if (argc > 2) port = argv[2];
+	if (argc > 3) total = atoi(argv[3]);
+	if (argc > 4) inflight = atoi(argv[4]);
+
+	if (inflight > total)
+		inflight = total;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &target) != 0) {
+		fprintf(stderr, "can't resolve %s:%s\n", host, port);
+		return 1;
+	}
+
+	fds = calloc(inflight, sizeof(*fds));
+
+	start = now();
+
+	for (i=0; i<inflight; i++) {
+		fds[i].fd = start_connect();
+		fds[i].events = POLLIN;
+		started++;
+	}
+
+	while (accepted + failed < total) {
+		if ((n = poll(fds, inflight, 5000)) < 0) {
+			perror("poll");
+			return 1;
+		}
+
+		if (n == 0) {
+			fprintf(stderr, "timed out, %d connections stuck\n",
+			        total - accepted - failed);
+			break;
+		}
+
+		for (i=0; i<inflight; i++) {
+			if (fds[i].fd < 0 || !fds[i].revents)
+				continue;
+
+			if (read(fds[i].fd, buf, sizeof(buf)) > 0)
+				accepted++;
+			else
+				failed++;
+
+			close(fds[i].fd);
+			fds[i].fd = -1;
+
+			if (started < total) {
+				fds[i].fd = start_connect();
+				started++;
+			}
+		}
+	}
+
+	elapsed = now() - start;
+
+	printf("%d accepted, %d failed in %.3fs: %.0f accepts/sec\n",
+	       accepted, failed, elapsed, accepted / elapsed);
+
+	return 0;
+}
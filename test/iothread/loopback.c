@@ -0,0 +1,219 @@
+/* Tethys, loopback.c -- pipelined PING benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Registers a number of clients against a running server, then keeps a
+   fixed number of PINGs in flight on each of them and counts the PONGs
+   that come back. Reports PONGs per second. Run it against the same
+   server with different io { threads } settings to compare.
+
+   usage: ./loopback [host [port [clients [pipeline [seconds]]]]] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+struct client {
+	int fd;
+	int registered;
+	int inflight;
+	size_t len;
+	char buf[4096];
+};
+
+static struct addrinfo *target;
+static int pipeline = 8;
+static long pongs = 0;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void send_all(int fd, const char *s, size_t len)
+{
+	ssize_t sz;
+
+	while (len > 0) {
+		sz = write(fd, s, len);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+		s += sz;
+		len -= sz;
+	}
+}
+
+static void send_pings(struct client *cl)
+{
+	char buf[512];
+	size_t len = 0;
+
+	while (cl->inflight < pipeline) {
+		len += sprintf(buf + len, "PING :%d\r\n", cl->inflight);
+		cl->inflight++;
+	}
+
+	if (len > 0)
+		send_all(cl->fd, buf, len);
+}
+
+static void handle_line(struct client *cl, char *line)
+{
+	char *p;
+
+	if (line[0] == ':' && (p = strchr(line, ' ')))
+		line = p + 1;
+
+	if (!strncmp(line, "PING ", 5)) {
+		line[1] = 'O';
+		send_all(cl->fd, line, strlen(line));
+		send_all(cl->fd, "\r\n", 2);
+	} else if (!strncmp(line, "001 ", 4)) {
+		cl->registered = 1;
+		send_pings(cl);
+	} else if (!strncmp(line, "PONG ", 5)) {
+		pongs++;
+		cl->inflight--;
+		send_pings(cl);
+	} else if (!strncmp(line, "ERROR ", 6)) {
+		fprintf(stderr, "server: %s\n", line);
+		exit(1);
+	}
+}
+
+static void client_read(struct client *cl)
+{
+	char *s, *p;
+	ssize_t sz;
+
+	sz = read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - cl->len - 1);
+	if (sz <= 0) {
+		if (sz < 0 && (errno == EINTR || errno == EAGAIN))
+			return;
+		fprintf(stderr, "connection closed\n");
+		exit(1);
+	}
+	cl->len += sz;
+	cl->buf[cl->len] = '\0';
+
+	s = cl->buf;
+	while ((p = strchr(s, '\n'))) {
+		*p = '\0';
+		if (p > s && p[-1] == '\r')
+			p[-1] = '\0';
+		handle_line(cl, s);
+		s = p + 1;
+	}
+
+	cl->len -= s - cl->buf;
+	memmove(cl->buf, s, cl->len);
+}
+
+static void client_connect(struct client *cl, int n)
+{
+	char buf[512];
+
+	if ((cl->fd = socket(target->ai_family, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	if (connect(cl->fd, target->ai_addr, target->ai_addrlen) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	sprintf(buf, "NICK lb%d\r\nUSER lb * 0 :loopback\r\n", n);
+	send_all(cl->fd, buf, strlen(buf));
+	fcntl(cl->fd, F_SETFL, fcntl(cl->fd, F_GETFL) | O_NONBLOCK);
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	struct pollfd *fds;
+	struct client *cl;
+	char *host = "127.0.0.1", *port = "6667";
+	int clients = 100, seconds = 10;
+	int i, err, ready;
+	double start, end, elapsed;
+
+	if (argc > 1) host = argv[1];
+	if (argc > 2) port = argv[2];
+	if (argc > 3) clients = atoi(argv[3]);
+	if (argc > 4) pipeline = atoi(argv[4]);
+	if (argc > 5) seconds = atoi(argv[5]);
+
+	if (clients < 1 || pipeline < 1 || pipeline > 32 || seconds < 1) {
+		fprintf(stderr, "usage: %s [host [port [clients "
+		        "[pipeline [seconds]]]]]\n", argv[0]);
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(host, port, &hints, &target)) != 0) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return 1;
+	}
+
+	cl = calloc(clients, sizeof(*cl));
+	fds = calloc(clients, sizeof(*fds));
+
+	for (i=0; i<clients; i++) {
+		client_connect(&cl[i], i);
+		fds[i].fd = cl[i].fd;
+		fds[i].events = POLLIN;
+	}
+
+	/* wait for every client to finish registering before timing */
+	for (ready = 0; ready < clients; ) {
+		if (poll(fds, clients, 1000) < 0 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+		for (i=0, ready=0; i<clients; i++) {
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(&cl[i]);
+			ready += cl[i].registered;
+		}
+	}
+
+	pongs = 0;
+	start = now();
+	end = start + seconds;
+
+	while (now() < end) {
+		if (poll(fds, clients, 100) < 0 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+		for (i=0; i<clients; i++) {
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(&cl[i]);
+		}
+	}
+
+	elapsed = now() - start;
+	printf("%d clients, %d in flight each: %ld pongs in %.2fs "
+	       "(%.0f/s)\n", clients, pipeline, pongs, elapsed,
+	       pongs / elapsed);
+
+	return 0;
+}
@@ -0,0 +1,182 @@
+/* Tethys, bench.c -- line framing microbenchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Frames a server burst into lines, over and over, the old way (two
+   memchr() calls per line, then stepping over the line endings) and
+   with each u_linescan implementation, and checks that they all agree.
+
+   The burst is read from a file, which should be the raw bytes a server
+   sent, as recorded with e.g. tcpflow or socat -r. Without one, a burst
+   of EUID and SJOIN lines is made up.
+
+   usage: ./bench [burst-file [rounds]] */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "ircd.h"
+
+/* the implementations are all static */
+#include "../../src/linescan.c"
+
+#define SPANS 32
+
+typedef int (scan_fn)(const uchar*, size_t, u_line_span*, int);
+
+static uchar *burst;
+static size_t burst_len;
+
+static void make_burst(void)
+{
+	size_t size = 16 << 20;
+	int i, j, n;
+
+	burst = malloc(size);
+
+	for (i=0; burst_len + 4096 < size; i++) {
+		burst_len += sprintf((char*)burst + burst_len,
+		    ":00A EUID user%d 1 1400000000 +i ~user%d "
+		    "host-%d.example.net 10.%d.%d.%d 00AAA%04X "
+		    "host-%d.example.net * :Some User\r\n",
+		    i, i, i, i >> 16 & 255, i >> 8 & 255, i & 255, i & 0xffff, i);
+
+		if (i % 20 != 0)
+			continue;
+
+		n = sprintf((char*)burst + burst_len,
+		    ":00A SJOIN 1400000000 #channel%d +nt :", i / 20);
+		for (j=0; j<20; j++) {
+			n += sprintf((char*)burst + burst_len + n, "%s00AAA%04X",
+			             j == 0 ? "@" : " ", (i - j) & 0xffff);
+		}
+		n += sprintf((char*)burst + burst_len + n, "\r\n");
+		burst_len += n;
+	}
+}
+
+static void read_burst(const char *path)
+{
+	FILE *f;
+	size_t n;
+
+	if (!(f = fopen(path, "rb"))) {
+		perror(path);
+		exit(1);
+	}
+
+	while (!feof(f)) {
+		burst = realloc(burst, burst_len + 65536);
+		n = fread(burst + burst_len, 1, 65536, f);
+		burst_len += n;
+	}
+
+	fclose(f);
+}
+
+/* what dispatch_lines used to do */
+static int scan_memchr(const uchar *p, size_t n, u_line_span *spans, int max)
+{
+	const uchar *s;
+	size_t start = 0, eol, end;
+	int count = 0;
+
+	while (count < max && start < n) {
+		eol = n - start;
+		if ((s = memchr(p + start, '\n', eol)) != NULL)
+			eol = s - (p + start);
+		if ((s = memchr(p + start, '\r', eol)) != NULL)
+			eol = s - (p + start);
+		eol += start;
+
+		if (eol == n)
+			break;
+
+		for (end = eol; end < n && (p[end] == '\r' || p[end] == '\n'); end++);
+
+		spans[count].off = start;
+		spans[count].len = eol - start;
+		spans[count].end = start = end;
+		count++;
+	}
+
+	return count;
+}
+
+/* frames the burst, SPANS lines at a time, as dispatch_lines does, and
+   returns a checksum of the line boundaries */
+static ulong frame(scan_fn *fn, ulong *lines)
+{
+	u_line_span spans[SPANS];
+	size_t pos = 0;
+	ulong sum = 0;
+	int i, n;
+
+	*lines = 0;
+
+	while ((n = fn(burst + pos, burst_len - pos, spans, SPANS)) > 0) {
+		for (i=0; i<n; i++)
+			sum = sum * 31 + pos + spans[i].off + spans[i].len;
+		pos += spans[n-1].end;
+		*lines += n;
+	}
+
+	return sum;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *name, scan_fn *fn, int rounds, ulong expect)
+{
+	ulong sum = 0, lines = 0;
+	double start, secs;
+	int i;
+
+	start = now();
+	for (i=0; i<rounds; i++)
+		sum = frame(fn, &lines);
+	secs = now() - start;
+
+	printf("%-8s %8.2f ms/round %8.1f MB/s %8.1f Mlines/s%s\n", name,
+	       secs * 1000 / rounds, burst_len * rounds / secs / 1e6,
+	       lines * rounds / secs / 1e6,
+	       expect && sum != expect ? "  MISMATCH" : "");
+
+	return expect && sum != expect;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 2 ? atoi(argv[2]) : 20;
+	ulong expect, lines;
+	int bad = 0;
+
+	if (argc > 1)
+		read_burst(argv[1]);
+	else
+		make_burst();
+
+	expect = frame(scan_memchr, &lines);
+	printf("%lu bytes, %lu lines, %d rounds\n", (ulong)burst_len,
+	       lines, rounds);
+
+	bad += run("memchr", scan_memchr, rounds, 0);
+	bad += run("scalar", scan_scalar, rounds, expect);
+#ifdef LINESCAN_X86
+	bad += run("sse2", scan_sse2, rounds, expect);
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		bad += run("avx2", scan_avx2, rounds, expect);
+#endif
+
+	printf("u_linescan uses %s\n", u_linescan_impl());
+
+	return bad ? 1 : 0;
+}
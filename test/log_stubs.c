@@ -4,6 +4,7 @@
    This file is protected under the terms contained
    in the COPYING file in the project root */
 
+#include <stdint.h>
 #include "../include/log.h"
 #include <stdio.h>
 #include <time.h>
@@ -29,6 +30,11 @@ int default_handler(int level, char *tm, char *line)
 
 int (*u_log_handler)(int, char*, char*) = default_handler;
 int u_log_level = LG_INFO;
+uint64_t u_log_dropped = 0;
+
+void u_log_flush(void)
+{
+}
 
 int u_log(int level, char* fmt, ...)
 {
@@ -4,9 +4,64 @@
 
 u_map *map;
 
+/* With -h, the map under test is a MAP_HASH map with pointer keys. Each
+   key string is interned in names, so the same string is always the
+   same pointer. Neither the hash nor U_MAP_EACH over the tree go in key
+   order, so dumps are sorted. */
+u_map *names = NULL;
+
+static char *key(char *s)
+{
+	char *k;
+
+	if (names == NULL)
+		return s;
+
+	if ((k = u_map_get(names, s)) == NULL) {
+		k = strdup(s);
+		u_map_set(names, s, k);
+	}
+
+	return k;
+}
+
+struct ent {
+	char *k, *v;
+};
+
+static struct ent *ents;
+static int nents;
+
+static int ent_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct ent*)a)->k, ((struct ent*)b)->k);
+}
+
+static void put(char *k, char *v)
+{
+	ents[nents].k = k;
+	ents[nents].v = v;
+	nents++;
+}
+
+static void put_start(void)
+{
+	ents = realloc(ents, (map->size + 1) * sizeof(*ents));
+	nents = 0;
+}
+
+static void put_end(void)
+{
+	int i;
+
+	qsort(ents, nents, sizeof(*ents), ent_cmp);
+	for (i=0; i<nents; i++)
+		printf("%s=%s\n", ents[i].k, ents[i].v);
+}
+
 static void do_dump(u_map *map, void *k, void *v, void *priv)
 {
-	printf("%s=%s\n", k, v);
+	put(k, v);
 }
 
 int main(int argc, char *argv[])
@@ -15,7 +70,12 @@ int main(int argc, char *argv[])
 	int running = 1;
 	size_t sz;
 
-	map = u_map_new(1);
+	if (argc > 1 && !strcmp(argv[1], "-h")) {
+		names = u_map_new(MAP_STRING_KEYS);
+		map = u_map_new(MAP_HASH);
+	} else {
+		map = u_map_new(MAP_STRING_KEYS);
+	}
 
 	while (running && !feof(stdin)) {
 		fgets(line, LINESIZE, stdin);
@@ -35,7 +95,9 @@ int main(int argc, char *argv[])
 			break;
 
 		case 'd': /* dump */
+			put_start();
 			u_map_each(map, do_dump, NULL);
+			put_end();
 			break;
 
 		case 'D': { /* dump 2 */
@@ -43,8 +105,24 @@ int main(int argc, char *argv[])
 			char *k;
 			void *v;
 
-			U_MAP_EACH(&state, map, k, v)
-				printf("%s=%s\n", k, v);
+			put_start();
+			U_MAP_EACH(&state, map, &k, &v)
+				put(k, v);
+			put_end();
+			break;
+		}
+
+		case '!': { /* delete everything while iterating */
+			u_map_each_state state;
+			char *k;
+			void *v;
+			int n = 0;
+
+			U_MAP_EACH(&state, map, &k, &v) {
+				free(u_map_del(map, k));
+				n++;
+			}
+			printf("%d %d\n", n, map->size);
 			break;
 		}
 
@@ -55,17 +133,17 @@ int main(int argc, char *argv[])
 				break;
 			}
 			*p++ = '\0';
-			u_map_set(map, s+1, strdup(p));
+			u_map_set(map, key(s+1), strdup(p));
 			break;
 
 		case '-': /* delete */
-			p = u_map_del(map, s+1);
+			p = u_map_del(map, key(s+1));
 			puts(p);
 			free(p);
 			break;
 
 		case '?': /* test */
-			puts(u_map_get(map, s+1) == NULL ? "no" : "yes");
+			puts(u_map_get(map, key(s+1)) == NULL ? "no" : "yes");
 			break;
 
 		case '*': /* debug */
@@ -73,7 +151,7 @@ int main(int argc, char *argv[])
 			break;
 
 		case '=': /* get */
-			p = u_map_get(map, s+1);
+			p = u_map_get(map, key(s+1));
 			puts(p ? p : "");
 			break;
 
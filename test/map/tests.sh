@@ -3,6 +3,8 @@
 function run_test {
   echo "run $1"
   ./map < $1 2>/dev/null | diff -rupN - $1.out
+  echo "run $1 (hash)"
+  ./map -h < $1 2>/dev/null | diff -rupN - $1.out
 }
 
 for i in test*.txt; do
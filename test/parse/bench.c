@@ -0,0 +1,248 @@
+/* Tethys, bench.c -- message parser benchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Parses a set of lines over and over with the parser tethys used to
+   have and with u_msg_parse, and checks that they agree on every line.
+   The lines are read from a file, one per line, or else a mix of client
+   and server traffic is made up.
+
+   usage: ./bench [lines-file [rounds]] */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "ircd.h"
+
+#define MAXLINES (1 << 20)
+
+static char *lines[MAXLINES];
+static int nlines;
+
+/* the old parser */
+/* -------------- */
+
+static char old_casemap[256];
+
+static char *ws_skip(char *s)
+{
+	while (*s && isspace(*s))
+		s++;
+	return s;
+}
+
+static char *ws_cut(char *s)
+{
+	while (*s && !isspace(*s))
+		s++;
+	if (!*s) return s;
+	*s++ = '\0';
+	return ws_skip(s);
+}
+
+static int old_parse(u_msg *msg, char *s)
+{
+	int i;
+	s = ws_skip(s);
+	if (!*s) return -1;
+
+	if (*s == ':') {
+		msg->srcstr = ++s;
+		s = ws_cut(s);
+		if (!*s) return -1;
+	} else {
+		msg->srcstr = NULL;
+	}
+
+	msg->command = s;
+	s = ws_cut(s);
+
+	for (i=0; i<U_MSG_MAXARGS; i++)
+		msg->argv[i] = NULL;
+
+	for (msg->argc=0; msg->argc<U_MSG_MAXARGS && *s;) {
+		if (*s == ':') {
+			msg->argv[msg->argc++] = ++s;
+			break;
+		}
+
+		msg->argv[msg->argc++] = s;
+		s = ws_cut(s);
+	}
+
+	for (s = msg->command; *s; s++)
+		*s = old_casemap[(uchar)*s];
+
+	return 0;
+}
+
+/* input */
+/* ----- */
+
+static void add(const char *line)
+{
+	if (nlines < MAXLINES)
+		lines[nlines++] = strdup(line);
+}
+
+static void make_lines(void)
+{
+	char buf[512];
+	int i;
+
+	for (i=0; i<100000; i++) {
+		switch (i % 8) {
+		case 0:
+			sprintf(buf, "PRIVMSG #channel%d :hello there, this "
+			        "is message number %d", i % 50, i);
+			break;
+		case 1:
+			sprintf(buf, "privmsg nick%d :hi", i);
+			break;
+		case 2:
+			sprintf(buf, "PING :irc%d.example.net", i % 3);
+			break;
+		case 3:
+			sprintf(buf, ":00AAAA%03d PRIVMSG #channel%d :relayed "
+			        "from another server", i % 1000, i % 50);
+			break;
+		case 4:
+			sprintf(buf, ":00A EUID user%d 1 1400000000 +i ~user "
+			        "host-%d.example.net 10.0.%d.%d 00AAA%04X * * "
+			        ":Some User", i, i, i >> 8 & 255, i & 255,
+			        i & 0xffff);
+			break;
+		case 5:
+			sprintf(buf, ":00A SJOIN 1400000000 #channel%d +nt "
+			        ":@00AAAAAAA 00AAAAAAB 00AAAAAAC +00AAAAAAD",
+			        i % 50);
+			break;
+		case 6:
+			sprintf(buf, "MODE #channel%d +o nick%d", i % 50, i);
+			break;
+		case 7:
+			sprintf(buf, "@time=2014-01-01T00:00:00.000Z "
+			        ":nick%d!user@host JOIN #channel%d", i, i % 50);
+			break;
+		}
+		add(buf);
+	}
+}
+
+static void read_lines(const char *path)
+{
+	char buf[4096];
+	FILE *f;
+
+	if (!(f = fopen(path, "r"))) {
+		perror(path);
+		exit(1);
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		buf[strcspn(buf, "\r\n")] = '\0';
+		add(buf);
+	}
+
+	fclose(f);
+}
+
+/* running */
+/* ------- */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, int (*parse)(u_msg*, char*), int rounds)
+{
+	char buf[4096];
+	double start, secs;
+	ulong sum = 0;
+	u_msg msg;
+	int i, r;
+
+	start = now();
+	for (r=0; r<rounds; r++) {
+		for (i=0; i<nlines; i++) {
+			/* both parsers modify the line */
+			strcpy(buf, lines[i]);
+			if (parse(&msg, buf) == 0)
+				sum += msg.argc + msg.command[0];
+		}
+	}
+	secs = now() - start;
+
+	printf("%-8s %8.1f ns/line %8.2f Mlines/s  (%lu)\n", name,
+	       secs * 1e9 / ((double)rounds * nlines),
+	       (double)rounds * nlines / secs / 1e6, sum);
+}
+
+static int same(const char *a, const char *b)
+{
+	return (!a && !b) || (a && b && !strcmp(a, b));
+}
+
+/* old and new should agree, except that tags are no longer part of the
+   command */
+static int check(void)
+{
+	char b1[4096], b2[4096];
+	u_msg m1, m2;
+	int i, j, r1, r2, bad = 0;
+
+	for (i=0; i<nlines; i++) {
+		strcpy(b1, lines[i]);
+		strcpy(b2, lines[i]);
+		r1 = old_parse(&m1, b1);
+		r2 = u_msg_parse(&m2, b2);
+
+		if (*ws_skip(lines[i]) == '@')
+			continue;
+
+		if (r1 != r2 || (r1 == 0 && (!same(m1.srcstr, m2.srcstr) ||
+		    !same(m1.command, m2.command) || m1.argc != m2.argc))) {
+			printf("differ: %s\n", lines[i]);
+			bad++;
+			continue;
+		}
+
+		for (j=0; r1 == 0 && j<U_MSG_MAXARGS; j++) {
+			if (!same(m1.argv[j], m2.argv[j])) {
+				printf("differ in arg %d: %s\n", j, lines[i]);
+				bad++;
+				break;
+			}
+		}
+	}
+
+	return bad;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+	for (i=0; i<256; i++)
+		old_casemap[i] = islower(i) ? toupper(i) : i;
+
+	if (argc > 1)
+		read_lines(argv[1]);
+	else
+		make_lines();
+
+	printf("%d lines, %d rounds\n", nlines, rounds);
+
+	if (check() > 0)
+		return 1;
+
+	run("old", old_parse, rounds);
+	run("spans", u_msg_parse, rounds);
+
+	return 0;
+}
@@ -0,0 +1,139 @@
+/* Tethys, bench.c -- timing wheel microbenchmark
+   Copyright (C) 2014 Alex Iadicicco
+
+   This file is protected under the terms contained
+   in the COPYING file in the project root */
+
+/* Gives each of N made-up connections a timer, as link.c does, and times
+   arming, rearming and cancelling them, and a stretch of ticks in which
+   every timer that goes off arms itself again. Each should cost about
+   the same per timer however many there are. For comparison, a tick is
+   also timed the way one mowgli timer per connection would cost it,
+   looking at every deadline.
+
+   A timer that goes off on the wrong tick is counted as a miss.
+
+   usage: ./bench [connections...] */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "ircd.h"
+
+#include "../../src/wheel.c"
+
+#define TICKS 3600
+
+struct fake_conn {
+	u_timer timer;
+	uint64_t deadline;
+};
+
+static u_wheel wheel;
+static ulong misses;
+/* so the scan isn't optimized away */
+static volatile ulong scan_due;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* between a minute and ten, like ping checks */
+static uint64_t delay(void)
+{
+	return 60 + random() % 540;
+}
+
+static void fire(u_timer *t, void *priv)
+{
+	struct fake_conn *fc = priv;
+
+	if (fc->deadline != wheel.now)
+		misses++;
+
+	fc->deadline = wheel.now + delay();
+	u_timer_arm(&wheel, t, fc->deadline - wheel.now);
+}
+
+static int run(int n)
+{
+	struct fake_conn *conns;
+	double start, arm, rearm, tick, cancel, scan;
+	ulong ran = 0, due = 0;
+	int i;
+
+	conns = calloc(n, sizeof(*conns));
+	u_wheel_init(&wheel, 1000);
+	misses = 0;
+	srandom(n);
+
+	start = now();
+	for (i=0; i<n; i++) {
+		u_timer_init(&conns[i].timer, fire, &conns[i]);
+		conns[i].deadline = wheel.now + delay();
+		u_timer_arm(&wheel, &conns[i].timer,
+		            conns[i].deadline - wheel.now);
+	}
+	arm = now() - start;
+
+	start = now();
+	for (i=0; i<n; i++) {
+		conns[i].deadline = wheel.now + delay();
+		u_timer_arm(&wheel, &conns[i].timer,
+		            conns[i].deadline - wheel.now);
+	}
+	rearm = now() - start;
+
+	start = now();
+	for (i=0; i<TICKS; i++)
+		ran += u_wheel_run(&wheel, wheel.now + 1);
+	tick = now() - start;
+
+	/* what walking a list of every deadline once a tick costs */
+	start = now();
+	for (i=0; i<TICKS; i++) {
+		int j;
+		for (j=0; j<n; j++)
+			due += conns[j].deadline <= wheel.now + i;
+	}
+	scan = now() - start;
+
+	start = now();
+	for (i=0; i<n; i++)
+		u_timer_cancel(&wheel, &conns[i].timer);
+	cancel = now() - start;
+
+	printf("%8d %8.1f %8.1f %8.1f %10.1f %8.2f %10.1f%s\n", n,
+	       arm * 1e9 / n, rearm * 1e9 / n, cancel * 1e9 / n,
+	       tick * 1e9 / TICKS, ran ? tick * 1e9 / ran : 0.0,
+	       scan * 1e9 / TICKS,
+	       misses || wheel.count ? "  MISSED" : "");
+
+	scan_due += due;
+	free(conns);
+
+	return misses || wheel.count;
+}
+
+int main(int argc, char *argv[])
+{
+	static int sizes[] = { 1000, 10000, 100000 };
+	int i, bad = 0;
+
+	printf("%d ticks, times in ns\n", TICKS);
+	printf("%8s %8s %8s %8s %10s %8s %10s\n", "conns", "arm",
+	       "rearm", "cancel", "wheel/tick", "/timer", "scan/tick");
+
+	if (argc > 1) {
+		for (i=1; i<argc; i++)
+			bad += run(atoi(argv[i]));
+	} else {
+		for (i=0; i<3; i++)
+			bad += run(sizes[i]);
+	}
+
+	return bad ? 1 : 0;
+}